@@ -63,6 +63,16 @@ struct io_handlers_t {
 	fp_write64 fnw64;
 };
 
+// translator statistics, see cpu_get_stats
+struct cpu_stats_t {
+	uint64_t ibtc_hits; // indirect branches that found their dst tc in the indirect branch target cache
+	uint64_t ibtc_misses; // indirect branches that had to return to the dispatcher to find their dst tc
+	uint32_t num_tc; // translated code blocks currently in the code cache
+	uint64_t code_size; // bytes of host memory used by the code of the translated code blocks in the code cache
+	uint64_t code_mem_size; // bytes of host memory reserved by the jit for the generated code
+	uint64_t disk_cache_hits; // translated code blocks loaded from the disk cache instead of being translated again
+};
+
 // forward declare
 struct cpu_t;
 
@@ -72,12 +82,17 @@ API_FUNC void cpu_free(cpu_t *cpu);
 API_FUNC lc86_status cpu_run(cpu_t *cpu);
 API_FUNC lc86_status cpu_run_until(cpu_t *cpu, uint64_t timeout_time);
 API_FUNC void cpu_set_timeout(cpu_t *cpu, uint64_t timeout_time);
+API_FUNC lc86_status cpu_run_instructions(cpu_t *cpu, uint64_t num_instr);
+API_FUNC uint64_t cpu_get_instr_count(cpu_t *cpu);
 API_FUNC void cpu_exit(cpu_t *cpu);
 API_FUNC void cpu_sync_state(cpu_t *cpu);
 API_FUNC lc86_status cpu_set_flags(cpu_t *cpu, uint32_t flags);
 API_FUNC void cpu_set_a20(cpu_t *cpu, bool closed, bool should_int = false);
 API_FUNC void cpu_raise_hw_int_line(cpu_t *cpu);
 API_FUNC void cpu_lower_hw_int_line(cpu_t *cpu);
+API_FUNC void cpu_get_stats(cpu_t *cpu, cpu_stats_t &out);
+API_FUNC lc86_status cpu_set_cache_limits(cpu_t *cpu, uint32_t max_num_tc, uint64_t max_code_size);
+API_FUNC lc86_status cpu_set_disk_cache(cpu_t *cpu, const char *dir);
 
 // register api
 API_FUNC regs_t *get_regs_ptr(cpu_t *cpu);
@@ -9,48 +9,46 @@
 #include "allocator.h"
 #include "os_mem.h"
 #include "os_exceptions.h"
+#include <cstring>
 
 
-mem_manager::block_header_t *
-mem_manager::create_pool()
+mem_manager::region_t *
+mem_manager::create_region(size_t size)
 {
-	block_header_t *start = static_cast<block_header_t *>(os_alloc(POOL_SIZE));
-	block_header_t *addr = start;
-	for (unsigned i = 0; i < BLOCKS_PER_POOL - 1; i++) {
-		addr->next = reinterpret_cast<block_header_t *>(reinterpret_cast<uint8_t *>(addr) + BLOCK_SIZE);
-		addr = addr->next;
-	}
-
-	addr->next = nullptr;
-	blocks.emplace_back(start);
-	return start;
-}
-
-void *
-mem_manager::alloc()
-{
-	if (head == nullptr) {
-		head = create_pool();
-	}
-
-	block_header_t *addr = head;
-	head = head->next;
-	return addr;
+	void *wr_addr;
+	uint8_t *addr = static_cast<uint8_t *>(os_alloc_code(size, wr_addr));
+	m_reserved_size += size;
+	region_t &region = m_regions[addr];
+	region.addr = addr;
+	region.wr_addr = static_cast<uint8_t *>(wr_addr);
+	region.size = size;
+	region.offset = 0;
+	region.num_blocks = 0;
+#if defined(__linux__)
+	region.eh_frame = os_gen_exp_info(addr, size);
+#endif
+	return &region;
 }
 
 void
-mem_manager::free(void *ptr)
+mem_manager::destroy_region(region_t *region)
 {
-	// this is necessary because we mark the code section memory as read-only after the code is written to it
-	os_protect(ptr, BLOCK_SIZE, get_mem_flags(MEM_READ | MEM_WRITE));
-	static_cast<block_header_t *>(ptr)->next = head;
-	head = static_cast<block_header_t *>(ptr);
+	m_reserved_size -= region->size;
+#if defined(_WIN64)
+	os_free_code(region->addr);
+	os_free_code(region->wr_addr);
+#elif defined(__linux__)
+	os_delete_exp_info(region->eh_frame);
+	os_free(region->addr, region->size);
+	os_free(region->wr_addr, region->size);
+#endif
+	m_regions.erase(region->addr);
 }
 
 void
 mem_manager::destroy_all_blocks()
 {
-#if defined(_WIN64) || defined(__linux__)
+#if defined(_WIN64)
 	for (const auto &eh_pair : eh_frames) {
 		os_delete_exp_info(eh_pair.second);
 	}
@@ -58,45 +56,47 @@ mem_manager::destroy_all_blocks()
 	eh_frames.clear();
 #endif
 
-#if defined(_WIN64)
-	for (auto &addr : blocks) {
-		os_free(addr);
-	}
-
-	for (auto &block : big_blocks) {
-		os_free(block.first);
-	}
-#elif defined(__linux__)
-	for (auto &addr : blocks) {
-		os_free(addr, POOL_SIZE);
-	}
-
-	for (auto &block : big_blocks) {
-		os_free(block.first, block.second);
+	while (!m_regions.empty()) {
+		destroy_region(&m_regions.begin()->second);
 	}
-#endif
 
-	big_blocks.clear();
-	blocks.clear();
-	head = nullptr;
+	m_free_regions.clear();
+	m_curr_region = nullptr;
 }
 
 mem_block
 mem_manager::allocate_sys_mem(size_t num_bytes)
 {
+	// The blocks are cache line aligned and placed back to back in the current region, instead of using at least a page each. Blocks bigger than a region
+	// get their own region
+
 	if (num_bytes == 0) {
 		return mem_block();
 	}
 
-	if (num_bytes > BLOCK_SIZE) {
-		size_t block_size = (num_bytes + PAGE_MASK) & ~PAGE_MASK;
-		void *addr = os_alloc(block_size);
-		mem_block block(addr, block_size);
-		big_blocks.emplace(addr, block_size);
-		return block;
+	num_bytes = (num_bytes + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1);
+	region_t *region;
+	if (num_bytes > REGION_SIZE) {
+		region = create_region((num_bytes + PAGE_MASK) & ~PAGE_MASK);
 	}
+	else {
+		if ((m_curr_region == nullptr) || ((m_curr_region->offset + num_bytes) > m_curr_region->size)) {
+			if (m_free_regions.empty()) {
+				m_curr_region = create_region(REGION_SIZE);
+			}
+			else {
+				m_curr_region = m_free_regions.back();
+				m_free_regions.pop_back();
+			}
+		}
+		region = m_curr_region;
+	}
+
+	mem_block block(region->addr + region->offset, region->wr_addr + region->offset, num_bytes);
+	region->offset += num_bytes;
+	++region->num_blocks;
 
-	return mem_block(alloc(), BLOCK_SIZE);
+	return block;
 }
 
 void
@@ -109,7 +109,7 @@ mem_manager::protect_sys_mem(const mem_block &block, unsigned flags)
 		return;
 	}
 
-	os_protect(addr, size, get_mem_flags(flags));
+	// the regions are mapped twice, with a writable view and an executable view that are never modified, so there is no protection to change here
 
 	if (flags & MEM_EXEC) {
 #if defined(_WIN64)
@@ -122,6 +122,23 @@ mem_manager::protect_sys_mem(const mem_block &block, unsigned flags)
 	}
 }
 
+void
+mem_manager::patch_sys_mem(void *addr, const void *data, size_t size)
+{
+	// overwrites size bytes of a block that was already protected by protect_sys_mem. The block might be running, so the caller must make sure that the
+	// code is valid both before and after the write. The write goes through the writable view of the region, so the executable view is never writable
+	auto it = m_regions.upper_bound(static_cast<uint8_t *>(addr));
+	assert(it != m_regions.begin());
+	region_t *region = &(--it)->second;
+	assert((static_cast<uint8_t *>(addr) >= region->addr) && ((static_cast<uint8_t *>(addr) + size) <= (region->addr + region->offset)));
+	std::memcpy(region->wr_addr + (static_cast<uint8_t *>(addr) - region->addr), data, size);
+#if defined(_WIN64)
+	os_flush_instr_cache(addr, size);
+#elif defined(__linux__)
+	os_flush_instr_cache(addr, static_cast<uint8_t *>(addr) + size);
+#endif
+}
+
 void
 mem_manager::release_sys_mem(void *addr)
 {
@@ -136,16 +153,24 @@ mem_manager::release_sys_mem(void *addr)
 		eh_frames.erase(main_addr);
 	}
 #endif
-	
-	if (auto it = big_blocks.find(addr); it != big_blocks.end()) {
-#if defined(_WIN64)
-		os_free(it->first);
-#elif defined(__linux__)
-		os_free(it->first, it->second);
-#endif
-		big_blocks.erase(addr);
-		return;
-	}
 
-	free(addr);
+	// find the region that holds the block, which is the last one that starts at or before addr
+	auto it = m_regions.upper_bound(static_cast<uint8_t *>(addr));
+	assert(it != m_regions.begin());
+	region_t *region = &(--it)->second;
+	assert((static_cast<uint8_t *>(addr) >= region->addr) && (static_cast<uint8_t *>(addr) < (region->addr + region->offset)));
+	assert(region->num_blocks);
+
+	if (--region->num_blocks == 0) {
+		// all the blocks of this region were released, so it can be reused from the start
+		if (region->size > REGION_SIZE) {
+			destroy_region(region);
+		}
+		else {
+			region->offset = 0;
+			if (region != m_curr_region) {
+				m_free_regions.push_back(region);
+			}
+		}
+	}
 }
@@ -9,43 +9,54 @@
 #include <vector>
 #include <map>
 
-#define POOL_SIZE        (64 * 1024)             // 64 KiB
-#define BLOCK_SIZE       (4 * 1024)              // 4 KiB
-#define BLOCKS_PER_POOL  POOL_SIZE / BLOCK_SIZE  // 16
+#define REGION_SIZE      (1024 * 1024)           // 1 MiB
+#define BLOCK_ALIGNMENT  64                      // cache line size
 
 #define MEM_READ  (1 << 0)
 #define MEM_WRITE (1 << 1)
 #define MEM_EXEC  (1 << 2)
 
 
+// addr: where the block is executed from, wr_addr: where the block is written to. They are two views of the same memory, see os_alloc_code
 struct mem_block {
 	void *addr;
+	void *wr_addr;
 	size_t size;
-	mem_block() : addr(nullptr), size(0ULL) {}
-	mem_block(void *addr, size_t size) : addr(addr), size(size) {}
+	mem_block() : addr(nullptr), wr_addr(nullptr), size(0ULL) {}
+	mem_block(void *addr, void *wr_addr, size_t size) : addr(addr), wr_addr(wr_addr), size(size) {}
 };
 
 class mem_manager {
 public:
 	mem_block allocate_sys_mem(size_t num_bytes);
 	void protect_sys_mem(const mem_block &block, unsigned flags);
+	void patch_sys_mem(void *addr, const void *data, size_t size);
 	void release_sys_mem(void *addr);
 	void destroy_all_blocks();
+	size_t get_reserved_size() const { return m_reserved_size; }
 	~mem_manager() { destroy_all_blocks(); }
 
-#if defined(_WIN64) || defined(__linux__)
+#if defined(_WIN64)
 	std::map<void *, void *> eh_frames;
 #endif
 
 private:
-	struct block_header_t {
-		block_header_t *next;
+	// a range of host memory where the blocks are placed back to back. Its memory is reused only when all of its blocks are released
+	struct region_t {
+		uint8_t *addr;
+		uint8_t *wr_addr;
+		size_t size;
+		size_t offset; // offset of the next block
+		size_t num_blocks; // num of blocks not yet released
+#if defined(__linux__)
+		void *eh_frame; // describes how to unwind all the blocks in the region
+#endif
 	};
-	block_header_t *head = nullptr;
-	std::vector<void *> blocks;
-	std::map<void *, size_t> big_blocks;
+	std::map<uint8_t *, region_t> m_regions; // keyed by the start address of the region
+	std::vector<region_t *> m_free_regions; // regions with no blocks, which can be reused
+	region_t *m_curr_region = nullptr; // region where the next block is placed
+	size_t m_reserved_size = 0; // total size of the regions
 
-	block_header_t *create_pool();
-	void *alloc();
-	void free(void *ptr);
+	region_t *create_region(size_t size);
+	void destroy_region(region_t *region);
 };
@@ -39,7 +39,7 @@ cpu_check_watchpoint_overlap(cpu_t *cpu, addr_t addr, size_t size, int idx)
 	return (watch_addr <= end) && (addr <= watch_end);
 }
 
-static void
+static bool
 cpu_check_watchpoints(cpu_t *cpu, addr_t addr, int dr_idx, int type, uint32_t eip)
 {
 	bool match = false;
@@ -64,26 +64,66 @@ cpu_check_watchpoints(cpu_t *cpu, addr_t addr, int dr_idx, int type, uint32_t ei
 		cpu->cpu_ctx.exp_info.exp_data.code = 0;
 		cpu->cpu_ctx.exp_info.exp_data.idx = EXP_DB;
 		cpu->cpu_ctx.exp_info.exp_data.eip = eip;
-		throw host_exp_t::db_exp;
 	}
+
+	return match;
 }
 
-void
-cpu_check_data_watchpoints(cpu_t *cpu, addr_t addr, size_t size, int type, uint32_t eip)
+// NOTE: when raise_host_exp is false, a debug trap is not thrown, and it's only recorded in exp_data. In this case, the return value tells if it happened
+template<bool raise_host_exp>
+bool cpu_check_data_watchpoints(cpu_t *cpu, addr_t addr, size_t size, int type, uint32_t eip)
 {
 	for (const auto &wp : cpu->wp_data) {
 		if ((wp.watch_addr <= (addr + size - 1)) && (addr <= wp.watch_end)) [[unlikely]] {
-			cpu_check_watchpoints(cpu, addr, wp.dr_idx, type, eip);
+			if (cpu_check_watchpoints(cpu, addr, wp.dr_idx, type, eip)) {
+				if constexpr (raise_host_exp) {
+					throw host_exp_t::db_exp;
+				}
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool
+cpu_check_page_watchpoints(cpu_t *cpu, addr_t addr)
+{
+	// this reads the debug registers instead of wp_data, because the debugger temporarily swaps out wp_data when it accesses the guest memory
+	addr_t page_start = addr & ~PAGE_MASK;
+	addr_t page_end = page_start + PAGE_MASK;
+	for (int idx = 0; idx < 4; ++idx) {
+		if (cpu_check_watchpoint_enabled(cpu, idx) && (cpu_get_watchpoint_type(cpu, idx) != DR7_TYPE_IO_RW)) {
+			size_t watch_len = cpu_get_watchpoint_lenght(cpu, idx);
+			addr_t watch_addr = cpu->cpu_ctx.regs.dr[idx] & ~(watch_len - 1);
+			if ((watch_addr <= page_end) && (page_start <= (watch_addr + watch_len - 1))) {
+				return true;
+			}
 		}
 	}
+
+	return false;
 }
 
-void
-cpu_check_io_watchpoints(cpu_t *cpu, port_t port, size_t size, int type, uint32_t eip)
+template<bool raise_host_exp>
+bool cpu_check_io_watchpoints(cpu_t *cpu, port_t port, size_t size, int type, uint32_t eip)
 {
 	for (const auto &wp : cpu->wp_io) {
 		if ((wp.watch_addr <= (port + size - 1)) && (port <= wp.watch_end)) [[unlikely]] {
-			cpu_check_watchpoints(cpu, port, wp.dr_idx, type, eip);
+			if (cpu_check_watchpoints(cpu, port, wp.dr_idx, type, eip)) {
+				if constexpr (raise_host_exp) {
+					throw host_exp_t::db_exp;
+				}
+				return true;
+			}
 		}
 	}
+
+	return false;
 }
+
+template bool cpu_check_data_watchpoints<true>(cpu_t *cpu, addr_t addr, size_t size, int type, uint32_t eip);
+template bool cpu_check_data_watchpoints<false>(cpu_t *cpu, addr_t addr, size_t size, int type, uint32_t eip);
+template bool cpu_check_io_watchpoints<true>(cpu_t *cpu, port_t port, size_t size, int type, uint32_t eip);
+template bool cpu_check_io_watchpoints<false>(cpu_t *cpu, port_t port, size_t size, int type, uint32_t eip);
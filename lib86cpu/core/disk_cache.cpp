@@ -0,0 +1,267 @@
+/*
+ * persistent cache of translated code
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#include "disk_cache.h"
+#include "memory_management.h"
+#include "x64/jit.h"
+#include <algorithm>
+#include <fstream>
+#include <random>
+
+// Only the tc's of the baseline tier of the jit are saved: interpreted tc's are cheap to create again, optimized tc's depend on the profile of the current
+// run, and hooks and tc's that cross a page are never in the code cache for long. The file starts with a header, followed by the tc's. Code generated by
+// another build of lib86cpu is discarded, because it calls the helpers at different addresses.
+// Other processes can use the same file at the same time, so it's never modified in place. Instead, all the tc's are written to a new file with a unique
+// name, which then atomically replaces the old one. When two processes do this, the tc's of the one that writes last are kept
+
+
+struct disk_file_hdr_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t fingerprint;
+};
+
+static uint64_t
+tc_disk_cache_fingerprint(cpu_t *cpu)
+{
+	// the jitted code also depends on these flags
+	uint32_t cpu_flags = cpu->cpu_flags & (CPU_DBG_PRESENT | CPU_ABORT_ON_HLT);
+	return hash_bytes(&cpu_flags, sizeof(cpu_flags), lc86_jit::get_code_fingerprint());
+}
+
+static bool
+tc_disk_cache_hash(cpu_t *cpu, addr_t pc, uint32_t size, uint64_t *hash)
+{
+	// hashes the guest code at pc. This fails if the code is not in ram or rom, which can happen when the memory map of the guest changed
+	std::vector<uint8_t> &buff = cpu->disk_cache->buff;
+	buff.resize(size);
+	if (as_ram_dispatch_read(cpu, pc, size, as_memory_search_addr(cpu, pc), buff.data()) != size) {
+		return false;
+	}
+
+	*hash = hash_bytes(buff.data(), size);
+	return true;
+}
+
+static bool
+tc_disk_cache_read_tc(std::ifstream &ifs, disk_tc_t &disk_tc)
+{
+	// returns false if the record is truncated or corrupted
+	if (!ifs.read(reinterpret_cast<char *>(&disk_tc.hdr), sizeof(disk_tc_hdr_t))) {
+		return false;
+	}
+
+	const disk_tc_hdr_t &hdr = disk_tc.hdr;
+	if ((hdr.size == 0) || (((hdr.pc & PAGE_MASK) + hdr.size) > PAGE_SIZE) || (hdr.code_size <= 16) || (hdr.code_size > REGION_SIZE) ||
+		(hdr.num_relocs > hdr.code_size / 8) || (hdr.jmp_patch[0] > (hdr.code_size - 4)) || (hdr.jmp_patch[1] > (hdr.code_size - 4)) ||
+		(hdr.instr_count > hdr.size)) {
+		return false;
+	}
+
+	disk_tc.code.resize(hdr.code_size);
+	disk_tc.relocs.resize(hdr.num_relocs);
+	disk_tc.instr_len.resize((hdr.guest_flags & HFLG_INSTR_COUNT) ? hdr.instr_count : 0);
+	if (!ifs.read(reinterpret_cast<char *>(disk_tc.code.data()), hdr.code_size) ||
+		!ifs.read(reinterpret_cast<char *>(disk_tc.relocs.data()), hdr.num_relocs * sizeof(jit_reloc_t)) ||
+		!ifs.read(reinterpret_cast<char *>(disk_tc.instr_len.data()), disk_tc.instr_len.size())) {
+		return false;
+	}
+
+	return std::all_of(disk_tc.relocs.begin(), disk_tc.relocs.end(), [&hdr](const jit_reloc_t &reloc) {
+		return ((reloc.offset + 8) <= hdr.code_size) && (reloc.type <= jit_reloc_type::image);
+		});
+}
+
+static void
+tc_disk_cache_write(disk_cache_t *disk_cache)
+{
+	// errors are ignored, since the tc's can still be translated again in the next runs
+	std::error_code ec;
+	std::filesystem::path tmp_path = disk_cache->path;
+	tmp_path += "." + std::to_string(std::random_device()()) + ".tmp";
+	std::ofstream ofs(tmp_path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	if (!ofs.is_open()) {
+		return;
+	}
+
+	disk_file_hdr_t file_hdr{ DISK_CACHE_MAGIC, DISK_CACHE_VERSION, disk_cache->fingerprint };
+	ofs.write(reinterpret_cast<const char *>(&file_hdr), sizeof(disk_file_hdr_t));
+	for (const auto &[pc, disk_tc] : disk_cache->tcs) {
+		ofs.write(reinterpret_cast<const char *>(&disk_tc.hdr), sizeof(disk_tc_hdr_t));
+		ofs.write(reinterpret_cast<const char *>(disk_tc.code.data()), disk_tc.hdr.code_size);
+		ofs.write(reinterpret_cast<const char *>(disk_tc.relocs.data()), disk_tc.hdr.num_relocs * sizeof(jit_reloc_t));
+		ofs.write(reinterpret_cast<const char *>(disk_tc.instr_len.data()), disk_tc.instr_len.size());
+	}
+	ofs.close();
+
+	if (!ofs) {
+		std::filesystem::remove(tmp_path, ec);
+		return;
+	}
+
+	std::filesystem::rename(tmp_path, disk_cache->path, ec);
+	if (ec) {
+		std::filesystem::remove(tmp_path, ec);
+		return;
+	}
+
+	disk_cache->num_unsaved = 0;
+}
+
+void
+tc_disk_cache_close(cpu_t *cpu)
+{
+	// writes the tc's that are not in the file yet, and disables the disk cache
+	if (cpu->disk_cache && cpu->disk_cache->num_unsaved) {
+		tc_disk_cache_write(cpu->disk_cache.get());
+	}
+	cpu->disk_cache.reset();
+}
+
+lc86_status
+tc_disk_cache_open(cpu_t *cpu, const char *dir)
+{
+	tc_disk_cache_close(cpu);
+	if (dir == nullptr) {
+		return lc86_status::success;
+	}
+
+	std::error_code ec;
+	std::filesystem::path path = std::filesystem::path(dir) / DISK_CACHE_FILE;
+	if (!std::filesystem::is_directory(dir, ec)) {
+		return lc86_status::invalid_parameter;
+	}
+
+	std::unique_ptr<disk_cache_t> disk_cache(new disk_cache_t);
+	disk_cache->path = path;
+	disk_cache->fingerprint = tc_disk_cache_fingerprint(cpu);
+	disk_cache->hits = 0;
+	disk_cache->num_unsaved = 0;
+
+	// if the file doesn't exist yet or it was created by another build of lib86cpu, then it's replaced by a new one the first time it's written
+	std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary);
+	if (ifs.is_open()) {
+		disk_file_hdr_t file_hdr;
+		if (ifs.read(reinterpret_cast<char *>(&file_hdr), sizeof(disk_file_hdr_t)) && (file_hdr.magic == DISK_CACHE_MAGIC) &&
+			(file_hdr.version == DISK_CACHE_VERSION) && (file_hdr.fingerprint == disk_cache->fingerprint)) {
+			disk_tc_t disk_tc;
+			while (tc_disk_cache_read_tc(ifs, disk_tc)) {
+				disk_cache->tcs.emplace(disk_tc.hdr.pc, std::move(disk_tc));
+			}
+		}
+	}
+
+	cpu->disk_cache = std::move(disk_cache);
+	return lc86_status::success;
+}
+
+static bool
+tc_disk_cache_can_persist(cpu_t *cpu)
+{
+	return cpu->disk_cache && !(cpu->disas_ctx.flags & DISAS_FLG_ONE_INSTR) && !(cpu->cpu_ctx.regs.dr[7] & DR7_EN_MASK) &&
+		!cpu->hook_map.contains(cpu->disas_ctx.virt_pc);
+}
+
+bool
+tc_disk_cache_load(cpu_t *cpu)
+{
+	// loads the code of cpu->tc from the disk cache, if a previous run translated the same guest code with the same cpu state. The caller must have already
+	// prepared the disas ctx
+
+	if (!tc_disk_cache_can_persist(cpu)) {
+		return false;
+	}
+
+	addr_t pc = cpu->disas_ctx.pc;
+	addr_t cs_base = cpu->cpu_ctx.regs.cs_hidden.base;
+	uint32_t guest_flags = (cpu->cpu_ctx.hflags & HFLG_CONST) | (cpu->cpu_ctx.regs.eflags & EFLAGS_CONST);
+	uint32_t hashed_size = 0;
+	uint64_t hash = 0;
+	auto [it, end] = cpu->disk_cache->tcs.equal_range(pc);
+	for (; it != end; ++it) {
+		const disk_tc_t &disk_tc = it->second;
+		const disk_tc_hdr_t &hdr = disk_tc.hdr;
+		if ((hdr.virt_pc != cpu->disas_ctx.virt_pc) || (hdr.cs_base != cs_base) || (hdr.cs != cpu->cpu_ctx.regs.cs) || (hdr.guest_flags != guest_flags) ||
+			(hdr.disas_flags != cpu->disas_ctx.flags)) {
+			continue;
+		}
+
+		if (hdr.size != hashed_size) {
+			if (!tc_disk_cache_hash(cpu, pc, hdr.size, &hash)) {
+				continue;
+			}
+			hashed_size = hdr.size;
+		}
+
+		if (hdr.src_hash != hash) {
+			continue;
+		}
+
+		translated_code_t *tc = cpu->tc;
+		tc->flags = hdr.flags;
+		tc->size = hdr.size;
+		tc->instr_count = hdr.instr_count;
+		tc->instr_len = disk_tc.instr_len;
+		tc->jmp_patch[0] = hdr.jmp_patch[0];
+		tc->jmp_patch[1] = hdr.jmp_patch[1];
+		cpu->jit->load_code_block(disk_tc.code.data(), hdr.code_size, disk_tc.relocs);
+		// the tc was not translated, so the code of its page might not be tracked yet
+		cpu->smc.set(pc >> PAGE_SHIFT);
+		++cpu->disk_cache->hits;
+		return true;
+	}
+
+	return false;
+}
+
+void
+tc_disk_cache_save(cpu_t *cpu)
+{
+	// appends cpu->tc to the disk cache. This must be called right after gen_code_block, while the jit still holds the code of the tc
+
+	// self checking tc's compare the guest code through the ram offset of their page, which depends on the memory regions of the guest
+	if (!tc_disk_cache_can_persist(cpu) || cpu->jit->is_optimizing() || (cpu->disas_ctx.flags & DISAS_FLG_PAGE_CROSS) || (cpu->tc->flags & TC_FLG_SELF_CHECK)) {
+		return;
+	}
+
+	translated_code_t *tc = cpu->tc;
+	disk_tc_t disk_tc{};
+	disk_tc_hdr_t &hdr = disk_tc.hdr;
+	if (!tc_disk_cache_hash(cpu, tc->pc, tc->size, &hdr.src_hash)) {
+		return;
+	}
+
+	// a tc evicted from the code cache is translated again later, so don't save it twice
+	auto [it, end] = cpu->disk_cache->tcs.equal_range(tc->pc);
+	for (; it != end; ++it) {
+		const disk_tc_hdr_t &other = it->second.hdr;
+		if ((other.virt_pc == tc->virt_pc) && (other.cs_base == tc->cs_base) && (other.cs == cpu->cpu_ctx.regs.cs) && (other.guest_flags == tc->guest_flags) &&
+			(other.disas_flags == cpu->disas_ctx.flags) && (other.size == tc->size) && (other.src_hash == hdr.src_hash)) {
+			return;
+		}
+	}
+
+	cpu->jit->get_code_image(disk_tc.code, disk_tc.relocs);
+	hdr.pc = tc->pc;
+	hdr.virt_pc = tc->virt_pc;
+	hdr.cs_base = tc->cs_base;
+	hdr.guest_flags = tc->guest_flags;
+	hdr.cs = cpu->cpu_ctx.regs.cs;
+	hdr.disas_flags = cpu->disas_ctx.flags;
+	hdr.flags = tc->flags & ~TC_FLG_JMP_TAKEN;
+	hdr.size = tc->size;
+	hdr.instr_count = tc->instr_count;
+	hdr.jmp_patch[0] = tc->jmp_patch[0];
+	hdr.jmp_patch[1] = tc->jmp_patch[1];
+	hdr.code_size = static_cast<uint32_t>(disk_tc.code.size());
+	hdr.num_relocs = static_cast<uint32_t>(disk_tc.relocs.size());
+	disk_tc.instr_len = tc->instr_len;
+
+	cpu->disk_cache->tcs.emplace(hdr.pc, std::move(disk_tc));
+	if (++cpu->disk_cache->num_unsaved == DISK_CACHE_WRITE_NUM) {
+		tc_disk_cache_write(cpu->disk_cache.get());
+	}
+}
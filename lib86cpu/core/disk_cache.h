@@ -0,0 +1,57 @@
+/*
+ * persistent cache of translated code
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#pragma once
+
+#include "lib86cpu_priv.h"
+#include "emitter_common.h"
+#include <filesystem>
+#include <unordered_map>
+
+#define DISK_CACHE_FILE     "lib86cpu_tc.bin"
+#define DISK_CACHE_MAGIC    0x4336384C // "L86C"
+#define DISK_CACHE_WRITE_NUM 4096 // num of new tc's after which the file is written again, so that they are not all lost if the process is killed
+#define DISK_CACHE_VERSION  3 // increment when the format of the file or the code emitted by the jit changes
+
+
+// key and metadata of a tc in the disk cache. In the file, this is followed by code_size bytes of code and num_relocs jit_reloc_t, and then by the
+// instr_count lengths of the instr if the tc counts them (HFLG_INSTR_COUNT in guest_flags)
+struct disk_tc_hdr_t {
+	addr_t pc;
+	addr_t virt_pc;
+	addr_t cs_base;
+	uint32_t guest_flags;
+	uint16_t cs; // the selector is used by the code of some instr, and the same base can be reached from different selectors in protected mode
+	uint16_t disas_flags;
+	uint32_t flags;
+	uint32_t size;
+	uint32_t instr_count;
+	uint32_t jmp_patch[2];
+	uint64_t src_hash; // hash of the guest code translated by the tc
+	uint32_t code_size;
+	uint32_t num_relocs;
+};
+
+struct disk_tc_t {
+	disk_tc_hdr_t hdr;
+	std::vector<uint8_t> code;
+	std::vector<jit_reloc_t> relocs;
+	std::vector<uint8_t> instr_len;
+};
+
+struct disk_cache_t {
+	std::filesystem::path path;
+	uint64_t fingerprint;
+	std::unordered_multimap<addr_t, disk_tc_t> tcs; // keyed by the physical pc, these are all written to the file
+	std::vector<uint8_t> buff; // holds the guest code being hashed
+	uint64_t hits;
+	uint32_t num_unsaved; // num of tc's in tcs that are not in the file yet
+};
+
+lc86_status tc_disk_cache_open(cpu_t *cpu, const char *dir);
+void tc_disk_cache_close(cpu_t *cpu);
+bool tc_disk_cache_load(cpu_t *cpu);
+void tc_disk_cache_save(cpu_t *cpu);
@@ -20,6 +20,18 @@
 #define CPU_CTX_INT          offsetof(cpu_ctx_t, int_pending)
 #define CPU_CTX_EXIT         offsetof(cpu_ctx_t, exit_requested)
 #define CPU_CTX_HALTED       offsetof(cpu_ctx_t, is_halted)
+#define CPU_CTX_EXP_PENDING  offsetof(cpu_ctx_t, exp_pending)
+#define CPU_CTX_TLB_GEN      offsetof(cpu_ctx_t, tlb_gen)
+#define CPU_CTX_TIMER_BUDGET offsetof(cpu_ctx_t, timer_budget)
+#define CPU_CTX_INSTR_BUDGET offsetof(cpu_ctx_t, instr_budget)
+#define CPU_CTX_INSTR_TC     offsetof(cpu_ctx_t, instr_tc)
+#define CPU_CTX_RAM          offsetof(cpu_ctx_t, ram)
+#define CPU_CTX_DTLB         offsetof(cpu_ctx_t, dtlb)
+#define CPU_CTX_RS_TC        offsetof(cpu_ctx_t, ret_stack.call_tc)
+#define CPU_CTX_RS_PC        offsetof(cpu_ctx_t, ret_stack.ret_pc)
+#define CPU_CTX_RS_IDX       offsetof(cpu_ctx_t, ret_stack.idx)
+#define CPU_CTX_IBTC         offsetof(cpu_ctx_t, ibtc)
+#define CPU_CTX_IBTC_HITS    offsetof(cpu_ctx_t, ibtc_hits)
 
 #define CPU_CTX_EAX          offsetof(cpu_ctx_t, regs.eax)
 #define CPU_CTX_ECX          offsetof(cpu_ctx_t, regs.ecx)
@@ -125,12 +137,31 @@
 #define CPU_EXP_IDX          offsetof(cpu_ctx_t, exp_info.exp_data.idx)
 #define CPU_EXP_EIP          offsetof(cpu_ctx_t, exp_info.exp_data.eip)
 
+#define TLB_ENTRY            offsetof(tlb_t, entry)
+#define TLB_REGION           offsetof(tlb_t, region)
+#define REGION_BUFF_OFF      offsetof(memory_region_t<addr_t>, buff_off_start)
+
 #define REG_off(reg) get_reg_offset(reg)
 #define REG_idx(reg) get_reg_idx(reg)
 #define REG_pair(reg) get_reg_pair(reg)
 
 
+// a host pointer embedded in the code of a tc, recorded so that the disk cache can fix it up when the code is loaded by another process
+enum class jit_reloc_type : uint32_t {
+	cpu,   // addend is an offset in cpu_t
+	tc,    // addend is an offset in the tc that holds the code
+	image, // addend is an offset from the code or static data of lib86cpu
+};
+
+struct jit_reloc_t {
+	uint32_t offset; // offset of the 64 bit immediate from the start of the code block
+	jit_reloc_type type;
+	int64_t addend;
+};
+
 entry_t JIT_API link_indirect_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
+entry_t JIT_API link_ret_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
+void JIT_API tc_self_check_failed(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
 size_t get_reg_offset(ZydisRegister reg);
 size_t get_seg_prfx_offset(ZydisDecodedInstruction *instr);
 int get_reg_idx(ZydisRegister reg);
@@ -153,6 +184,8 @@ inline constexpr auto all_callable_funcs = std::make_tuple(
 	cpu_timer_helper,
 	cpu_do_int,
 	link_indirect_handler,
+	link_ret_handler,
+	tc_self_check_failed,
 	mem_read_helper<uint32_t>,
 	mem_read_helper<uint16_t>,
 	mem_read_helper<uint8_t>,
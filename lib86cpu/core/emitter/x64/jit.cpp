@@ -6,6 +6,7 @@
 
 #include "jit.h"
 #include "support.h"
+#include "disk_cache.h"
 #include "instructions.h"
 #include "debugger.h"
 #include "clock.h"
@@ -213,6 +214,9 @@ get_jit_stack_required()
 	return tot_arg_size;
 }
 
+// the fde in linux/os_exceptions.cpp writes the offset of the CFA after the prolog of main() as a single byte ULEB128, so it must be smaller than 128
+static_assert((get_jit_stack_required() + 16) < 128);
+
 static constexpr size_t
 get_jit_reg_args_size()
 {
@@ -285,6 +289,23 @@ get_reg_arg_offset()
 
 static_assert((LOCAL_VARS_off(0) & 15) == 0); // must be 16 byte aligned so that sse can work on it in lc86_jit::load_mem
 
+// guest registers that can be kept in host registers for the duration of a tc. The host registers are non-volatile, so their original value is saved
+// in the shadow area of main() before they are used, see lc86_jit::gen_reg_cache_begin
+struct reg_cache_entry {
+	ZydisRegister guest_reg;
+	size_t guest_off;
+	x86::Gp host_reg;
+	size_t home_off;
+};
+
+static const reg_cache_entry reg_cache_map[] = {
+	{ ZYDIS_REGISTER_EAX, CPU_CTX_EAX, x86::r12, get_jit_stack_required() + 8 + RCX_HOME_off },
+	{ ZYDIS_REGISTER_ECX, CPU_CTX_ECX, x86::r13, get_jit_stack_required() + 8 + RDX_HOME_off },
+	{ ZYDIS_REGISTER_ESI, CPU_CTX_ESI, x86::r14, get_jit_stack_required() + 8 + R8_HOME_off },
+	{ ZYDIS_REGISTER_EDI, CPU_CTX_EDI, x86::r15, get_jit_stack_required() + 8 + R9_HOME_off },
+};
+constexpr unsigned reg_cache_num = std::size(reg_cache_map);
+
 // [reg]
 #define MEM8(reg)  x86::byte_ptr(reg)
 #define MEM16(reg) x86::word_ptr(reg)
@@ -357,7 +378,7 @@ static_assert((LOCAL_VARS_off(0) & 15) == 0); // must be 16 byte aligned so that
 #define IMUL3(dst, src, imm) m_a.imul(dst, src, imm)
 #define DIV(op) m_a.div(op)
 #define IDIV(op) m_a.idiv(op)
-#define XCHG(dst, src) m_a.xchg(dst, src);
+#define XCHG(dst, src) m_a.xchg(dst, src)
 #define CLC() m_a.clc()
 #define STC() m_a.stc()
 #define CALL(addr) m_a.call(addr)
@@ -400,18 +421,18 @@ static_assert((LOCAL_VARS_off(0) & 15) == 0); // must be 16 byte aligned so that
 
 #define MOVAPS(dst, src) m_a.movaps(dst, src)
 
-#define LD_R8L(dst, reg_offset) MOV(dst, MEMD8(RCX, reg_offset))
-#define LD_R8H(dst, reg_offset) MOV(dst, MEMD8(RCX, reg_offset + 1))
-#define LD_R16(dst, reg_offset) MOV(dst, MEMD16(RCX, reg_offset))
-#define LD_R32(dst, reg_offset) MOV(dst, MEMD32(RCX, reg_offset))
+#define LD_R8L(dst, reg_offset) load_reg(dst, reg_offset, SIZE8)
+#define LD_R8H(dst, reg_offset) load_reg(dst, reg_offset + 1, SIZE8)
+#define LD_R16(dst, reg_offset) load_reg(dst, reg_offset, SIZE16)
+#define LD_R32(dst, reg_offset) load_reg(dst, reg_offset, SIZE32)
 #define LD_REG_val(dst, reg_offset, size) load_reg(dst, reg_offset, size)
 #define LD_SEG(dst, seg_offset) MOV(dst, MEMD16(RCX, seg_offset))
 #define LD_SEG_BASE(dst, seg_offset) MOV(dst, MEMD32(RCX, seg_offset + seg_base_offset))
 #define LD_SEG_LIMIT(dst, seg_offset) MOV(dst, MEMD32(RCX, seg_offset + seg_limit_offset))
-#define ST_R8L(reg_offset, src) MOV(MEMD8(RCX, reg_offset), src)
-#define ST_R8H(reg_offset, src) MOV(MEMD8(RCX, reg_offset + 1), src)
-#define ST_R16(reg_offset, src) MOV(MEMD16(RCX, reg_offset), src)
-#define ST_R32(reg_offset, src) MOV(MEMD32(RCX, reg_offset), src)
+#define ST_R8L(reg_offset, src) store_reg(src, reg_offset, SIZE8)
+#define ST_R8H(reg_offset, src) store_reg(src, reg_offset + 1, SIZE8)
+#define ST_R16(reg_offset, src) store_reg(src, reg_offset, SIZE16)
+#define ST_R32(reg_offset, src) store_reg(src, reg_offset, SIZE32)
 #define ST_REG_val(val, reg_offset, size) store_reg(val, reg_offset, size)
 #define ST_SEG(seg_offset, val) MOV(MEMD16(RCX, seg_offset), val)
 #define ST_SEG_BASE(seg_offset, val) MOV(MEMD32(RCX, seg_offset + seg_base_offset), val)
@@ -428,12 +449,12 @@ static_assert((LOCAL_VARS_off(0) & 15) == 0); // must be 16 byte aligned so that
 #define LD_IO() load_io(m_cpu->size_mode)
 #define ST_IO() store_io(m_cpu->size_mode)
 
-#define LD_CF(dst) MOV(dst, MEMD32(RCX, CPU_CTX_EFLAGS_AUX)); AND(dst, 0x80000000)
+#define LD_CF(dst) do { MOV(dst, MEMD32(RCX, CPU_CTX_EFLAGS_AUX)); AND(dst, 0x80000000); } while (0)
 #define LD_OF(dst, aux) ld_of(dst, aux)
 #define LD_ZF(dst) MOV(dst, MEMD32(RCX, CPU_CTX_EFLAGS_RES))
 #define LD_SF(res_dst, aux) ld_sf(res_dst, aux)
 #define LD_PF(dst, res, aux) ld_pf(dst, res, aux)
-#define LD_AF(dst) MOV(dst, MEMD32(RCX, CPU_CTX_EFLAGS_AUX)); AND(dst, 8)
+#define LD_AF(dst) do { MOV(dst, MEMD32(RCX, CPU_CTX_EFLAGS_AUX)); AND(dst, 8); } while (0)
 
 #define RAISEin_no_param_t() gen_raise_exp_inline<true>()
 #define RAISEin_no_param_f() gen_raise_exp_inline<false>()
@@ -447,14 +468,26 @@ static_assert((LOCAL_VARS_off(0) & 15) == 0); // must be 16 byte aligned so that
 #define GET_OP(op) get_operand(instr, op)
 #define GET_IMM() get_immediate_op(instr, OPNUM_SRC)
 
-#define RELOAD_RCX_CTX() MOV(RCX, &m_cpu->cpu_ctx)
+#define MOV_PTR(dst, ptr) gen_mov_ptr(dst, ptr)
+#define RELOAD_RCX_CTX() MOV_PTR(RCX, &m_cpu->cpu_ctx)
 #define RESTORE_FPU_CTX() FLDCW(MEMD16(RSP, LOCAL_VARS_off(5)))
-#define CALL_F(func) MOV(RAX, func); CALL(RAX); RELOAD_RCX_CTX()
+#define CALL_F(func) do { gen_reg_cache_flush(); MOV_PTR(RAX, func); CALL(RAX); RELOAD_RCX_CTX(); gen_reg_cache_reload(); } while (0)
+#define CALL_MEM_F(func) do { gen_reg_cache_flush(); MOV_PTR(RAX, func); CALL(RAX); RELOAD_RCX_CTX(); gen_mem_fault_check(); gen_reg_cache_reload(); } while (0)
 
 
+static uintptr_t
+get_image_base()
+{
+	// the disk cache only loads code generated by the same build of lib86cpu, so any function of the library can be the base of the image relocations
+	return reinterpret_cast<uintptr_t>(&cpu_raise_exception<>);
+}
+
 lc86_jit::lc86_jit(cpu_t *cpu)
 {
 	m_cpu = cpu;
+	m_reg_saved = m_reg_loaded = m_reg_dirty = 0;
+	m_flags_dead = false;
+	m_optimize = false;
 	_environment = Environment::host();
 	_environment.setObjectFormat(ObjectFormat::kJIT);
 	gen_aux_funcs();
@@ -466,12 +499,18 @@ lc86_jit::start_new_session()
 	m_code.reset();
 	m_code.init(_environment);
 	m_code.attach(m_a.as<BaseEmitter>());
+	m_mem_fault = Label();
+	m_self_check = Label();
+	m_loop_head = Label();
+	m_instr_count_off = 0;
+	m_relocs.clear();
 }
 
 void
 lc86_jit::gen_code_block()
 {
-	translated_code_t *tc = m_cpu->tc;
+	gen_mem_fault_stub();
+	gen_self_check_stub();
 
 	if (auto err = m_code.flatten()) {
 		std::string err_str("Asmjit failed at flatten() with the error ");
@@ -495,11 +534,6 @@ lc86_jit::gen_code_block()
 	// when an exception is thrown. Note that the sections need to be DWORD aligned
 	estimated_code_size += 24;
 	estimated_code_size = (estimated_code_size + 3) & ~3;
-#elif defined (__linux__)
-	// Increase estimated_code_size by 24 + 40 + 4, to accomodate the .eh_frame section required to unwind the function
-	// when an exception is thrown. Note that the section needs to be 8 byte aligned
-	estimated_code_size += (24 + 40 + 4);
-	estimated_code_size = (estimated_code_size + 7) & ~7;
 #endif
 
 	auto block = m_mem.allocate_sys_mem(estimated_code_size);
@@ -517,13 +551,64 @@ lc86_jit::gen_code_block()
 	size_t buff_size = static_cast<size_t>(section->bufferSize());
 
 	assert(offset + buff_size <= estimated_code_size);
+	std::memcpy(static_cast<uint8_t *>(block.wr_addr) + offset, section->data(), buff_size);
+
+	// According to asmjit's source code, the code size can decrease after the relocation above, so we need to query it again
+	finish_code_block(block, offset, m_code.codeSize());
+}
+
+void
+lc86_jit::load_code_block(const uint8_t *code, uint32_t code_size, const std::vector<jit_reloc_t> &relocs)
+{
+	// same as gen_code_block, but the code was generated by another process and comes from the disk cache. The host pointers in it are fixed up for this
+	// process and for the current tc with relocs
+
+	size_t estimated_code_size = code_size;
+#if defined(_WIN64)
+	estimated_code_size += 24;
+	estimated_code_size = (estimated_code_size + 3) & ~3;
+#endif
+
+	auto block = m_mem.allocate_sys_mem(estimated_code_size);
+	uint8_t *wr_code = static_cast<uint8_t *>(block.wr_addr);
+	std::memcpy(wr_code, code, code_size);
+
+	for (const auto &reloc : relocs) {
+		uint64_t addr;
+		switch (reloc.type)
+		{
+		case jit_reloc_type::cpu:
+			addr = reinterpret_cast<uintptr_t>(m_cpu) + reloc.addend;
+			break;
+
+		case jit_reloc_type::tc:
+			addr = reinterpret_cast<uintptr_t>(m_cpu->tc) + reloc.addend;
+			break;
+
+		case jit_reloc_type::image:
+			addr = get_image_base() + reloc.addend;
+			break;
+
+		default:
+			LIB86CPU_ABORT();
+		}
+
+		assert(reloc.offset + 8 <= code_size);
+		std::memcpy(wr_code + reloc.offset, &addr, 8);
+	}
+
+	finish_code_block(block, 0, code_size);
+}
+
+void
+lc86_jit::finish_code_block(mem_block &block, size_t offset, size_t code_size)
+{
+	translated_code_t *tc = m_cpu->tc;
 	uint8_t *exit_offset = static_cast<uint8_t *>(block.addr) + offset;
 	uint8_t *main_offset = exit_offset + 16;
-	std::memcpy(exit_offset, section->data(), buff_size);
 
-#if defined(_WIN64) || defined(__linux__)
-	// According to asmjit's source code, the code size can decrease after the relocation above, so we need to query it again
-	gen_exception_info(main_offset, m_code.codeSize() - 16);
+#if defined(_WIN64)
+	gen_exception_info(main_offset, static_cast<uint8_t *>(block.wr_addr) + offset + 16, code_size - 16);
 #endif
 
 	// This code block is complete, so protect and flush the instruction cache now
@@ -531,6 +616,79 @@ lc86_jit::gen_code_block()
 
 	tc->ptr_code = reinterpret_cast<entry_t>(main_offset);
 	tc->jmp_offset[0] = tc->jmp_offset[1] = tc->jmp_offset[2] = reinterpret_cast<entry_t>(exit_offset);
+	tc->code_size = static_cast<uint32_t>(block.size);
+}
+
+void
+lc86_jit::get_code_image(std::vector<uint8_t> &code, std::vector<jit_reloc_t> &relocs) const
+{
+	// returns the code of the tc just emitted by gen_code_block, which stays in the CodeHolder until the next session starts
+	const Section *section = m_code.textSection();
+	code.assign(section->data(), section->data() + section->bufferSize());
+	relocs = m_relocs;
+}
+
+uint64_t
+lc86_jit::get_code_fingerprint()
+{
+	// identifies the code generated by this build of lib86cpu, so that it's the same for all the builds that emit the same code. DISK_CACHE_VERSION must be
+	// incremented when the jit changes the code it emits. The code also accesses the members of cpu_ctx_t and cpu_t with fixed offsets, and it calls the
+	// helpers at offsets from the image base that change when the library is linked again
+	static constexpr uint64_t layout[] = {
+		DISK_CACHE_VERSION,
+		sizeof(cpu_ctx_t),
+		offsetof(cpu_ctx_t, regs),
+		offsetof(cpu_ctx_t, lazy_eflags),
+		offsetof(cpu_ctx_t, hflags),
+		offsetof(cpu_ctx_t, exp_info),
+		offsetof(cpu_ctx_t, int_pending),
+		offsetof(cpu_ctx_t, exp_pending),
+		offsetof(cpu_ctx_t, timer_budget),
+		offsetof(cpu_ctx_t, instr_budget),
+		offsetof(cpu_ctx_t, instr_tc),
+		offsetof(cpu_ctx_t, ret_stack),
+		offsetof(cpu_ctx_t, fpu_data),
+		offsetof(cpu_ctx_t, itlb),
+		offsetof(cpu_ctx_t, dtlb),
+		offsetof(cpu_ctx_t, ibtc),
+		sizeof(cpu_t),
+		sizeof(translated_code_t),
+	};
+	uint64_t hash = hash_bytes(layout, sizeof(layout));
+	std::apply([&hash](auto... funcs) {
+		for (int64_t offset : { static_cast<int64_t>(reinterpret_cast<uintptr_t>(funcs) - get_image_base())... }) {
+			hash = hash_bytes(&offset, sizeof(offset), hash);
+		}
+		}, all_callable_funcs);
+
+	return hash;
+}
+
+template<typename T>
+void lc86_jit::gen_mov_ptr(x86::Gp reg, T ptr)
+{
+	// emits a mov with a 64 bit immediate that holds a host pointer, and records where it is, so that the disk cache can relocate it. Pointers in cpu_t and
+	// in the current tc are stored as offsets from them, everything else must be code or static data of lib86cpu. Hooks are the only exception, but the
+	// disk cache never saves them
+
+	uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+	m_a.movabs(reg, addr);
+
+	jit_reloc_t reloc;
+	reloc.offset = static_cast<uint32_t>(m_a.offset() - 8);
+	if ((addr - reinterpret_cast<uintptr_t>(m_cpu)) < sizeof(cpu_t)) {
+		reloc.type = jit_reloc_type::cpu;
+		reloc.addend = static_cast<int64_t>(addr - reinterpret_cast<uintptr_t>(m_cpu));
+	}
+	else if (m_cpu->tc && ((addr - reinterpret_cast<uintptr_t>(m_cpu->tc)) < sizeof(translated_code_t))) {
+		reloc.type = jit_reloc_type::tc;
+		reloc.addend = static_cast<int64_t>(addr - reinterpret_cast<uintptr_t>(m_cpu->tc));
+	}
+	else {
+		reloc.type = jit_reloc_type::image;
+		reloc.addend = static_cast<int64_t>(addr - get_image_base());
+	}
+	m_relocs.push_back(reloc);
 }
 
 void
@@ -605,7 +763,7 @@ lc86_jit::gen_aux_funcs()
 	size_t buff_size = static_cast<size_t>(section->bufferSize());
 
 	assert(offset + buff_size <= estimated_code_size);
-	std::memcpy(static_cast<uint8_t *>(block.addr) + offset, section->data(), buff_size);
+	std::memcpy(static_cast<uint8_t *>(block.wr_addr) + offset, section->data(), buff_size);
 
 	m_mem.protect_sys_mem(block, MEM_READ | MEM_EXEC);
 
@@ -621,7 +779,7 @@ lc86_jit::gen_exit_func()
 	// this should be emitted before main(), so that we can calculate the tc ptr from tc->ptr_code by simply subtracting an offset
 
 	size_t exit_off_start = m_a.offset();
-	MOV(RAX, m_cpu->tc);
+	MOV_PTR(RAX, m_cpu->tc);
 	RET();
 	size_t exit_off_end = m_a.offset();
 	assert((exit_off_end - exit_off_start) == 11);
@@ -637,7 +795,10 @@ lc86_jit::gen_interrupt_check()
 {
 	Label no_int = m_a.newLabel();
 	if (m_cpu->cpu_ctx.hflags & HFLG_TIMEOUT) {
-		Label no_timeout = m_a.newLabel();
+		// the instr of the tc are subtracted from the budget, and the host clock is only read by cpu_timer_helper when the budget runs out
+		Label no_timeout = m_a.newLabel(), budget_left = m_a.newLabel();
+		SUB(MEMD64(RCX, CPU_CTX_TIMER_BUDGET), std::max<uint32_t>(m_cpu->tc->instr_count, 1));
+		BR_SGT(budget_left);
 		CALL_F(&cpu_timer_helper);
 		TEST(EAX, EAX);
 		BR_EQ(no_int);
@@ -645,19 +806,157 @@ lc86_jit::gen_interrupt_check()
 		BR_NE(no_timeout);
 		MOV(MEMD8(RCX, CPU_CTX_EXIT), 1); // request an exit
 		m_a.bind(no_timeout);
+		XOR(EAX, EAX);
+		gen_epilogue_main<false>();
+		m_a.bind(budget_left);
 	}
-	else {
-		MOV(EDX, MEMD32(RCX, CPU_CTX_INT));
-		TEST(EDX, EDX);
-		BR_EQ(no_int);
-		MOV(RAX, &cpu_do_int);
-		CALL(RAX);
-	}
+
+	MOV(EDX, MEMD32(RCX, CPU_CTX_INT));
+	TEST(EDX, EDX);
+	BR_EQ(no_int);
+	gen_reg_cache_flush();
+	MOV_PTR(RAX, &cpu_do_int);
+	CALL(RAX);
 	XOR(EAX, EAX);
-	gen_epilogue_main<false>();
+	gen_epilogue_main<false, false>();
 	m_a.bind(no_int);
 }
 
+void
+lc86_jit::gen_accessed_mark()
+{
+	// tells tc_cache_evict that this tc ran since its last sweep of the code cache
+	MOV_PTR(RDX, &m_cpu->tc->accessed);
+	MOV(MEM8(RDX), 1);
+}
+
+void
+lc86_jit::gen_exec_counter()
+{
+	// only emitted in baseline tc's: count the executions of this tc and, when it becomes hot, return to cpu_main_loop without running it, so that it can be
+	// recompiled with the optimizing tier and merged with its successors in a superblock. Nothing was executed yet, so the eip is still the one of the first
+	// instr of the tc
+
+	Label not_hot = m_a.newLabel();
+	MOV_PTR(RDX, &m_cpu->tc->exec_count);
+	MOV(EAX, MEM32(RDX));
+	ADD(EAX, 1);
+	MOV(MEM32(RDX), EAX);
+	CMP(EAX, SUPERBLOCK_HOT_COUNT);
+	BR_NE(not_hot);
+	MOV_PTR(RDX, &m_cpu->superblock.hot_tc);
+	MOV_PTR(RAX, m_cpu->tc);
+	MOV(MEM64(RDX), RAX);
+	XOR(EAX, EAX);
+	gen_epilogue_main<false>();
+	m_a.bind(not_hot);
+}
+
+void
+lc86_jit::gen_self_check()
+{
+	// only emitted in self checking tc's, before anything else of the tc runs. The guest code to compare is only known after the whole tc was translated,
+	// so the comparison is emitted at the end of the tc by gen_self_check_stub, and this only jumps to it
+
+	m_self_check = m_a.newLabel();
+	m_self_check_ret = m_a.newLabel();
+	BR_UNCOND(m_self_check);
+	m_a.bind(m_self_check_ret);
+}
+
+void
+lc86_jit::gen_loop_head()
+{
+	// the branches back to the first instr of the tc jump here, without leaving the tc, see gen_loop_jmp. The hot counter comes after this, so the iterations
+	// of a loop are counted as executions of the tc
+	m_loop_head = m_a.newLabel();
+	m_loop_pc = m_cpu->virt_pc;
+	m_a.bind(m_loop_head);
+}
+
+void
+lc86_jit::gen_instr_count_check()
+{
+	// only emitted when running with cpu_run_instructions: the instr of the tc are subtracted from the budget before any of them runs. If they don't fit,
+	// the tc returns to cpu_main_loop, which runs the remaining instr one at a time. Nothing was executed yet, so the eip is still the one of the first
+	// instr of the tc. The number of instr is only known after the whole tc was translated, so gen_tc_epilogue patches it in the mov below. The tc is then
+	// recorded in cpu_ctx_t::instr_tc, so that the instr it doesn't get to run are refunded if it's stopped early, see tc_refund_instr
+
+	Label has_budget = m_a.newLabel();
+	MOV(EAX, INT32_MAX); // always encoded with an imm32
+	m_instr_count_off = m_a.offset() - 4;
+	SUB(MEMD64(RCX, CPU_CTX_INSTR_BUDGET), RAX);
+	BR_SGE(has_budget);
+	ADD(MEMD64(RCX, CPU_CTX_INSTR_BUDGET), RAX);
+	XOR(EAX, EAX);
+	gen_epilogue_main<false>();
+	m_a.bind(has_budget);
+	MOV_PTR(RAX, m_cpu->tc);
+	MOV(MEMD64(RCX, CPU_CTX_INSTR_TC), RAX);
+}
+
+void
+lc86_jit::gen_self_check_stub()
+{
+	// compares the guest code of the tc in ram with the bytes it was translated from, 8 bytes at a time. If they differ, the tc deletes itself and returns to
+	// cpu_main_loop, which will translate the new code. A tc that crosses a page only checks its first page, like tc_invalidate does
+
+	if (m_self_check.isValid()) {
+		translated_code_t *tc = m_cpu->tc;
+		uint32_t size = std::min(tc->size, PAGE_SIZE - (tc->pc & PAGE_MASK));
+		const memory_region_t<addr_t> *region = as_memory_search_addr(m_cpu, tc->pc);
+		m_a.bind(m_self_check);
+
+		if ((region->type == mem_type::ram) && ((tc->pc + size - 1) <= region->end)) {
+			Label changed = m_a.newLabel();
+			const uint8_t *code = static_cast<const uint8_t *>(get_ram_host_ptr(m_cpu, region, tc->pc));
+			MOV(RDX, MEMD64(RCX, CPU_CTX_RAM));
+			MOV(EAX, tc->pc - region->buff_off_start);
+			ADD(RDX, RAX);
+			uint32_t i = 0;
+			for (; (i + 8) <= size; i += 8) {
+				uint64_t val;
+				std::memcpy(&val, code + i, 8);
+				MOV(RAX, val);
+				CMP(MEMD64(RDX, i), RAX);
+				BR_NE(changed);
+			}
+			if ((i + 4) <= size) {
+				uint32_t val;
+				std::memcpy(&val, code + i, 4);
+				CMP(MEMD32(RDX, i), val);
+				BR_NE(changed);
+				i += 4;
+			}
+			if ((i + 2) <= size) {
+				uint16_t val;
+				std::memcpy(&val, code + i, 2);
+				CMP(MEMD16(RDX, i), val);
+				BR_NE(changed);
+				i += 2;
+			}
+			if (i < size) {
+				CMP(MEMD8(RDX, i), code[i]);
+				BR_NE(changed);
+			}
+			BR_UNCOND(m_self_check_ret);
+			m_a.bind(changed);
+			MOV_PTR(RDX, tc);
+			MOV_PTR(RAX, &tc_self_check_failed);
+			CALL(RAX);
+			XOR(EAX, EAX);
+			gen_epilogue_main<false, false>();
+		}
+		else {
+			// the code is not all in a ram region, so let tc_invalidate handle the tc like any other
+			tc->flags &= ~TC_FLG_SELF_CHECK;
+			BR_UNCOND(m_self_check_ret);
+		}
+
+		m_self_check = Label();
+	}
+}
+
 void
 lc86_jit::gen_no_link_checks()
 {
@@ -695,7 +994,7 @@ lc86_jit::gen_prologue_main()
 	// immediately after with a MOV rcx, &m_cpu->cpu_ctx, since the cu_ctx is a constant and never changes at runtime while the emulatio is running. Prologue and
 	// epilog always push and pop RBX, so it's volatile too. Prefer using RAX, RDX, RBX over R8, R9, R10 and R11 to reduce the code size, and only use the host stack
 	// as a last resort. Calling external functions from main() must be done with CALL(RAX), and not with rip offsets, because the function can be farther than
-	// 4 GiB from the current code.
+	// 4 GiB from the current code. R12-R15 hold cached guest registers, see gen_reg_cache_begin.
 	// Some optimizations used in the main() function:
 	// Offsets from cpu_ctx can be calculated with displacements, to avoid having to use additional ADD instructions. Local variables on the stack are always allocated
 	// at a fixed offset computed at compile time, and the shadow area to spill registers is available too (always allocated by the caller of the jitted function).
@@ -709,13 +1008,18 @@ lc86_jit::gen_prologue_main()
 	SUB(RSP, get_jit_stack_required());
 
 	m_needs_epilogue = true;
+	m_flags_dead = false;
+	m_reg_saved = m_reg_loaded = m_reg_dirty = 0;
 }
 
-template<bool set_ret>
+template<bool set_ret, bool flush_regs>
 void lc86_jit::gen_epilogue_main()
 {
+	if constexpr (flush_regs) {
+		gen_reg_cache_flush();
+	}
 	if constexpr (set_ret) {
-		MOV(RAX, m_cpu->tc);
+		MOV_PTR(RAX, m_cpu->tc);
 	}
 	ADD(RSP, get_jit_stack_required());
 	POP(RBX);
@@ -725,11 +1029,102 @@ void lc86_jit::gen_epilogue_main()
 void
 lc86_jit::gen_tail_call(x86::Gp addr)
 {
+	gen_reg_cache_flush();
 	ADD(RSP, get_jit_stack_required());
 	POP(RBX);
 	BR_UNCOND(addr);
 }
 
+void
+lc86_jit::gen_set_jmp_taken(uint32_t jmp_taken)
+{
+	// records the direction that the tc took for cpu_main_loop, which uses it to link the tc to its successor
+	MOV_PTR(RDX, &m_cpu->tc->flags);
+	MOV(EAX, MEM32(RDX));
+	AND(EAX, ~TC_FLG_JMP_TAKEN);
+	if (jmp_taken) {
+		OR(EAX, jmp_taken << 4);
+	}
+	MOV(MEM32(RDX), EAX);
+}
+
+void
+lc86_jit::gen_link_jmp(uint32_t idx, bool set_jmp_taken, bool cross_page)
+{
+	// leaves the tc through the link idx. The jmp rel32 is patched by patch_link to jump straight to the linked tc, when that is close enough to this code.
+	// Otherwise, the jmp falls through to the next instr, which records the direction taken if it's needed, and then jumps through jmp_offset[idx]. That's
+	// the exit function until the link is established
+
+	gen_reg_cache_flush();
+	ADD(RSP, get_jit_stack_required());
+	POP(RBX);
+	Label exit = m_a.newLabel();
+	if (cross_page) {
+		// the linked tc is on another page, whose mapping could have changed since the link was established. The tlb_gen only changes when the tlb is
+		// flushed, so if it's the same, the itlb still maps the dst to the code of the linked tc
+		MOV_PTR(RDX, &m_cpu->tc->link_gen[idx]);
+		MOV(RAX, MEM64(RDX));
+		CMP(RAX, MEMD64(RCX, CPU_CTX_TLB_GEN));
+		BR_NE(exit);
+	}
+	// align the rel32 to four bytes, so that patch_link changes it with a single store
+	while (((m_a.offset() + 1) & 3) != 0) {
+		m_a.nop();
+	}
+	assert(m_cpu->tc->jmp_patch[idx] == 0);
+	m_cpu->tc->jmp_patch[idx] = static_cast<uint32_t>(m_a.offset() + 1);
+	Label unlinked = m_a.newLabel();
+	m_a.long_().jmp(unlinked);
+	m_a.bind(unlinked);
+	assert(m_a.offset() == (m_cpu->tc->jmp_patch[idx] + 4));
+	if (set_jmp_taken) {
+		gen_set_jmp_taken(idx == 0 ? TC_JMP_DST_PC : TC_JMP_NEXT_PC);
+	}
+	MOV_PTR(RDX, &m_cpu->tc->jmp_offset[idx]);
+	MOV(RAX, MEM64(RDX));
+	BR_UNCOND(RAX);
+	if (cross_page) {
+		// return to cpu_main_loop, which finds the dst again and establishes the link with the current tlb_gen
+		m_a.bind(exit);
+		if (set_jmp_taken) {
+			gen_set_jmp_taken(idx == 0 ? TC_JMP_DST_PC : TC_JMP_NEXT_PC);
+		}
+		MOV_PTR(RDX, &m_cpu->tc->jmp_offset[2]);
+		MOV(RAX, MEM64(RDX));
+		BR_UNCOND(RAX);
+	}
+}
+
+void
+lc86_jit::gen_loop_jmp()
+{
+	// jumps back to the first instr of the tc, instead of leaving it and entering it again through the link. The interrupts were already checked by
+	// gen_no_link_checks, so a pending interrupt is still serviced after at most one iteration. The guest eip was already set to the start of the tc, so
+	// tc_invalidate can still find that this tc is running if the loop writes to its own code
+	gen_reg_cache_flush();
+	BR_UNCOND(m_loop_head);
+}
+
+void
+lc86_jit::patch_link(translated_code_t *tc, uint32_t idx)
+{
+	// makes the jmp rel32 of the link idx of tc agree with jmp_offset[idx]. The rel32 is zero when the link is not established, or when the linked tc is
+	// beyond the reach of a rel32, so that the jmp falls back to the indirect jump through jmp_offset
+
+	if (tc->jmp_patch[idx] == 0) {
+		return;
+	}
+
+	uint8_t *rel32_addr = reinterpret_cast<uint8_t *>(tc->jmp_offset[2]) + tc->jmp_patch[idx];
+	int64_t disp = reinterpret_cast<uint8_t *>(tc->jmp_offset[idx]) - (rel32_addr + 4);
+	int32_t rel32 = 0;
+	if ((tc->jmp_offset[idx] != tc->jmp_offset[2]) && (disp >= INT32_MIN) && (disp <= INT32_MAX)) {
+		rel32 = static_cast<int32_t>(disp);
+	}
+
+	m_mem.patch_sys_mem(rel32_addr, &rel32, sizeof(int32_t));
+}
+
 void
 lc86_jit::gen_tc_epilogue()
 {
@@ -745,6 +1140,11 @@ lc86_jit::gen_tc_epilogue()
 	if (m_needs_epilogue) {
 		gen_epilogue_main();
 	}
+
+	if (m_instr_count_off) {
+		uint32_t instr_count = m_cpu->tc->instr_count;
+		std::memcpy(m_code.textSection()->data() + m_instr_count_off, &instr_count, 4);
+	}
 }
 
 template<bool terminates, typename T1, typename T2, typename T3, typename T4>
@@ -760,9 +1160,10 @@ void lc86_jit::gen_raise_exp_inline(T1 fault_addr, T2 code, T3 idx, T4 eip)
 	MOV(MEMD16(RCX, CPU_EXP_CODE), code);
 	MOV(MEMD16(RCX, CPU_EXP_IDX), idx);
 	MOV(MEMD32(RCX, CPU_EXP_EIP), eip);
-	MOV(RAX, &cpu_raise_exception<>);
+	gen_reg_cache_flush();
+	MOV_PTR(RAX, &cpu_raise_exception<>);
 	CALL(RAX);
-	gen_epilogue_main<false>();
+	gen_epilogue_main<false, false>();
 }
 
 template<bool terminates>
@@ -774,9 +1175,10 @@ void lc86_jit::gen_raise_exp_inline()
 		m_cpu->translate_next = 0;
 	}
 
-	MOV(RAX, &cpu_raise_exception<>);
+	gen_reg_cache_flush();
+	MOV_PTR(RAX, &cpu_raise_exception<>);
 	CALL(RAX);
-	gen_epilogue_main<false>();
+	gen_epilogue_main<false, false>();
 }
 
 void
@@ -831,135 +1233,81 @@ void lc86_jit::gen_link_direct(addr_t dst_pc, addr_t *next_pc, T target_pc)
 	// and only emit the taken code path. If it's in a reg, it must be ebx because otherwise a volative reg might be trashed by the timer and
 	// interrupt calls in gen_no_link_checks
 
+	if (m_cpu->superblock.idx < m_cpu->superblock.trace.size()) {
+		// we are translating a superblock: if the next tc of the trace is one of the destinations of this instr, then it's translated right after it in
+		// the same tc, instead of linking to it. The other destination becomes a side exit that returns to cpu_main_loop
+		addr_t trace_pc = m_cpu->superblock.trace[m_cpu->superblock.idx];
+		if (!(m_cpu->disas_ctx.flags & DISAS_FLG_PAGE_CROSS) && (trace_pc >= (m_cpu->virt_pc + m_cpu->instr_bytes)) &&
+			((trace_pc == dst_pc) || (next_pc && (trace_pc == *next_pc)))) {
+			if constexpr (std::is_integral_v<T>) {
+				if (target_pc == trace_pc) {
+					m_cpu->superblock.follow = true;
+					return;
+				}
+			}
+			else {
+				Label follow = m_a.newLabel();
+				CMP(target_pc, trace_pc);
+				BR_EQ(follow);
+				gen_no_link_checks();
+				XOR(EAX, EAX);
+				gen_epilogue_main<false>();
+				m_a.bind(follow);
+				m_cpu->superblock.follow = true;
+				return;
+			}
+		}
+	}
+
 	m_needs_epilogue = false;
 
 	gen_no_link_checks();
 
 	// vec_addr: instr_pc, dst_pc, next_pc
+	// Destinations on another page are linked too, but their links are only followed while the itlb still maps them to the same code, see gen_link_jmp
 	addr_t page_addr = m_cpu->virt_pc & ~PAGE_MASK;
-	uint32_t n, dst = (dst_pc & ~PAGE_MASK) == page_addr;
+	bool dst_cross = (dst_pc & ~PAGE_MASK) != page_addr;
+	bool next_cross = false;
 	if (next_pc) {
-		n = dst + ((*next_pc & ~PAGE_MASK) == page_addr);
-	}
-	else {
-		n = dst;
+		next_cross = (*next_pc & ~PAGE_MASK) != page_addr;
 	}
+	uint32_t n = next_pc ? 2 : 1;
 	m_cpu->tc->flags |= (n & TC_FLG_NUM_JMP);
 
-	switch (n)
-	{
-	case 0:
-		gen_epilogue_main();
-		return;
-
-	case 1: {
-		if (next_pc) { // if(dst_pc) -> cond jmp dst_pc; if(next_pc) -> cond jmp next_pc
-			if (dst) {
-				MOV(RDX, &m_cpu->tc->flags);
-				MOV(EAX, MEM32(RDX));
-				AND(EAX, ~TC_FLG_JMP_TAKEN);
-				if constexpr (std::is_integral_v<T>) {
-					if (target_pc == dst_pc) {
-						MOV(MEM32(RDX), EAX);
-						MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-						MOV(RAX, MEM64(RDX));
-						gen_tail_call(RAX);
-					}
-					else {
-						OR(EAX, TC_JMP_RET << 4);
-						MOV(MEM32(RDX), EAX);
-						gen_epilogue_main();
-					}
-				}
-				else {
-					Label ret = m_a.newLabel();
-					CMP(target_pc, dst_pc);
-					BR_NE(ret);
-					MOV(MEM32(RDX), EAX);
-					MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-					MOV(RAX, MEM64(RDX));
-					gen_tail_call(RAX);
-					m_a.bind(ret);
-					OR(EAX, TC_JMP_RET << 4);
-					MOV(MEM32(RDX), EAX);
-					gen_epilogue_main();
-				}
-			}
-			else {
-				MOV(RDX, &m_cpu->tc->flags);
-				MOV(EAX, MEM32(RDX));
-				AND(EAX, ~TC_FLG_JMP_TAKEN);
-				if constexpr (std::is_integral_v<T>) {
-					if (target_pc == *next_pc) {
-						OR(EAX, TC_JMP_NEXT_PC << 4);
-						MOV(MEM32(RDX), EAX);
-						MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-						MOV(RAX, MEM64(RDX));
-						gen_tail_call(RAX);
-					}
-					else {
-						OR(EAX, TC_JMP_RET << 4);
-						MOV(MEM32(RDX), EAX);
-						gen_epilogue_main();
-					}
-				}
-				else {
-					Label ret = m_a.newLabel();
-					CMP(target_pc, *next_pc);
-					BR_NE(ret);
-					OR(EAX, TC_JMP_NEXT_PC << 4);
-					MOV(MEM32(RDX), EAX);
-					MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-					MOV(RAX, MEM64(RDX));
-					gen_tail_call(RAX);
-					m_a.bind(ret);
-					OR(EAX, TC_JMP_RET << 4);
-					MOV(MEM32(RDX), EAX);
-					gen_epilogue_main();
-				}
-			}
+	// a backward branch to the start of the tc (e.g. a small loop) stays in the tc. Tc's that cross a page are excluded, because tc_invalidate can't see
+	// the writes to their second page
+	bool dst_loop = m_loop_head.isValid() && (dst_pc == m_loop_pc) && !(m_cpu->disas_ctx.flags & DISAS_FLG_PAGE_CROSS);
+	auto gen_link_dst = [this, dst_loop, dst_cross](bool set_jmp_taken) {
+		if (dst_loop) {
+			gen_loop_jmp();
 		}
-		else { // uncond jmp dst_pc
-			MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
+		else {
+			gen_link_jmp(0, set_jmp_taken, dst_cross);
 		}
-	}
-	break;
+	};
+
+	switch (n)
+	{
+	case 1: // uncond jmp dst_pc
+		gen_link_dst(false);
+		break;
 
 	case 2: { // cond jmp next_pc + uncond jmp dst_pc
-		MOV(RDX, &m_cpu->tc->flags);
-		MOV(EAX, MEM32(RDX));
-		AND(EAX, ~TC_FLG_JMP_TAKEN);
 		if constexpr (std::is_integral_v<T>) {
 			if (target_pc == *next_pc) {
-				OR(EAX, TC_JMP_NEXT_PC << 4);
-				MOV(MEM32(RDX), EAX);
-				MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-				MOV(RAX, MEM64(RDX));
-				gen_tail_call(RAX);
+				gen_link_jmp(1, true, next_cross);
 			}
 			else {
-				MOV(MEM32(RDX), EAX);
-				MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-				MOV(RAX, MEM64(RDX));
-				gen_tail_call(RAX);
+				gen_link_dst(true);
 			}
 		}
 		else {
-			Label ret = m_a.newLabel();
+			Label dst = m_a.newLabel();
 			CMP(target_pc, *next_pc);
-			BR_NE(ret);
-			OR(EAX, TC_JMP_NEXT_PC << 4);
-			MOV(MEM32(RDX), EAX);
-			MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
-			m_a.bind(ret);
-			MOV(MEM32(RDX), EAX);
-			MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-			MOV(RAX, MEM64(RDX));
-			gen_tail_call(RAX);
+			BR_NE(dst);
+			gen_link_jmp(1, true, next_cross);
+			m_a.bind(dst);
+			gen_link_dst(true);
 		}
 	}
 	break;
@@ -978,9 +1326,7 @@ lc86_jit::gen_link_dst_only()
 
 	m_cpu->tc->flags |= (1 & TC_FLG_NUM_JMP);
 
-	MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-	MOV(RAX, MEM64(RDX));
-	gen_tail_call(RAX);
+	gen_link_jmp(0, false, false);
 }
 
 void
@@ -990,7 +1336,34 @@ lc86_jit::gen_link_indirect()
 
 	gen_no_link_checks();
 
-	MOV(RDX, m_cpu->tc);
+	// search the ibtc inline, and only call link_indirect_handler when the dst tc is not there or it's on another page. The hash must be the same of
+	// tc_ibtc_hash, and the guest_flags are compared first, so that the dummy_tc always fails
+	Label miss = m_a.newLabel();
+	LD_R32(EAX, CPU_CTX_EIP);
+	ADD(EAX, MEMD32(RCX, CPU_CTX_CS_BASE));
+	MOV(EDX, EAX);
+	AND(EDX, IBTC_SIZE - 1);
+	MOV(RDX, MEMSD64(RCX, RDX, 3, CPU_CTX_IBTC));
+	MOV(R8D, MEMD32(RCX, CPU_CTX_HFLG));
+	AND(R8D, HFLG_CONST);
+	MOV(R9D, MEMD32(RCX, CPU_CTX_EFLAGS));
+	AND(R9D, EFLAGS_CONST);
+	OR(R8D, R9D);
+	CMP(R8D, MEMD32(RDX, offsetof(translated_code_t, guest_flags)));
+	BR_NE(miss);
+	CMP(EAX, MEMD32(RDX, offsetof(translated_code_t, virt_pc)));
+	BR_NE(miss);
+	MOV(R8D, MEMD32(RCX, CPU_CTX_CS_BASE));
+	CMP(R8D, MEMD32(RDX, offsetof(translated_code_t, cs_base)));
+	BR_NE(miss);
+	AND(EAX, ~PAGE_MASK);
+	CMP(EAX, m_cpu->virt_pc & ~PAGE_MASK);
+	BR_NE(miss);
+	ADD(MEMD64(RCX, CPU_CTX_IBTC_HITS), 1);
+	MOV(RAX, MEMD64(RDX, offsetof(translated_code_t, ptr_code)));
+	gen_tail_call(RAX);
+	m_a.bind(miss);
+	MOV_PTR(RDX, m_cpu->tc);
 	CALL_F(&link_indirect_handler);
 	gen_tail_call(RAX);
 }
@@ -998,9 +1371,38 @@ lc86_jit::gen_link_indirect()
 void
 lc86_jit::gen_link_ret()
 {
-	// NOTE: perhaps find a way to use a return stack buffer to link to the next tc
+	// only for near rets: the tc they return to is predicted with the return stack buffer, and the ibtc is used as a fallback
 
-	gen_link_indirect();
+	m_needs_epilogue = false;
+
+	gen_no_link_checks();
+
+	MOV_PTR(RDX, m_cpu->tc);
+	CALL_F(&link_ret_handler);
+	gen_tail_call(RAX);
+}
+
+void
+lc86_jit::gen_ret_stack_push(addr_t ret_eip)
+{
+	// push the return address of a near call to the return stack buffer. Tc's that only run once are deleted right after they are executed, so they push a
+	// nullptr tc, which keeps the stack balanced with the rets but is never used as a prediction
+	if (m_cpu->size_mode == SIZE16) {
+		ret_eip &= 0x0000FFFF;
+	}
+
+	MOV(EAX, MEMD32(RCX, CPU_CTX_RS_IDX));
+	ADD(EAX, 1);
+	AND(EAX, RET_STACK_SIZE - 1);
+	MOV(MEMD32(RCX, CPU_CTX_RS_IDX), EAX);
+	MOV(MEMSD32(RCX, RAX, 2, CPU_CTX_RS_PC), m_cpu->cpu_ctx.regs.cs_hidden.base + ret_eip);
+	if (m_cpu->disas_ctx.flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR)) {
+		MOV(MEMSD64(RCX, RAX, 3, CPU_CTX_RS_TC), 0);
+	}
+	else {
+		MOV_PTR(RDX, m_cpu->tc);
+		MOV(MEMSD64(RCX, RAX, 3, CPU_CTX_RS_TC), RDX);
+	}
 }
 
 template<typename T>
@@ -1013,22 +1415,12 @@ void lc86_jit::gen_link_dst_cond(T &&lambda)
 	gen_no_link_checks();
 
 	if ((m_cpu->virt_pc & ~PAGE_MASK) == (m_cpu->virt_pc + m_cpu->instr_bytes & ~PAGE_MASK)) {
-		MOV(RDX, &m_cpu->tc->flags);
-		MOV(EAX, MEM32(RDX));
-		AND(EAX, ~TC_FLG_JMP_TAKEN);
 		lambda();
 		Label dst = m_a.newLabel();
 		BR_EQ(dst);
-		OR(EAX, TC_JMP_NEXT_PC << 4);
-		MOV(MEM32(RDX), EAX);
-		MOV(RDX, &m_cpu->tc->jmp_offset[1]);
-		MOV(RAX, MEM64(RDX));
-		gen_tail_call(RAX);
+		gen_link_jmp(1, true, false);
 		m_a.bind(dst);
-		MOV(MEM32(RDX), EAX);
-		MOV(RDX, &m_cpu->tc->jmp_offset[0]);
-		MOV(RAX, MEM64(RDX));
-		gen_tail_call(RAX);
+		gen_link_jmp(0, true, false);
 
 		m_cpu->tc->flags |= ((2 & TC_FLG_NUM_JMP) | TC_FLG_DST_COND);
 	}
@@ -1661,6 +2053,10 @@ void lc86_jit::set_flags_sum(x86::Gp a, T b, x86::Gp sum)
 {
 	// a: reg, b: e(d|b)x/(d|b)x/(d|b)l or imm32/16/8, sum: r8d/w/b
 
+	if (m_flags_dead) {
+		return;
+	}
+
 	assert(sum.id() == x86::Gp::kIdR8);
 	if constexpr (!std::is_integral_v<T>) {
 		assert(b.id() == x86::Gp::kIdDx || b.id() == x86::Gp::kIdBx);
@@ -1715,6 +2111,10 @@ void lc86_jit::set_flags_sub(T1 a, T2 b, x86::Gp sub)
 {
 	// a: reg or imm32/16/8, b: e(d|b)x/(d|b)x/(d|b)l or imm32/16/8, sub: r8d/w/b
 
+	if (m_flags_dead) {
+		return;
+	}
+
 	assert(sub.id() == x86::Gp::kIdR8);
 	if constexpr (!std::is_integral_v<T2>) {
 		assert(b.id() == x86::Gp::kIdDx || b.id() == x86::Gp::kIdBx);
@@ -1769,6 +2169,10 @@ void lc86_jit::set_flags_sub(T1 a, T2 b, x86::Gp sub)
 template<typename T1, typename T2>
 void lc86_jit::set_flags(T1 res, T2 aux, size_t res_size)
 {
+	if (m_flags_dead) {
+		return;
+	}
+
 	if (res_size != SIZE32) {
 		if constexpr (std::is_integral_v<T1>) {
 			int32_t res1 = static_cast<int32_t>(res);
@@ -1814,9 +2218,150 @@ lc86_jit::ld_pf(x86::Gp dst, x86::Gp res, x86::Gp aux)
 	MOVZX(dst, MEMS8(dst.r64(), res.r64(), 0));
 }
 
+void
+lc86_jit::gen_reg_cache_begin(ZydisDecodedInstruction *instr)
+{
+	// Called before emitting every instruction. The instructions listed below only access the guest registers with load_reg and store_reg (including
+	// the LD/ST_R* macros), so the registers they use are kept in host registers until the end of the tc, a helper call or an instruction not listed
+	// here. Because this always runs at the start of an instruction, the loads emitted here are executed on every path of the tc that follows them
+
+	if (!m_optimize) {
+		// baseline tc's never cache the guest registers, so there is nothing to do
+		return;
+	}
+
+	switch (instr->mnemonic)
+	{
+	case ZYDIS_MNEMONIC_ADC:
+	case ZYDIS_MNEMONIC_ADD:
+	case ZYDIS_MNEMONIC_AND:
+	case ZYDIS_MNEMONIC_CMP:
+	case ZYDIS_MNEMONIC_DEC:
+	case ZYDIS_MNEMONIC_INC:
+	case ZYDIS_MNEMONIC_LEA:
+	case ZYDIS_MNEMONIC_MOV:
+	case ZYDIS_MNEMONIC_MOVSX:
+	case ZYDIS_MNEMONIC_MOVZX:
+	case ZYDIS_MNEMONIC_NEG:
+	case ZYDIS_MNEMONIC_NOT:
+	case ZYDIS_MNEMONIC_OR:
+	case ZYDIS_MNEMONIC_SBB:
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_TEST:
+	case ZYDIS_MNEMONIC_XOR:
+		break;
+
+	default:
+		// this instruction might access cpu_ctx_t::regs directly, so write back the guest registers and give the host registers back
+		gen_reg_cache_flush();
+		m_reg_saved = m_reg_loaded = m_reg_dirty = 0;
+		return;
+	}
+
+	auto cache_reg = [this](ZydisRegister reg) {
+		if (reg == ZYDIS_REGISTER_NONE) {
+			return;
+		}
+
+		reg = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LEGACY_32, reg);
+		for (unsigned i = 0; i < reg_cache_num; ++i) {
+			if ((reg_cache_map[i].guest_reg == reg) && !(m_reg_loaded & (1 << i))) {
+				if (!(m_reg_saved & (1 << i))) {
+					MOV(MEMD64(RSP, reg_cache_map[i].home_off), reg_cache_map[i].host_reg);
+					m_reg_saved |= (1 << i);
+				}
+				MOV(reg_cache_map[i].host_reg.r32(), MEMD32(RCX, reg_cache_map[i].guest_off));
+				m_reg_loaded |= (1 << i);
+				return;
+			}
+		}
+	};
+
+	for (unsigned i = 0; i < instr->operand_count; ++i) {
+		ZydisDecodedOperand *operand = &instr->operands[i];
+		if (operand->type == ZYDIS_OPERAND_TYPE_REGISTER) {
+			cache_reg(operand->reg.value);
+		}
+		else if (operand->type == ZYDIS_OPERAND_TYPE_MEMORY) {
+			cache_reg(operand->mem.base);
+			cache_reg(operand->mem.index);
+		}
+	}
+}
+
+void
+lc86_jit::gen_reg_cache_flush()
+{
+	// writes back the modified guest registers and restores the host registers of the caller. This must happen before calling external code and before
+	// leaving the tc. It doesn't change the state of the cache, since it might be emitted in a code path that is not always taken
+
+	for (unsigned i = 0; i < reg_cache_num; ++i) {
+		if (m_reg_dirty & (1 << i)) {
+			MOV(MEMD32(RCX, reg_cache_map[i].guest_off), reg_cache_map[i].host_reg.r32());
+		}
+		if (m_reg_saved & (1 << i)) {
+			MOV(reg_cache_map[i].host_reg, MEMD64(RSP, reg_cache_map[i].home_off));
+		}
+	}
+}
+
+void
+lc86_jit::gen_reg_cache_reload()
+{
+	// the external code might have changed the guest registers, so load them again
+
+	for (unsigned i = 0; i < reg_cache_num; ++i) {
+		if (m_reg_loaded & (1 << i)) {
+			MOV(reg_cache_map[i].host_reg.r32(), MEMD32(RCX, reg_cache_map[i].guest_off));
+		}
+	}
+}
+
+int
+lc86_jit::find_cached_reg(size_t reg_offset)
+{
+	// returns the index of the cached guest register that holds reg_offset, or -1 if the register is not currently cached
+
+	for (unsigned i = 0; i < reg_cache_num; ++i) {
+		if ((m_reg_loaded & (1 << i)) && (reg_offset >= reg_cache_map[i].guest_off) && (reg_offset < (reg_cache_map[i].guest_off + 4))) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 void
 lc86_jit::load_reg(x86::Gp dst, size_t reg_offset, size_t size)
 {
+	int idx = find_cached_reg(reg_offset);
+	if (idx != -1) {
+		if ((reg_offset == reg_cache_map[idx].guest_off) && !dst.isGpbHi()) {
+			switch (size)
+			{
+			case SIZE8:
+				MOV(dst, reg_cache_map[idx].host_reg.r8());
+				return;
+
+			case SIZE16:
+				MOV(dst, reg_cache_map[idx].host_reg.r16());
+				return;
+
+			case SIZE32:
+				MOV(dst, reg_cache_map[idx].host_reg.r32());
+				return;
+
+			default:
+				LIB86CPU_ABORT();
+			}
+		}
+
+		// high byte registers (ah, ch) don't have a host register equivalent, so access them from cpu_ctx_t after writing back their value
+		if (m_reg_dirty & (1 << idx)) {
+			MOV(MEMD32(RCX, reg_cache_map[idx].guest_off), reg_cache_map[idx].host_reg.r32());
+		}
+	}
+
 	switch (size)
 	{
 	case SIZE8:
@@ -1839,6 +2384,40 @@ lc86_jit::load_reg(x86::Gp dst, size_t reg_offset, size_t size)
 template<typename T>
 void lc86_jit::store_reg(T val, size_t reg_offset, size_t size)
 {
+	int idx = find_cached_reg(reg_offset);
+	if (idx != -1) {
+		bool can_use_host_reg = reg_offset == reg_cache_map[idx].guest_off;
+		if constexpr (!std::is_integral_v<T>) {
+			can_use_host_reg = can_use_host_reg && !val.isGpbHi();
+		}
+
+		if (can_use_host_reg) {
+			switch (size)
+			{
+			case SIZE8:
+				MOV(reg_cache_map[idx].host_reg.r8(), val);
+				break;
+
+			case SIZE16:
+				MOV(reg_cache_map[idx].host_reg.r16(), val);
+				break;
+
+			case SIZE32:
+				MOV(reg_cache_map[idx].host_reg.r32(), val);
+				break;
+
+			default:
+				LIB86CPU_ABORT();
+			}
+			m_reg_dirty |= (1 << idx);
+			return;
+		}
+
+		if (m_reg_dirty & (1 << idx)) {
+			MOV(MEMD32(RCX, reg_cache_map[idx].guest_off), reg_cache_map[idx].host_reg.r32());
+		}
+	}
+
 	switch (size)
 	{
 	case SIZE8:
@@ -1856,6 +2435,124 @@ void lc86_jit::store_reg(T val, size_t reg_offset, size_t size)
 	default:
 		LIB86CPU_ABORT();
 	}
+
+	if (idx != -1) {
+		// the register was partially written in cpu_ctx_t, so reload it
+		MOV(reg_cache_map[idx].host_reg.r32(), MEMD32(RCX, reg_cache_map[idx].guest_off));
+	}
+}
+
+template<bool is_write>
+void lc86_jit::gen_dtlb_lookup(uint8_t size, uint8_t is_priv, Label slow)
+{
+	// RCX: cpu_ctx, EDX: addr
+	// This is an inlined version of the dtlb lookup done by mem_read/write_helper. It only handles ram pages, everything else (tlb misses, rom/mmio/subpage pages,
+	// pages with watchpoints and accesses that cross pages) jumps to the slow label, which is expected to call the helper. On a hit, RAX holds the host pointer to
+	// the data. EDX and R8 are preserved, R9, R10 and R11 are clobbered
+
+	// the cpl is part of the flags of the tc, so the access bits to check are a constant here
+	uint64_t mem_access = tlb_access[is_write][(m_cpu->cpu_ctx.hflags & HFLG_CPL) >> is_priv] | TLB_RAM;
+	if constexpr (is_write) {
+		mem_access |= TLB_DIRTY;
+	}
+	uint64_t entry_mask = mem_access | DTLB_TAG_MASK64 | TLB_ROM | TLB_MMIO | TLB_SUBPAGE | TLB_WATCH;
+
+	if (size != SIZE8) {
+		LEA(R9D, MEMD32(RDX, (1 << size) - 1));
+		XOR(R9D, EDX);
+		TEST(R9D, ~PAGE_MASK);
+		BR_NE(slow);
+	}
+
+	MOV(R10D, EDX);
+	SHR(R10D, PAGE_SHIFT);
+	AND(R10D, DTLB_IDX_MASK);
+	SHL(R10D, 6); // a dtlb set is 64 bytes large, see the static_assert in lib86cpu_priv.h
+	LEA(R10, MEMSD64(RCX, R10, 0, CPU_CTX_DTLB));
+	MOV(R9D, EDX);
+	SHR(R9D, 32 - DTLB_TAG_SHIFT64);
+	SHL(R9, 32);
+	OR(R9, mem_access);
+	MOV(R11, entry_mask);
+
+	Label hit = m_a.newLabel();
+	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
+		MOV(RAX, MEMD64(R10, i * sizeof(tlb_t) + TLB_ENTRY));
+		AND(RAX, R11);
+		CMP(RAX, R9);
+		if (i == (DTLB_NUM_LINES - 1)) {
+			BR_NE(slow);
+			ADD(R10, i * sizeof(tlb_t));
+		}
+		else if (i == 0) {
+			BR_EQ(hit);
+		}
+		else {
+			Label next = m_a.newLabel();
+			BR_NE(next);
+			ADD(R10, i * sizeof(tlb_t));
+			BR_UNCOND(hit);
+			m_a.bind(next);
+		}
+	}
+
+	// tlb hit, R10 points to the matching tlb_t. Since the page is ram, host ptr = ram + phys_addr - region->buff_off_start
+	m_a.bind(hit);
+	MOV(EAX, MEMD32(R10, TLB_ENTRY));
+	AND(EAX, ~PAGE_MASK);
+	MOV(R9D, EDX);
+	AND(R9D, PAGE_MASK);
+	OR(EAX, R9D);
+
+	if constexpr (is_write) {
+		// writes to pages with translated code must invalidate it, which is done by the helper. This tests the smc bit of the page with bt, since the
+		// words of smc_bits_t form a plain bit string in memory
+		MOV(R11D, EAX);
+		SHR(R11D, PAGE_SHIFT);
+		MOV_PTR(R9, m_cpu->smc.words);
+		BT(MEM32(R9), R11D);
+		BR_ULT(slow);
+	}
+
+	MOV(R9, MEMD64(R10, TLB_REGION));
+	SUB(EAX, MEMD32(R9, REGION_BUFF_OFF));
+	ADD(RAX, MEMD64(RCX, CPU_CTX_RAM));
+}
+
+void
+lc86_jit::gen_mem_fault_check()
+{
+	// emitted right after a call to the memory and io helpers with raise_host_exp == false. These report a page fault or a debug trap by setting exp_pending instead of throwing it,
+	// which would have to unwind the frame of the tc. At this point, the guest registers were already written back and the host registers of the caller restored
+	// by the call, so the check must come before reloading the reg cache
+
+	if (!m_mem_fault.isValid()) {
+		m_mem_fault = m_a.newLabel();
+	}
+	CMP(MEMD8(RCX, CPU_CTX_EXP_PENDING), 0);
+	BR_NE(m_mem_fault);
+}
+
+void
+lc86_jit::gen_mem_fault_stub()
+{
+	// emitted once at the end of the tc, only if one of its memory accesses needs it. The reg cache was already flushed before the branch, and its state here
+	// can be different from the one at the branch, so this must not touch it. A debug trap leaves exp_pending set, because the trapped instr must be executed
+	// before the exception is raised, which tc_run_code does after the tc returns
+	if (m_mem_fault.isValid()) {
+		Label db_trap = m_a.newLabel();
+		m_a.bind(m_mem_fault);
+		CMP(MEMD16(RCX, CPU_EXP_IDX), EXP_DB);
+		BR_EQ(db_trap);
+		MOV(MEMD8(RCX, CPU_CTX_EXP_PENDING), 0);
+		MOV_PTR(RAX, &cpu_raise_exception<>);
+		CALL(RAX);
+		gen_epilogue_main<false, false>();
+		m_a.bind(db_trap);
+		XOR(EAX, EAX);
+		gen_epilogue_main<false, false>();
+		m_mem_fault = Label();
+	}
 }
 
 void
@@ -1869,46 +2566,83 @@ lc86_jit::load_mem(uint8_t size, uint8_t is_priv)
 	case SIZE128:
 		LEA(RCX, MEMD64(RSP, LOCAL_VARS_off(0)));
 		MOV(R8D, EDX);
-		MOV(RDX, &m_cpu->cpu_ctx);
+		MOV_PTR(RDX, &m_cpu->cpu_ctx);
 		MOV(R9D, m_cpu->instr_eip);
 		MOV(MEMD8(RSP, LOCAL_VARS_off(2)), is_priv);
-		CALL_F(&mem_read_helper<uint128_t>);
+		CALL_MEM_F((&mem_read_helper<uint128_t, false>));
 		break;
 
 	case SIZE80:
 		LEA(RCX, MEMD64(RSP, LOCAL_VARS_off(0)));
 		MOV(R8D, EDX);
-		MOV(RDX, &m_cpu->cpu_ctx);
+		MOV_PTR(RDX, &m_cpu->cpu_ctx);
 		MOV(R9D, m_cpu->instr_eip);
 		MOV(MEMD8(RSP, LOCAL_VARS_off(2)), is_priv);
-		CALL_F(&mem_read_helper<uint80_t>);
+		CALL_MEM_F((&mem_read_helper<uint80_t, false>));
 		break;
 
-	default:
+	default: {
+		// in optimized tc's, reads from ram pages are done inline, everything else goes through mem_read_helper
+		Label done;
+		if (m_optimize) {
+			Label slow = m_a.newLabel();
+			done = m_a.newLabel();
+			gen_dtlb_lookup<false>(size, is_priv, slow);
+
+			switch (size)
+			{
+			case SIZE64:
+				MOV(RAX, MEM64(RAX));
+				break;
+
+			case SIZE32:
+				MOV(EAX, MEM32(RAX));
+				break;
+
+			case SIZE16:
+				MOVZX(EAX, MEM16(RAX));
+				break;
+
+			case SIZE8:
+				MOVZX(EAX, MEM8(RAX));
+				break;
+
+			default:
+				LIB86CPU_ABORT();
+			}
+			BR_UNCOND(done);
+			m_a.bind(slow);
+		}
+
 		MOV(R9B, is_priv);
 		MOV(R8D, m_cpu->instr_eip);
 
 		switch (size)
 		{
 		case SIZE64:
-			CALL_F(&mem_read_helper<uint64_t>);
+			CALL_MEM_F((&mem_read_helper<uint64_t, false>));
 			break;
 
 		case SIZE32:
-			CALL_F(&mem_read_helper<uint32_t>);
+			CALL_MEM_F((&mem_read_helper<uint32_t, false>));
 			break;
 
 		case SIZE16:
-			CALL_F(&mem_read_helper<uint16_t>);
+			CALL_MEM_F((&mem_read_helper<uint16_t, false>));
 			break;
 
 		case SIZE8:
-			CALL_F(&mem_read_helper<uint8_t>);
+			CALL_MEM_F((&mem_read_helper<uint8_t, false>));
 			break;
 
 		default:
 			LIB86CPU_ABORT();
 		}
+
+		if (done.isValid()) {
+			m_a.bind(done);
+		}
+	}
 	}
 }
 
@@ -1917,9 +2651,6 @@ void lc86_jit::store_mem(T val, uint8_t size, uint8_t is_priv)
 {
 	// RCX: cpu_ctx, EDX: addr, R8B/R8W/R8D: val, R9D: instr_eip, stack: is_priv
 
-	MOV(MEMD32(RSP, STACK_ARGS_off), is_priv);
-	MOV(R9D, m_cpu->instr_eip);
-
 	bool is_r8 = false;
 	if constexpr (!std::is_integral_v<T>) {
 		if (val.id() == x86::Gp::kIdR8) {
@@ -1930,43 +2661,100 @@ void lc86_jit::store_mem(T val, uint8_t size, uint8_t is_priv)
 	switch (size)
 	{
 	case SIZE128:
-		if (!is_r8) {
-			MOV(R8, val);
-		}
-		CALL_F((&mem_write_helper<uint128_t, dont_write>));
-		break;
-
 	case SIZE64:
 		if (!is_r8) {
 			MOV(R8, val);
 		}
-		CALL_F((&mem_write_helper<uint64_t, dont_write>));
 		break;
 
 	case SIZE32:
 		if (!is_r8) {
 			MOV(R8D, val);
 		}
-		CALL_F((&mem_write_helper<uint32_t, dont_write>));
 		break;
 
 	case SIZE16:
 		if (!is_r8) {
 			MOV(R8W, val);
 		}
-		CALL_F((&mem_write_helper<uint16_t, dont_write>));
 		break;
 
 	case SIZE8:
 		if (!is_r8) {
 			MOV(R8B, val);
 		}
-		CALL_F((&mem_write_helper<uint8_t, dont_write>));
 		break;
 
 	default:
 		LIB86CPU_ABORT();
 	}
+
+	// in optimized tc's, writes to ram pages without translated code are done inline, everything else goes through mem_write_helper
+	Label done;
+	if constexpr (!dont_write) {
+		if (m_optimize && (size != SIZE128)) {
+			Label slow = m_a.newLabel();
+			done = m_a.newLabel();
+			gen_dtlb_lookup<true>(size, is_priv, slow);
+
+			switch (size)
+			{
+			case SIZE64:
+				MOV(MEM64(RAX), R8);
+				break;
+
+			case SIZE32:
+				MOV(MEM32(RAX), R8D);
+				break;
+
+			case SIZE16:
+				MOV(MEM16(RAX), R8W);
+				break;
+
+			case SIZE8:
+				MOV(MEM8(RAX), R8B);
+				break;
+
+			default:
+				LIB86CPU_ABORT();
+			}
+			BR_UNCOND(done);
+			m_a.bind(slow);
+		}
+	}
+
+	MOV(MEMD32(RSP, STACK_ARGS_off), is_priv);
+	MOV(R9D, m_cpu->instr_eip);
+
+	switch (size)
+	{
+	case SIZE128:
+		CALL_MEM_F((&mem_write_helper<uint128_t, dont_write, false>));
+		break;
+
+	case SIZE64:
+		CALL_MEM_F((&mem_write_helper<uint64_t, dont_write, false>));
+		break;
+
+	case SIZE32:
+		CALL_MEM_F((&mem_write_helper<uint32_t, dont_write, false>));
+		break;
+
+	case SIZE16:
+		CALL_MEM_F((&mem_write_helper<uint16_t, dont_write, false>));
+		break;
+
+	case SIZE8:
+		CALL_MEM_F((&mem_write_helper<uint8_t, dont_write, false>));
+		break;
+
+	default:
+		LIB86CPU_ABORT();
+	}
+
+	if (done.isValid()) {
+		m_a.bind(done);
+	}
 }
 
 void
@@ -1979,15 +2767,15 @@ lc86_jit::load_io(uint8_t size_mode)
 	switch (size_mode)
 	{
 	case SIZE32:
-		CALL_F(&io_read_helper<uint32_t>);
+		CALL_MEM_F((&io_read_helper<uint32_t, false>));
 		break;
 
 	case SIZE16:
-		CALL_F(&io_read_helper<uint16_t>);
+		CALL_MEM_F((&io_read_helper<uint16_t, false>));
 		break;
 
 	case SIZE8:
-		CALL_F(&io_read_helper<uint8_t>);
+		CALL_MEM_F((&io_read_helper<uint8_t, false>));
 		break;
 
 	default:
@@ -2005,15 +2793,15 @@ lc86_jit::store_io(uint8_t size_mode)
 	switch (size_mode)
 	{
 	case SIZE32:
-		CALL_F(&io_write_helper<uint32_t>);
+		CALL_MEM_F((&io_write_helper<uint32_t, false>));
 		break;
 
 	case SIZE16:
-		CALL_F(&io_write_helper<uint16_t>);
+		CALL_MEM_F((&io_write_helper<uint16_t, false>));
 		break;
 
 	case SIZE8:
-		CALL_F(&io_write_helper<uint8_t>);
+		CALL_MEM_F((&io_write_helper<uint8_t, false>));
 		break;
 
 	default:
@@ -2385,8 +3173,8 @@ void lc86_jit::gen_fpu_stack_check()
 	TEST(EAX, FPU_EXP_INVALID);
 	BR_NE(exp_masked);
 	static const char *abort_msg = "Unmasked fpu stack exception not supported";
-	MOV(RCX, abort_msg);
-	MOV(RAX, &cpu_runtime_abort);
+	MOV_PTR(RCX, abort_msg);
+	MOV_PTR(RAX, &cpu_runtime_abort);
 	CALL(RAX); // won't return
 	INT3();
 	m_a.bind(exp_masked);
@@ -2444,8 +3232,8 @@ lc86_jit::gen_fpu_exp_post_check()
 	CMP(DX, FPU_EXP_ALL);
 	BR_EQ(no_exp);
 	static const char *abort_msg = "Unmasked fpu exceptions are not supported";
-	MOV(RCX, abort_msg);
-	MOV(RAX, &cpu_runtime_abort);
+	MOV_PTR(RCX, abort_msg);
+	MOV_PTR(RAX, &cpu_runtime_abort);
 	CALL(RAX); // won't return
 	INT3();
 	m_a.bind(no_exp);
@@ -3421,7 +4209,7 @@ void lc86_jit::int_(ZydisDecodedInstruction *instr)
 		MOV(MEMD16(RCX, CPU_EXP_CODE), 0);
 		MOV(MEMD16(RCX, CPU_EXP_IDX), EXP_OF);
 		MOV(MEMD32(RCX, CPU_EXP_EIP), m_cpu->instr_eip + m_cpu->instr_bytes);
-		MOV(RAX, &cpu_raise_exception<true>);
+		MOV_PTR(RAX, &cpu_raise_exception<true>);
 		CALL(RAX);
 		gen_epilogue_main<false>();
 		m_a.bind(no_exp);
@@ -3440,7 +4228,7 @@ void lc86_jit::int_(ZydisDecodedInstruction *instr)
 		}
 
 		MOV(MEMD32(RCX, CPU_EXP_EIP), m_cpu->instr_eip + m_cpu->instr_bytes);
-		MOV(RAX, &cpu_raise_exception<true>);
+		MOV_PTR(RAX, &cpu_raise_exception<true>);
 		CALL(RAX);
 		gen_epilogue_main<false>();
 
@@ -4077,6 +4865,7 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 
 		gen_stack_push(ret_eip);
 		ST_R32(CPU_CTX_EIP, call_eip);
+		gen_ret_stack_push(ret_eip);
 		gen_link_direct(call_pc, nullptr, call_pc);
 		m_cpu->tc->flags |= TC_FLG_DIRECT;
 	}
@@ -4102,6 +4891,7 @@ lc86_jit::call(ZydisDecodedInstruction *instr)
 				MOVZX(EAX, AX);
 			}
 			ST_R32(CPU_CTX_EIP, EAX);
+			gen_ret_stack_push(ret_eip);
 			gen_link_indirect();
 			m_cpu->tc->flags |= TC_FLG_INDIRECT;
 		}
@@ -4963,7 +5753,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DL, AL);
 				});
-			MOV(RAX, &divb_helper);
+			MOV_PTR(RAX, &divb_helper);
 			break;
 
 		case SIZE16:
@@ -4977,7 +5767,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DX, AX);
 				});
-			MOV(RAX, &divw_helper);
+			MOV_PTR(RAX, &divw_helper);
 			break;
 
 		case SIZE32:
@@ -4991,7 +5781,7 @@ lc86_jit::div(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(EDX, EAX);
 				});
-			MOV(RAX, &divd_helper);
+			MOV_PTR(RAX, &divd_helper);
 			break;
 
 		default:
@@ -5271,8 +6061,8 @@ lc86_jit::hlt(ZydisDecodedInstruction *instr)
 		// required to be run by the test) is actually executed
 		if (m_cpu->cpu_flags & CPU_ABORT_ON_HLT) {
 			static const char *abort_msg = "Encountered HLT instruction, terminating the emulation";
-			MOV(RCX, abort_msg);
-			MOV(RAX, &cpu_runtime_abort); // won't return
+			MOV_PTR(RCX, abort_msg);
+			MOV_PTR(RAX, &cpu_runtime_abort); // won't return
 			CALL(RAX);
 			INT3();
 		}
@@ -5294,6 +6084,17 @@ lc86_jit::hlt(ZydisDecodedInstruction *instr)
 				MOV(MEMD8(RCX, CPU_CTX_HALTED), 1); // set halted flag
 				m_a.bind(no_timeout);
 			}
+			else if (m_cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT) {
+				// the hw int might have been raised already by an io callback, so check it once like hlt_helper does. Otherwise, nothing else can raise it
+				// before cpu_run_instructions returns, so the rest of the budget is spent halted
+				Label woken = m_a.newLabel();
+				CALL_F(&hlt_helper);
+				TEST(EAX, EAX);
+				BR_NE(woken);
+				MOV(MEMD64(RCX, CPU_CTX_INSTR_BUDGET), 0);
+				MOV(MEMD8(RCX, CPU_CTX_HALTED), 1); // set halted flag
+				m_a.bind(woken);
+			}
 			else {
 				Label retry = m_a.newLabel();
 				m_a.bind(retry);
@@ -5337,7 +6138,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DL, AL);
 				});
-			MOV(RAX, &idivb_helper);
+			MOV_PTR(RAX, &idivb_helper);
 			break;
 
 		case SIZE16:
@@ -5351,7 +6152,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(DX, AX);
 				});
-			MOV(RAX, &idivw_helper);
+			MOV_PTR(RAX, &idivw_helper);
 			break;
 
 		case SIZE32:
@@ -5365,7 +6166,7 @@ lc86_jit::idiv(ZydisDecodedInstruction *instr)
 					LD_MEM();
 					MOV(EDX, EAX);
 				});
-			MOV(RAX, &idivd_helper);
+			MOV_PTR(RAX, &idivd_helper);
 			break;
 
 		default:
@@ -5755,7 +6556,7 @@ lc86_jit::iret(ZydisDecodedInstruction *instr)
 		CALL_F(&lret_pe_helper<true>);
 		TEST(EAX, EAX);
 		BR_NE(exp);
-		gen_link_ret();
+		gen_link_indirect();
 		m_a.bind(exp);
 		RAISEin_no_param_f();
 	}
@@ -5763,7 +6564,7 @@ lc86_jit::iret(ZydisDecodedInstruction *instr)
 		MOV(R8D, m_cpu->instr_eip);
 		MOV(DL, m_cpu->size_mode);
 		CALL_F(&iret_real_helper);
-		gen_link_ret();
+		gen_link_indirect();
 	}
 
 	m_cpu->tc->flags |= TC_FLG_RET;
@@ -6146,7 +6947,7 @@ lc86_jit::lahf(ZydisDecodedInstruction *instr)
 	MOVZX(EAX, MEMD8(RCX, CPU_CTX_EFLAGS_AUX + 1));
 	MOVZX(EBX, DL);
 	XOR(RBX, RAX);
-	MOV(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
+	MOV_PTR(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
 	MOVZX(R8D, MEMS8(RBX, RAX, 0));
 	XOR(EAX, EAX);
 	XOR(R8D, 1);
@@ -7808,7 +8609,7 @@ lc86_jit::pushf(ZydisDecodedInstruction *instr)
 	MOVZX(EAX, MEMD8(RCX, CPU_CTX_EFLAGS_AUX + 1));
 	MOVZX(EBX, DL);
 	XOR(RBX, RAX);
-	MOV(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
+	MOV_PTR(RAX, &m_cpu->cpu_ctx.lazy_eflags.parity);
 	MOVZX(R9D, MEMS8(RBX, RAX, 0));
 	XOR(EAX, EAX);
 	XOR(R9D, 1);
@@ -7973,7 +8774,13 @@ lc86_jit::ret(ZydisDecodedInstruction *instr)
 		LIB86CPU_ABORT();
 	}
 
-	gen_link_ret();
+	if (instr->opcode >= 0xCA) {
+		// far rets are not pushed by the calls to the return stack buffer
+		gen_link_indirect();
+	}
+	else {
+		gen_link_ret();
+	}
 	m_cpu->tc->flags |= TC_FLG_RET;
 	m_cpu->translate_next = 0;
 }
@@ -38,13 +38,27 @@ class lc86_jit : public Target {
 public:
 	lc86_jit(cpu_t *cpu);
 	void gen_code_block();
+	void load_code_block(const uint8_t *code, uint32_t code_size, const std::vector<jit_reloc_t> &relocs);
+	void get_code_image(std::vector<uint8_t> &code, std::vector<jit_reloc_t> &relocs) const;
+	static uint64_t get_code_fingerprint();
 	void gen_tc_prologue() { start_new_session(); gen_exit_func(); gen_prologue_main(); }
 	void gen_tc_epilogue();
+	void gen_accessed_mark();
+	void gen_exec_counter();
+	void gen_self_check();
+	void gen_loop_head();
+	void gen_instr_count_check();
+	void gen_reg_cache_begin(ZydisDecodedInstruction *instr);
+	void set_flags_dead(bool is_dead) { m_flags_dead = is_dead; }
+	void set_optimize(bool optimize) { m_optimize = optimize; }
+	bool is_optimizing() const { return m_optimize; }
 	void gen_aux_funcs();
 	void gen_hook(hook_t hook_addr);
 	void gen_raise_exp_inline(uint32_t fault_addr, uint16_t code, uint16_t idx, uint32_t eip);
+	void patch_link(translated_code_t *tc, uint32_t idx);
 	void free_code_block(void *addr) { m_mem.release_sys_mem(addr); }
 	void destroy_all_code() { m_mem.destroy_all_blocks(); }
+	size_t get_code_mem_size() const { return m_mem.get_reserved_size(); }
 
 	void aaa(ZydisDecodedInstruction *instr);
 	void aad(ZydisDecodedInstruction *instr);
@@ -166,16 +180,22 @@ public:
 	void xlat(ZydisDecodedInstruction *instr);
 	void xor_(ZydisDecodedInstruction *instr);
 
-#if defined(_WIN64) || defined (__linux__)
-	void gen_exception_info(uint8_t *code_ptr, size_t code_size);
+#if defined(_WIN64)
+	void gen_exception_info(uint8_t *code_ptr, uint8_t *wr_code_ptr, size_t code_size);
 #endif
 
 private:
 	void start_new_session();
+	void finish_code_block(mem_block &block, size_t offset, size_t code_size);
+	template<typename T>
+	void gen_mov_ptr(x86::Gp reg, T ptr);
 	void gen_prologue_main();
-	template<bool set_ret = true>
+	template<bool set_ret = true, bool flush_regs = true>
 	void gen_epilogue_main();
 	void gen_tail_call(x86::Gp addr);
+	void gen_set_jmp_taken(uint32_t jmp_taken);
+	void gen_link_jmp(uint32_t idx, bool set_jmp_taken, bool cross_page);
+	void gen_loop_jmp();
 	void gen_exit_func();
 	void gen_interrupt_check();
 	void gen_no_link_checks();
@@ -185,6 +205,7 @@ private:
 	void gen_link_dst_only();
 	void gen_link_indirect();
 	void gen_link_ret();
+	void gen_ret_stack_push(addr_t ret_eip);
 	template<typename T>
 	void gen_link_dst_cond(T &&lambda);
 	template<bool terminates, typename T1, typename T2, typename T3, typename T4>
@@ -230,9 +251,17 @@ private:
 	void ld_of(x86::Gp dst, x86::Gp aux);
 	void ld_sf(x86::Gp res_dst, x86::Gp aux);
 	void ld_pf(x86::Gp dst, x86::Gp res, x86::Gp aux);
+	void gen_reg_cache_flush();
+	void gen_reg_cache_reload();
+	int find_cached_reg(size_t reg_offset);
 	void load_reg(x86::Gp dst, size_t reg_offset, size_t size);
 	template<typename T>
 	void store_reg(T val, size_t reg_offset, size_t size);
+	template<bool is_write>
+	void gen_dtlb_lookup(uint8_t size, uint8_t is_priv, Label slow);
+	void gen_mem_fault_check();
+	void gen_mem_fault_stub();
+	void gen_self_check_stub();
 	void load_mem(uint8_t size, uint8_t is_priv);
 	template<typename T, bool dont_write = false>
 	void store_mem(T val, uint8_t size, uint8_t is_priv);
@@ -278,6 +307,15 @@ private:
 	CodeHolder m_code;
 	x86::Assembler m_a;
 	bool m_needs_epilogue;
+	bool m_flags_dead; // when true, the set_flags* functions don't emit anything because the flags of the current instr are overwritten before being read
+	bool m_optimize; // when true, the tc is a hot tc being recompiled, and the more expensive code generation (reg cache, dead flags, inline tlb lookups) is used
+	uint8_t m_reg_saved, m_reg_loaded, m_reg_dirty; // bitmasks of the entries of reg_cache_map, see lc86_jit::gen_reg_cache_begin
+	Label m_mem_fault; // shared by all the memory accesses of the tc that can report a page fault, see lc86_jit::gen_mem_fault_check
+	Label m_self_check, m_self_check_ret; // see lc86_jit::gen_self_check
+	Label m_loop_head; // where the branches to the first instr of the tc jump, see lc86_jit::gen_loop_head
+	addr_t m_loop_pc; // virt_pc of m_loop_head
+	size_t m_instr_count_off; // offset of the imm32 patched by gen_tc_epilogue, or zero, see lc86_jit::gen_instr_count_check
+	std::vector<jit_reloc_t> m_relocs; // host pointers embedded in the code of the current tc, see lc86_jit::gen_mov_ptr
 	mem_manager m_mem;
 };
 
@@ -872,6 +872,8 @@ update_drN_helper(cpu_ctx_t *cpu_ctx, uint8_t dr_idx, uint32_t new_dr)
 						break;
 					}
 				}
+				// the dtlb entries cache if a page has a watchpoint, so they need to be refreshed
+				tlb_flush(cpu_ctx->cpu);
 			}
 		}
 	}
@@ -897,6 +899,7 @@ update_drN_helper(cpu_ctx_t *cpu_ctx, uint8_t dr_idx, uint32_t new_dr)
 				}
 			}
 		}
+		tlb_flush(cpu_ctx->cpu);
 	}
 	break;
 
@@ -12,7 +12,7 @@
 
 
 template<bool remove_hook = false>
-void tc_invalidate(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_t size = 0, [[maybe_unused]] uint32_t eip = 0);
+void tc_invalidate(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint32_t size = 0, [[maybe_unused]] uint32_t eip = 0);
 template<bool should_flush_tlb>
 void tc_should_clear_cache_and_tlb(cpu_t *cpu, addr_t start, addr_t end);
 void tc_cache_clear(cpu_t *cpu);
@@ -24,6 +24,8 @@ uint32_t JIT_API cpu_do_int(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
 void fpu_init(cpu_t *cpu);
 void JIT_API fpu_update_tag(cpu_ctx_t *cpu_ctx, uint32_t idx);
 void halt_loop(cpu_t *cpu);
+bool cpu_interp_translate(cpu_t *cpu);
+translated_code_t *tc_run_interp(cpu_ctx_t *cpu_ctx, translated_code_t *tc);
 void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 
 
@@ -38,6 +40,7 @@ void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 // HFLG_CR4_OSFXSR: osfxsr flag of cr4
 // HFLG_CR0_TS: ts flag of cr0
 // HFLG_TIMEOUT: timeout check was emitted
+// HFLG_INSTR_COUNT: instr count check was emitted
 #define CPL_SHIFT           0
 #define CS32_SHIFT          2
 #define SS32_SHIFT          3
@@ -49,6 +52,7 @@ void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 #define CR0_TS_SHIFT        10
 #define TIMEOUT_SHIFT       11
 #define INHIBIT_INT_SHIFT   14
+#define INSTR_COUNT_SHIFT   15
 #define HFLG_INVALID        (1 << 31) // this should use a bit position that doesn't overlap with either HFLG_CONST or EFLAGS_CONST
 #define HFLG_CPL            (3 << CPL_SHIFT)
 #define HFLG_CS32           (1 << CS32_SHIFT)
@@ -59,9 +63,10 @@ void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 #define HFLG_DBG_TRAP       (1 << DBG_TRAP_SHIFT)
 #define HFLG_TIMEOUT        (1 << TIMEOUT_SHIFT)
 #define HFLG_INHIBIT_INT    (1 << INHIBIT_INT_SHIFT)
+#define HFLG_INSTR_COUNT    (1 << INSTR_COUNT_SHIFT)
 #define HFLG_CR0_TS         (1 << CR0_TS_SHIFT)
 #define HFLG_CR4_OSFXSR     (1 << CR4_OSFXSR_SHIFT)
-#define HFLG_CONST          (HFLG_CPL | HFLG_CS32 | HFLG_SS32 | HFLG_PE_MODE | HFLG_CR0_EM | HFLG_TRAMP | HFLG_TIMEOUT | HFLG_CR0_TS | HFLG_CR4_OSFXSR)
+#define HFLG_CONST          (HFLG_CPL | HFLG_CS32 | HFLG_SS32 | HFLG_PE_MODE | HFLG_CR0_EM | HFLG_TRAMP | HFLG_TIMEOUT | HFLG_CR0_TS | HFLG_CR4_OSFXSR | HFLG_INSTR_COUNT)
 
 // cpu interrupt flags
 #define CPU_NO_INT      0
@@ -97,6 +102,8 @@ void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 #define TC_FLG_RET             (1 << 6)
 #define TC_FLG_DST_ONLY        (1 << 7)  // jump(dest_pc)
 #define TC_FLG_DST_COND        (1 << 8)  // jump(dest_pc) based on binary condition
+#define TC_FLG_INTERP          (1 << 9)  // tc is run by the interpreter
+#define TC_FLG_SELF_CHECK      (1 << 10) // tc compares its guest code with the one it was translated from when it runs, instead of being invalidated by writes
 #define TC_FLG_LINK_MASK  (TC_FLG_INDIRECT | TC_FLG_DIRECT | TC_FLG_RET | TC_FLG_DST_ONLY | TC_FLG_DST_COND)
 
 // segment descriptor flags
@@ -256,6 +263,7 @@ void JIT_API tlb_invalidate_(cpu_ctx_t *cpu_ctx, addr_t addr);
 #define TLB_MMIO        (1 << 7)  // page is backed by mmio
 #define TLB_GLOBAL      (1 << 8)  // page has global flag in its pte
 #define TLB_DIRTY       (1 << 9)  // page was written to at least once
+#define TLB_WATCH       (1 << 10) // page overlaps with a data watchpoint, so accesses to it must be done by the memory helpers
 #define TLB_SUBPAGE     (1 << 11) // page is backed by different memory regions
 #define TLB_VALID       (TLB_SUP_READ | TLB_SUP_WRITE | TLB_USER_READ | TLB_USER_WRITE) // entry is valid
 
@@ -295,6 +303,7 @@ CR0_TS_MASK | CR0_EM_MASK | CR0_MP_MASK | CR0_PE_MASK)
 #define DR6_BD_MASK      (1 << 13)
 #define DR6_BS_MASK      (1 << 14)
 #define DR6_RES_MASK     0xFFFF0FF0 // dr6 reserved bits
+#define DR7_EN_MASK      0xFF // local and global enable bits of dr0-3
 #define DR7_GD_MASK      (1 << 13)
 #define DR7_RES_MASK     0x400 // dr7 reserved bits
 #define DR7_TYPE_SHIFT   16
@@ -414,4 +423,9 @@ CR0_TS_MASK | CR0_EM_MASK | CR0_MP_MASK | CR0_PE_MASK)
 #define MXCSR_MASK 0x0000FFBF
 
 #define X86_MAX_INSTR_LENGTH 15
+#define FLAGS_LOOKAHEAD_MAX  8 // max number of instructions scanned by the dead flags analysis in cpu_translate
+#define SUPERBLOCK_HOT_COUNT 64 // number of executions after which a tc is merged with its linked successors in a superblock
+#define SUPERBLOCK_MAX_TC    8 // max number of tc's that can be merged in a superblock
+#define INTERP_HOT_COUNT     16 // number of executions after which an interpreted tc is translated with the jit
+#define SMC_CHECK_THRESHOLD  8 // number of writes that invalidated the tc's of a page, after which its code is translated with self checking tc's
 #define INTEL_MICROCODE_ID   (1ULL << 32)
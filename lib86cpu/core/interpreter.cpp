@@ -0,0 +1,846 @@
+/*
+ * threaded interpreter for cold guest code
+ *
+ * Translating a block with the jit costs far more than running it a few times, which is all that most of the guest code ever does (e.g. the bios and the
+ * boot code). Because of that, blocks made only of the simple instructions supported here are first decoded into an array of interp_instr_t, each holding
+ * a pointer to a handler specialized for its operands and size. The handlers reuse the same memory helpers and lazy eflags of the jitted code, so that
+ * the guest state is identical no matter which tier runs a tc. After INTERP_HOT_COUNT executions, cpu_main_loop translates the tc with the jit
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#include "internal.h"
+#include "memory_management.h"
+#include "emitter_common.h"
+#include <cstring>
+#include <type_traits>
+
+// mem_flags of interp_instr_t
+#define INTERP_MEM_BASE   (1 << 0)
+#define INTERP_MEM_INDEX  (1 << 1)
+#define INTERP_MEM_ADDR16 (1 << 2)
+
+enum class opnd_t {
+	reg,
+	imm,
+	mem,
+};
+
+enum class alu_t {
+	add,
+	or_,
+	and_,
+	sub,
+	xor_,
+	cmp,
+	test,
+};
+
+
+template<typename T>
+static T
+ld_reg(cpu_ctx_t *cpu_ctx, uint32_t offset)
+{
+	T val;
+	std::memcpy(&val, reinterpret_cast<uint8_t *>(cpu_ctx) + offset, sizeof(T));
+	return val;
+}
+
+template<typename T>
+static void
+st_reg(cpu_ctx_t *cpu_ctx, uint32_t offset, T val)
+{
+	std::memcpy(reinterpret_cast<uint8_t *>(cpu_ctx) + offset, &val, sizeof(T));
+}
+
+template<typename T>
+static uint32_t
+sign_extend(T val)
+{
+	return static_cast<uint32_t>(static_cast<std::make_signed_t<T>>(val));
+}
+
+template<typename T>
+static uint32_t
+to_auxbits(T vec)
+{
+	// same as gen_sum_vec16_8 and gen_sub_vec16_8: move the carries out of the two msb to bits 31 and 30, and keep the af carry in bit 3
+	if constexpr (sizeof(T) == 4) {
+		return vec & 0xC0000008;
+	}
+	else {
+		uint32_t vec32 = vec;
+		return ((vec32 << (32 - sizeof(T) * 8)) | vec32) & 0xC0000008;
+	}
+}
+
+template<typename T>
+static void
+set_flags(cpu_ctx_t *cpu_ctx, T res)
+{
+	cpu_ctx->lazy_eflags.result = sign_extend(res);
+	cpu_ctx->lazy_eflags.auxbits = 0;
+}
+
+template<typename T>
+static void
+set_flags_sum(cpu_ctx_t *cpu_ctx, T a, T b, T sum)
+{
+	cpu_ctx->lazy_eflags.result = sign_extend(sum);
+	cpu_ctx->lazy_eflags.auxbits = to_auxbits<T>((a & b) | ((a | b) & ~sum));
+}
+
+template<typename T>
+static void
+set_flags_sub(cpu_ctx_t *cpu_ctx, T a, T b, T sub)
+{
+	cpu_ctx->lazy_eflags.result = sign_extend(sub);
+	cpu_ctx->lazy_eflags.auxbits = to_auxbits<T>((~a & b) | (~(a ^ b) & sub));
+}
+
+static uint32_t
+get_mem_offset(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// same as lc86_jit::get_operand. With 16 bit addressing, truncating the 32 bit sum gives the same offset of the 16 bit additions done by the jit
+	uint32_t offset = instr->disp;
+	if (instr->mem_flags & INTERP_MEM_BASE) {
+		offset += ld_reg<uint32_t>(cpu_ctx, instr->base);
+	}
+	if (instr->mem_flags & INTERP_MEM_INDEX) {
+		offset += (ld_reg<uint32_t>(cpu_ctx, instr->index) << instr->scale);
+	}
+	if (instr->mem_flags & INTERP_MEM_ADDR16) {
+		offset &= 0xFFFF;
+	}
+
+	return offset;
+}
+
+static addr_t
+get_mem_addr(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	return ld_reg<uint32_t>(cpu_ctx, instr->seg_base) + get_mem_offset(cpu_ctx, instr);
+}
+
+template<typename T, opnd_t src_type>
+static T
+ld_src(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	if constexpr (src_type == opnd_t::reg) {
+		return ld_reg<T>(cpu_ctx, instr->src);
+	}
+	else if constexpr (src_type == opnd_t::imm) {
+		return static_cast<T>(instr->src);
+	}
+	else {
+		return mem_read_helper<T>(cpu_ctx, get_mem_addr(cpu_ctx, instr), instr->eip, 0);
+	}
+}
+
+// NOTE: all the handlers below must not update the eip, which is only written by the instr that ends the tc, like the jit does. Otherwise, tc_invalidate
+// will not detect guest writes to the tc being interpreted, and it will delete it while it's still running
+
+template<typename T, opnd_t dst_type, opnd_t src_type>
+static interp_instr_t *
+interp_mov(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	T val = ld_src<T, src_type>(cpu_ctx, instr);
+	if constexpr (dst_type == opnd_t::mem) {
+		mem_write_helper<T>(cpu_ctx, get_mem_addr(cpu_ctx, instr), val, instr->eip, 0);
+	}
+	else {
+		st_reg<T>(cpu_ctx, instr->dst, val);
+	}
+
+	return instr + 1;
+}
+
+template<alu_t op, typename T, opnd_t dst_type, opnd_t src_type>
+static interp_instr_t *
+interp_alu(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	T a, b, res;
+	[[maybe_unused]] addr_t addr;
+	if constexpr (dst_type == opnd_t::mem) {
+		addr = get_mem_addr(cpu_ctx, instr);
+		a = mem_read_helper<T>(cpu_ctx, addr, instr->eip, 0);
+	}
+	else {
+		a = ld_reg<T>(cpu_ctx, instr->dst);
+	}
+	b = ld_src<T, src_type>(cpu_ctx, instr);
+
+	if constexpr (op == alu_t::add) {
+		res = a + b;
+	}
+	else if constexpr (op == alu_t::or_) {
+		res = a | b;
+	}
+	else if constexpr ((op == alu_t::and_) || (op == alu_t::test)) {
+		res = a & b;
+	}
+	else if constexpr ((op == alu_t::sub) || (op == alu_t::cmp)) {
+		res = a - b;
+	}
+	else {
+		res = a ^ b;
+	}
+
+	// the result is written before the flags, so that a fault on the write leaves the guest state untouched
+	if constexpr ((op != alu_t::cmp) && (op != alu_t::test)) {
+		if constexpr (dst_type == opnd_t::mem) {
+			mem_write_helper<T>(cpu_ctx, addr, res, instr->eip, 0);
+		}
+		else {
+			st_reg<T>(cpu_ctx, instr->dst, res);
+		}
+	}
+
+	if constexpr (op == alu_t::add) {
+		set_flags_sum<T>(cpu_ctx, a, b, res);
+	}
+	else if constexpr ((op == alu_t::sub) || (op == alu_t::cmp)) {
+		set_flags_sub<T>(cpu_ctx, a, b, res);
+	}
+	else {
+		set_flags<T>(cpu_ctx, res);
+	}
+
+	return instr + 1;
+}
+
+template<bool is_inc, typename T, opnd_t dst_type>
+static interp_instr_t *
+interp_inc_dec(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	T a, res;
+	[[maybe_unused]] addr_t addr;
+	if constexpr (dst_type == opnd_t::mem) {
+		addr = get_mem_addr(cpu_ctx, instr);
+		a = mem_read_helper<T>(cpu_ctx, addr, instr->eip, 0);
+	}
+	else {
+		a = ld_reg<T>(cpu_ctx, instr->dst);
+	}
+
+	res = is_inc ? a + 1 : a - 1;
+	if constexpr (dst_type == opnd_t::mem) {
+		mem_write_helper<T>(cpu_ctx, addr, res, instr->eip, 0);
+	}
+	else {
+		st_reg<T>(cpu_ctx, instr->dst, res);
+	}
+
+	// inc and dec don't change cf, so restore it in the auxbits while keeping the new of, like lc86_jit::inc and lc86_jit::dec do
+	uint32_t cf = cpu_ctx->lazy_eflags.auxbits & 0x80000000;
+	if constexpr (is_inc) {
+		set_flags_sum<T>(cpu_ctx, a, 1, res);
+	}
+	else {
+		set_flags_sub<T>(cpu_ctx, a, 1, res);
+	}
+	uint32_t aux = cpu_ctx->lazy_eflags.auxbits;
+	uint32_t of = ((aux << 1) ^ aux) & 0x80000000;
+	cpu_ctx->lazy_eflags.auxbits = (((of ^ cf) >> 1) | cf) | (aux & 0x3FFFFFFF);
+
+	return instr + 1;
+}
+
+template<typename T>
+static interp_instr_t *
+interp_lea(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	st_reg<T>(cpu_ctx, instr->dst, static_cast<T>(get_mem_offset(cpu_ctx, instr)));
+	return instr + 1;
+}
+
+template<bool is_signed, typename T, typename S, opnd_t src_type>
+static interp_instr_t *
+interp_movx(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// movzx and movsx, T is the size of the dst reg and S the size of the src
+	S val = ld_src<S, src_type>(cpu_ctx, instr);
+	if constexpr (is_signed) {
+		st_reg<T>(cpu_ctx, instr->dst, static_cast<T>(static_cast<std::make_signed_t<S>>(val)));
+	}
+	else {
+		st_reg<T>(cpu_ctx, instr->dst, static_cast<T>(val));
+	}
+
+	return instr + 1;
+}
+
+template<typename T, opnd_t src_type>
+static interp_instr_t *
+interp_push(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// same as lc86_jit::gen_stack_push. The esp is only updated after the write, so that a fault on it leaves the guest state untouched
+	T val = ld_src<T, src_type>(cpu_ctx, instr);
+	if (cpu_ctx->hflags & HFLG_SS32) {
+		uint32_t esp = cpu_ctx->regs.esp - sizeof(T);
+		mem_write_helper<T>(cpu_ctx, cpu_ctx->regs.ss_hidden.base + esp, val, instr->eip, 0);
+		cpu_ctx->regs.esp = esp;
+	}
+	else {
+		uint16_t sp = static_cast<uint16_t>(cpu_ctx->regs.esp - sizeof(T));
+		mem_write_helper<T>(cpu_ctx, cpu_ctx->regs.ss_hidden.base + sp, val, instr->eip, 0);
+		cpu_ctx->regs.esp = (cpu_ctx->regs.esp & 0xFFFF0000) | sp;
+	}
+
+	return instr + 1;
+}
+
+template<typename T>
+static interp_instr_t *
+interp_pop(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// same as lc86_jit::gen_stack_pop. The esp is written before the dst reg, so that pop esp loads the popped val like lc86_jit::pop does
+	T val;
+	if (cpu_ctx->hflags & HFLG_SS32) {
+		val = mem_read_helper<T>(cpu_ctx, cpu_ctx->regs.ss_hidden.base + cpu_ctx->regs.esp, instr->eip, 0);
+		cpu_ctx->regs.esp += sizeof(T);
+	}
+	else {
+		uint16_t sp = static_cast<uint16_t>(cpu_ctx->regs.esp);
+		val = mem_read_helper<T>(cpu_ctx, cpu_ctx->regs.ss_hidden.base + sp, instr->eip, 0);
+		cpu_ctx->regs.esp = (cpu_ctx->regs.esp & 0xFFFF0000) | static_cast<uint16_t>(sp + sizeof(T));
+	}
+	st_reg<T>(cpu_ctx, instr->dst, val);
+
+	return instr + 1;
+}
+
+static interp_instr_t *
+interp_nop(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	return instr + 1;
+}
+
+static interp_instr_t *
+interp_jmp(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	cpu_ctx->regs.eip = instr->dst;
+	return nullptr;
+}
+
+static interp_instr_t *
+interp_jcc(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// same as read_eflags, but only for the flags needed by the condition
+	uint32_t res = cpu_ctx->lazy_eflags.result;
+	uint32_t aux = cpu_ctx->lazy_eflags.auxbits;
+	bool cf = aux >> 31;
+	bool zf = res == 0;
+	bool sf = (res >> 31) ^ (aux & 1);
+	bool of = ((aux ^ (aux << 1)) >> 31);
+	bool taken;
+
+	switch (instr->src >> 1)
+	{
+	case 0: // jo
+		taken = of;
+		break;
+
+	case 1: // jb
+		taken = cf;
+		break;
+
+	case 2: // jz
+		taken = zf;
+		break;
+
+	case 3: // jbe
+		taken = cf | zf;
+		break;
+
+	case 4: // js
+		taken = sf;
+		break;
+
+	case 5: // jp
+		taken = cpu_ctx->lazy_eflags.parity[(res ^ (aux >> 8)) & 0xFF] ^ 1;
+		break;
+
+	case 6: // jl
+		taken = sf ^ of;
+		break;
+
+	case 7: // jle
+		taken = zf | (sf ^ of);
+		break;
+
+	default:
+		LIB86CPU_ABORT();
+	}
+
+	// odd condition codes are the negation of the previous one
+	cpu_ctx->regs.eip = (taken ^ (instr->src & 1)) ? instr->dst : instr->next_eip;
+	return nullptr;
+}
+
+static interp_instr_t *
+interp_end(cpu_ctx_t *cpu_ctx, interp_instr_t *instr)
+{
+	// appended after the last instr of a tc that doesn't end with a jmp, that is, when it stopped because an instr crossed a page or it's a one-instr tc
+	cpu_ctx->regs.eip = instr->eip;
+	return nullptr;
+}
+
+template<typename T>
+static interp_fn_t
+select_size(unsigned size, T &&lambda)
+{
+	switch (size)
+	{
+	case 8:
+		return lambda(uint8_t());
+
+	case 16:
+		return lambda(uint16_t());
+
+	case 32:
+		return lambda(uint32_t());
+
+	default:
+		return nullptr;
+	}
+}
+
+template<alu_t op>
+static interp_fn_t
+select_alu(opnd_t dst_type, opnd_t src_type, unsigned size)
+{
+	return select_size(size, [dst_type, src_type](auto val) -> interp_fn_t {
+		using T = decltype(val);
+		if (dst_type == opnd_t::mem) {
+			return src_type == opnd_t::reg ? &interp_alu<op, T, opnd_t::mem, opnd_t::reg> : &interp_alu<op, T, opnd_t::mem, opnd_t::imm>;
+		}
+		switch (src_type)
+		{
+		case opnd_t::reg:
+			return &interp_alu<op, T, opnd_t::reg, opnd_t::reg>;
+
+		case opnd_t::imm:
+			return &interp_alu<op, T, opnd_t::reg, opnd_t::imm>;
+
+		default:
+			return &interp_alu<op, T, opnd_t::reg, opnd_t::mem>;
+		}
+		});
+}
+
+static interp_fn_t
+select_mov(opnd_t dst_type, opnd_t src_type, unsigned size)
+{
+	return select_size(size, [dst_type, src_type](auto val) -> interp_fn_t {
+		using T = decltype(val);
+		if (dst_type == opnd_t::mem) {
+			return src_type == opnd_t::reg ? &interp_mov<T, opnd_t::mem, opnd_t::reg> : &interp_mov<T, opnd_t::mem, opnd_t::imm>;
+		}
+		switch (src_type)
+		{
+		case opnd_t::reg:
+			return &interp_mov<T, opnd_t::reg, opnd_t::reg>;
+
+		case opnd_t::imm:
+			return &interp_mov<T, opnd_t::reg, opnd_t::imm>;
+
+		default:
+			return &interp_mov<T, opnd_t::reg, opnd_t::mem>;
+		}
+		});
+}
+
+template<bool is_signed>
+static interp_fn_t
+select_movx(opnd_t src_type, unsigned dst_size, unsigned src_size)
+{
+	return select_size(dst_size, [src_type, src_size](auto dst_val) -> interp_fn_t {
+		using T = decltype(dst_val);
+		return select_size(src_size, [src_type](auto src_val) -> interp_fn_t {
+			using S = decltype(src_val);
+			if constexpr (sizeof(S) >= sizeof(T)) {
+				// movzx r16, r/m16 is not supported by the jit either
+				return nullptr;
+			}
+			else {
+				return src_type == opnd_t::mem ? &interp_movx<is_signed, T, S, opnd_t::mem> : &interp_movx<is_signed, T, S, opnd_t::reg>;
+			}
+			});
+		});
+}
+
+template<bool is_inc>
+static interp_fn_t
+select_inc_dec(opnd_t dst_type, unsigned size)
+{
+	return select_size(size, [dst_type](auto val) -> interp_fn_t {
+		using T = decltype(val);
+		return dst_type == opnd_t::mem ? &interp_inc_dec<is_inc, T, opnd_t::mem> : &interp_inc_dec<is_inc, T, opnd_t::reg>;
+		});
+}
+
+static bool
+interp_decode_operand(ZydisDecodedInstruction *zinstr, unsigned opnum, interp_instr_t *instr, uint32_t &val, opnd_t &type)
+{
+	// returns false if the operand cannot be handled by the interpreter
+
+	ZydisDecodedOperand *operand = &zinstr->operands[opnum];
+	switch (operand->type)
+	{
+	case ZYDIS_OPERAND_TYPE_REGISTER:
+		switch (ZydisRegisterGetClass(operand->reg.value))
+		{
+		case ZYDIS_REGCLASS_GPR8:
+		case ZYDIS_REGCLASS_GPR16:
+		case ZYDIS_REGCLASS_GPR32:
+			val = static_cast<uint32_t>(REG_off(operand->reg.value));
+			type = opnd_t::reg;
+			return true;
+
+		default:
+			return false;
+		}
+
+	case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+		if (zinstr->opcode == 0x83) {
+			// sign extended imm8, see lc86_jit::add
+			val = static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(operand->imm.value.u)));
+		}
+		else {
+			val = static_cast<uint32_t>(operand->imm.value.u);
+		}
+		type = opnd_t::imm;
+		return true;
+
+	case ZYDIS_OPERAND_TYPE_MEMORY:
+		instr->seg_base = static_cast<uint16_t>(REG_off(operand->mem.segment) + seg_base_offset);
+		instr->mem_flags = zinstr->address_width == 32 ? 0 : INTERP_MEM_ADDR16;
+		switch (operand->encoding)
+		{
+		case ZYDIS_OPERAND_ENCODING_DISP16_32_64:
+			instr->disp = static_cast<uint32_t>(operand->mem.disp.value);
+			break;
+
+		case ZYDIS_OPERAND_ENCODING_MODRM_RM:
+			instr->disp = operand->mem.disp.has_displacement ? static_cast<uint32_t>(operand->mem.disp.value) : 0;
+			if (operand->mem.base != ZYDIS_REGISTER_NONE) {
+				instr->base = static_cast<uint16_t>(REG_off(operand->mem.base));
+				instr->mem_flags |= INTERP_MEM_BASE;
+			}
+			if (operand->mem.scale) {
+				instr->index = static_cast<uint16_t>(REG_off(operand->mem.index));
+				instr->scale = zinstr->raw.sib.scale;
+				instr->mem_flags |= INTERP_MEM_INDEX;
+			}
+			break;
+
+		default:
+			return false;
+		}
+		type = opnd_t::mem;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool
+interp_decode_instr(ZydisDecodedInstruction *zinstr, interp_instr_t *instr, bool &ends_tc)
+{
+	// returns false if the instr cannot be handled by the interpreter. The supported instr are a subset of the ones that lc86_jit emits without calling
+	// helpers other than the memory ones, and only in the encodings that the jit supports
+
+	uint32_t dst = 0, src = 0;
+	opnd_t dst_type = opnd_t::reg, src_type = opnd_t::reg;
+	bool is_default_map = zinstr->opcode_map == ZYDIS_OPCODE_MAP_DEFAULT;
+	unsigned size = zinstr->operand_width;
+
+	switch (zinstr->mnemonic)
+	{
+	case ZYDIS_MNEMONIC_MOV:
+		if (!is_default_map || (zinstr->opcode == 0x8C) || (zinstr->opcode == 0x8E)) {
+			// mov to/from segment and control/debug regs
+			return false;
+		}
+		if (!interp_decode_operand(zinstr, OPNUM_DST, instr, dst, dst_type) || !interp_decode_operand(zinstr, OPNUM_SRC, instr, src, src_type)) {
+			return false;
+		}
+		instr->fn = select_mov(dst_type, src_type, size);
+		break;
+
+	case ZYDIS_MNEMONIC_ADD:
+	case ZYDIS_MNEMONIC_OR:
+	case ZYDIS_MNEMONIC_AND:
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_XOR:
+	case ZYDIS_MNEMONIC_CMP:
+	case ZYDIS_MNEMONIC_TEST:
+		// 0x82 is an alias of 0x80 that the jit doesn't support
+		if (!is_default_map || (zinstr->opcode == 0x82)) {
+			return false;
+		}
+		if (!interp_decode_operand(zinstr, OPNUM_DST, instr, dst, dst_type) || !interp_decode_operand(zinstr, OPNUM_SRC, instr, src, src_type)) {
+			return false;
+		}
+		switch (zinstr->mnemonic)
+		{
+		case ZYDIS_MNEMONIC_ADD:
+			instr->fn = select_alu<alu_t::add>(dst_type, src_type, size);
+			break;
+
+		case ZYDIS_MNEMONIC_OR:
+			instr->fn = select_alu<alu_t::or_>(dst_type, src_type, size);
+			break;
+
+		case ZYDIS_MNEMONIC_AND:
+			instr->fn = select_alu<alu_t::and_>(dst_type, src_type, size);
+			break;
+
+		case ZYDIS_MNEMONIC_SUB:
+			instr->fn = select_alu<alu_t::sub>(dst_type, src_type, size);
+			break;
+
+		case ZYDIS_MNEMONIC_XOR:
+			instr->fn = select_alu<alu_t::xor_>(dst_type, src_type, size);
+			break;
+
+		case ZYDIS_MNEMONIC_CMP:
+			instr->fn = select_alu<alu_t::cmp>(dst_type, src_type, size);
+			break;
+
+		default:
+			instr->fn = select_alu<alu_t::test>(dst_type, src_type, size);
+		}
+		break;
+
+	case ZYDIS_MNEMONIC_INC:
+	case ZYDIS_MNEMONIC_DEC:
+		if (!is_default_map || !interp_decode_operand(zinstr, OPNUM_SINGLE, instr, dst, dst_type)) {
+			return false;
+		}
+		instr->fn = zinstr->mnemonic == ZYDIS_MNEMONIC_INC ? select_inc_dec<true>(dst_type, size) : select_inc_dec<false>(dst_type, size);
+		break;
+
+	case ZYDIS_MNEMONIC_LEA:
+		if (!interp_decode_operand(zinstr, OPNUM_DST, instr, dst, dst_type) || !interp_decode_operand(zinstr, OPNUM_SRC, instr, src, src_type)) {
+			return false;
+		}
+		if (src_type != opnd_t::mem) {
+			return false;
+		}
+		instr->fn = size == 16 ? &interp_lea<uint16_t> : &interp_lea<uint32_t>;
+		break;
+
+	case ZYDIS_MNEMONIC_MOVZX:
+	case ZYDIS_MNEMONIC_MOVSX:
+		if (!interp_decode_operand(zinstr, OPNUM_DST, instr, dst, dst_type) || !interp_decode_operand(zinstr, OPNUM_SRC, instr, src, src_type)) {
+			return false;
+		}
+		instr->fn = zinstr->mnemonic == ZYDIS_MNEMONIC_MOVZX ? select_movx<false>(src_type, size, zinstr->operands[OPNUM_SRC].size) :
+			select_movx<true>(src_type, size, zinstr->operands[OPNUM_SRC].size);
+		break;
+
+	case ZYDIS_MNEMONIC_PUSH:
+		// only the gpr and imm pushes, see lc86_jit::push
+		if (!is_default_map || !(((zinstr->opcode >= 0x50) && (zinstr->opcode <= 0x57)) || (zinstr->opcode == 0x68) || (zinstr->opcode == 0x6A))) {
+			return false;
+		}
+		if (!interp_decode_operand(zinstr, OPNUM_SINGLE, instr, src, src_type)) {
+			return false;
+		}
+		if (zinstr->opcode == 0x6A) {
+			src = static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(zinstr->operands[OPNUM_SINGLE].imm.value.u)));
+		}
+		instr->fn = select_size(size, [src_type](auto val) -> interp_fn_t {
+			using T = decltype(val);
+			if constexpr (sizeof(T) == 1) {
+				return nullptr;
+			}
+			else {
+				return src_type == opnd_t::imm ? &interp_push<T, opnd_t::imm> : &interp_push<T, opnd_t::reg>;
+			}
+			});
+		break;
+
+	case ZYDIS_MNEMONIC_POP:
+		// only the gpr pops, see lc86_jit::pop
+		if (!is_default_map || (zinstr->opcode < 0x58) || (zinstr->opcode > 0x5F) || !interp_decode_operand(zinstr, OPNUM_SINGLE, instr, dst, dst_type)) {
+			return false;
+		}
+		instr->fn = size == 16 ? &interp_pop<uint16_t> : &interp_pop<uint32_t>;
+		break;
+
+	case ZYDIS_MNEMONIC_NOP:
+		instr->fn = &interp_nop;
+		break;
+
+	case ZYDIS_MNEMONIC_JMP:
+	case ZYDIS_MNEMONIC_JO:
+	case ZYDIS_MNEMONIC_JNO:
+	case ZYDIS_MNEMONIC_JB:
+	case ZYDIS_MNEMONIC_JNB:
+	case ZYDIS_MNEMONIC_JZ:
+	case ZYDIS_MNEMONIC_JNZ:
+	case ZYDIS_MNEMONIC_JBE:
+	case ZYDIS_MNEMONIC_JNBE:
+	case ZYDIS_MNEMONIC_JS:
+	case ZYDIS_MNEMONIC_JNS:
+	case ZYDIS_MNEMONIC_JP:
+	case ZYDIS_MNEMONIC_JNP:
+	case ZYDIS_MNEMONIC_JL:
+	case ZYDIS_MNEMONIC_JNL:
+	case ZYDIS_MNEMONIC_JLE:
+	case ZYDIS_MNEMONIC_JNLE:
+		// only the relative jumps, see lc86_jit::jmp and lc86_jit::jcc
+		if (zinstr->mnemonic == ZYDIS_MNEMONIC_JMP) {
+			if (!is_default_map || ((zinstr->opcode != 0xE9) && (zinstr->opcode != 0xEB))) {
+				return false;
+			}
+			instr->fn = &interp_jmp;
+		}
+		else {
+			instr->src = zinstr->opcode & 0xF;
+			instr->fn = &interp_jcc;
+		}
+		dst = instr->next_eip + static_cast<uint32_t>(zinstr->operands[OPNUM_SINGLE].imm.value.s);
+		if (size == 16) {
+			dst &= 0x0000FFFF;
+		}
+		instr->dst = dst;
+		ends_tc = true;
+		return true;
+
+	default:
+		return false;
+	}
+
+	instr->dst = dst;
+	instr->src = src;
+	return instr->fn != nullptr;
+}
+
+bool
+cpu_interp_translate(cpu_t *cpu)
+{
+	// Decodes the guest code at disas_ctx in the interp_code of the current tc, if the interpreter supports all of its instr. The tc ends where cpu_translate
+	// would end it, so that it covers the same guest code of its jitted version. Instr breakpoints and hooks are left to the jit, because they need code
+	// emitted at the start or after every instr. One-instr tc's are interpreted too, unless they are used for single stepping, debug traps or inhibited
+	// interrupts, since those need the checks that gen_no_link_checks emits after the instr
+
+	disas_ctx_t disas_ctx = cpu->disas_ctx;
+	if ((cpu->cpu_ctx.regs.dr[7] & DR7_EN_MASK) || (cpu->hook_map.find(disas_ctx.virt_pc) != cpu->hook_map.end())) {
+		return false;
+	}
+
+	if ((disas_ctx.flags & DISAS_FLG_ONE_INSTR) && ((disas_ctx.flags & DISAS_FLG_INHIBIT_INT) || (cpu->cpu_ctx.hflags & HFLG_DBG_TRAP) ||
+		(cpu->cpu_ctx.regs.eflags & (RF_MASK | TF_MASK)) || (cpu->cpu_flags & CPU_SINGLE_STEP))) {
+		return false;
+	}
+
+	ZydisDecodedInstruction zinstr;
+	ZydisDecoder decoder;
+	init_instr_decoder(&disas_ctx, &decoder);
+	addr_t page_addr = disas_ctx.virt_pc & ~PAGE_MASK;
+	uint32_t size = 0, instr_count = 0;
+	std::vector<interp_instr_t> code;
+	std::vector<uint8_t> instr_len;
+
+	while (true) {
+		if (!ZYAN_SUCCESS(decode_instr(cpu, &disas_ctx, &decoder, &zinstr))) {
+			// let the jit raise the exception, if any
+			return false;
+		}
+
+		interp_instr_t instr{};
+		bool ends_tc = false;
+		instr.eip = disas_ctx.virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
+		instr.next_eip = instr.eip + zinstr.length;
+		if (!interp_decode_instr(&zinstr, &instr, ends_tc)) {
+			return false;
+		}
+
+		code.push_back(instr);
+		++instr_count;
+		if (cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT) {
+			instr_len.push_back(zinstr.length);
+		}
+		disas_ctx.flags |= ((disas_ctx.virt_pc & ~PAGE_MASK) != ((disas_ctx.virt_pc + zinstr.length - 1) & ~PAGE_MASK)) << 2;
+		disas_ctx.pc += zinstr.length;
+		disas_ctx.virt_pc += zinstr.length;
+		size += zinstr.length;
+
+		if (ends_tc) {
+			break;
+		}
+
+		if (disas_ctx.flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR)) {
+			interp_instr_t end{};
+			end.fn = &interp_end;
+			end.eip = instr.next_eip;
+			code.push_back(end);
+			break;
+		}
+
+		if ((disas_ctx.virt_pc & ~PAGE_MASK) != page_addr) {
+			// the jit would continue in the next page, which the tc_page_map of this tc doesn't cover
+			return false;
+		}
+	}
+
+	cpu->disas_ctx.flags = disas_ctx.flags;
+	cpu->tc->code_size = static_cast<uint32_t>(code.size() * sizeof(interp_instr_t));
+	cpu->tc->interp_code = std::move(code);
+	cpu->tc->instr_len = std::move(instr_len);
+	cpu->tc->size = size;
+	cpu->tc->instr_count = instr_count;
+	cpu->tc->flags |= TC_FLG_INTERP;
+	cpu->tc->jmp_offset[0] = cpu->tc->jmp_offset[1] = cpu->tc->jmp_offset[2] = nullptr;
+
+	return true;
+}
+
+translated_code_t *
+tc_run_interp(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
+{
+	// Runs an interpreted tc. Interpreted tc's are never linked, so this always returns nullptr. The tc is not accessed anymore after the last instr,
+	// because cpu_do_int can clear the code cache
+
+	int64_t num_instr = tc->instr_count;
+	if (cpu_ctx->hflags & HFLG_INSTR_COUNT) {
+		// same as lc86_jit::gen_instr_count_check
+		if (cpu_ctx->instr_budget < num_instr) {
+			return nullptr;
+		}
+		cpu_ctx->instr_budget -= num_instr;
+		cpu_ctx->instr_tc = tc;
+	}
+
+	++tc->exec_count;
+	tc->accessed = 1;
+	interp_instr_t *instr = tc->interp_code.data();
+	do {
+		instr = instr->fn(cpu_ctx, instr);
+	} while (instr);
+	cpu_ctx->instr_tc = nullptr;
+
+	// same as lc86_jit::gen_interrupt_check. This is all that gen_no_link_checks would emit, since cpu_interp_translate rejects the one-instr
+	// tc's that need more than this
+	if (cpu_ctx->hflags & HFLG_TIMEOUT) {
+		cpu_ctx->timer_budget -= num_instr;
+		if (cpu_ctx->timer_budget <= 0) {
+			uint32_t ret = cpu_timer_helper(cpu_ctx);
+			if (ret && !(ret & (CPU_HW_INT | CPU_NON_HW_INT))) {
+				cpu_ctx->exit_requested = 1;
+			}
+			return nullptr;
+		}
+	}
+
+	if (uint32_t int_flg = cpu_ctx->cpu->read_int_fn(cpu_ctx)) {
+		cpu_do_int(cpu_ctx, int_flg);
+	}
+
+	return nullptr;
+}
@@ -5,9 +5,11 @@
  */
 
 #include "lib86cpu_priv.h"
+#include "os_exceptions.h"
 #ifdef LIB86CPU_X64_EMITTER
 #include "x64/jit.h"
 #endif
+#include <algorithm>
 
 #define CIE_ID                     0
 #define CIE_VERSION                1
@@ -50,16 +52,20 @@ PACKED(struct fde_t {
  	uint64_t code_start;
  	uint64_t code_size;
  	uint8_t augmentation_data_length;
- 	uint8_t adv_loc_rule1;
-	uint8_t def_cfa_off_rule1[2];
+	uint8_t def_cfa_off_rule[2];
 	uint8_t cfa_off_rule[2];
-	uint8_t adv_loc_rule2;
-	uint8_t def_cfa_off_rule2[2];
-	uint8_t nop_rule[7];
+	uint8_t nop_rule[3];
 });
 
 static_assert((sizeof(fde_t) % sizeof(void *)) == 0);
 
+// a .eh_frame section with a single cie and fde, terminated by a zero length entry
+PACKED(struct eh_frame_t {
+	cie_t cie;
+	fde_t fde;
+	uint32_t terminator;
+});
+
 extern "C" {
 	void __register_frame(void *);
 	void __deregister_frame(void *);
@@ -127,43 +133,37 @@ write_cie(cie_t *cie)
 static void
 write_fde(fde_t *fde, uint8_t *code_ptr, size_t code_size)
 {
+	// The rules start directly from the state after the prolog of main(), that is, after push rbx and sub rsp, stack_size. Exceptions are only thrown by the
+	// functions called by main(), so the prolog itself never needs to be unwound. This way, the same fde can describe all the main() functions in a region.
+	// This only holds as long as all the code in the region is made of main() functions with the same prolog, and nothing in it throws outside of their body
 	fde->length = sizeof(fde_t) - sizeof(fde->length);
 	fde->cie_off = sizeof(cie_t) + sizeof(fde->length); // offset to the cie this fde refers to
-	fde->code_start = reinterpret_cast<uint64_t>(code_ptr); // addr where the function specified by this fde starts
-	fde->code_size = reinterpret_cast<uint64_t>(code_size); // size of the function specified by this fde
+	fde->code_start = reinterpret_cast<uint64_t>(code_ptr); // addr where the code specified by this fde starts
+	fde->code_size = reinterpret_cast<uint64_t>(code_size); // size of the code specified by this fde
 	fde->augmentation_data_length = 0; // size of fde augmentation data
-	fde->adv_loc_rule1 = DW_CFA_advance_loc(1); // location after push rbx
-	fde->def_cfa_off_rule1[0] = DW_CFA_def_cfa_off; // offset of CFA after push rbx
-	fde->def_cfa_off_rule1[1] = 16;
+	fde->def_cfa_off_rule[0] = DW_CFA_def_cfa_off; // offset of CFA after sub rsp, stack_size
+	fde->def_cfa_off_rule[1] = static_cast<uint8_t>(get_jit_stack_required_runtime() + 16); // stack_size + pushed rbx + ret addr, see the static_assert in jit.cpp
 	fde->cfa_off_rule[0] = DW_CFA_offset(DWARF_RBX); // specify rbx in terms of CFA -> (2 * -8)
 	fde->cfa_off_rule[1] = 2;
-	fde->adv_loc_rule2 = DW_CFA_advance_loc(4); // location after sub rsp, stack_size
-	fde->def_cfa_off_rule2[0] = DW_CFA_def_cfa_off; // offset of CFA after sub rsp, stack_size
-	fde->def_cfa_off_rule2[1] = 112;
 	std::fill(fde->nop_rule, fde->nop_rule + sizeof(fde->nop_rule), DW_CFA_nop);
 }
 
-static void
-write_eh_frame(cie_t *cie, uint8_t *code_ptr, size_t code_size)
-{
-	write_cie(cie);
-	fde_t *fde = reinterpret_cast<fde_t *>(cie + 1);
-	write_fde(fde, code_ptr, code_size);
-	*reinterpret_cast<uint32_t*>(fde + 1) = 0;
-	__register_frame(cie);
-}
-
-void
-lc86_jit::gen_exception_info(uint8_t *code_ptr, size_t code_size)
+void *
+os_gen_exp_info(void *code_ptr, size_t code_size)
 {
-	size_t aligned_code_size = (code_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
-	cie_t *cie = reinterpret_cast<cie_t *>(code_ptr + aligned_code_size);
-	write_eh_frame(cie, code_ptr, code_size);
-	m_mem.eh_frames.emplace(code_ptr, cie);
+	// Registers a single .eh_frame for a whole region of the jit allocator, instead of one for every tc, so that the list of frames searched by the unwinder
+	// stays short and the tc's don't need to register anything when they are emitted
+	eh_frame_t *eh_frame = new eh_frame_t;
+	write_cie(&eh_frame->cie);
+	write_fde(&eh_frame->fde, static_cast<uint8_t *>(code_ptr), code_size);
+	eh_frame->terminator = 0;
+	__register_frame(eh_frame);
+	return eh_frame;
 }
 
 void
 os_delete_exp_info(void *addr)
 {
 	__deregister_frame(addr);
+	delete static_cast<eh_frame_t *>(addr);
 }
@@ -7,5 +7,6 @@
 #pragma once
  
  
+void *os_gen_exp_info(void *code_ptr, size_t code_size);
 void os_delete_exp_info(void *addr);
  
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "internal.h"
 #include "allocator.h"
 #include <sys/mman.h>
+#include <unistd.h>
 #include "os_mem.h"
 
 
@@ -50,6 +51,39 @@ os_alloc(size_t size)
 	return addr;
 }
 
+void *
+os_alloc_code(size_t size, void *&wr_addr)
+{
+	// Maps the same memory twice: the jit writes the code through the view at wr_addr, and runs it from the returned view. The memory is then never writable
+	// and executable at the same time, without needing to call mprotect every time a block of code is written
+
+	int fd = memfd_create("lib86cpu_code", MFD_CLOEXEC);
+	if (fd == -1) {
+		throw lc86_exp_abort("Failed to create the file for the generated code", lc86_status::no_memory);
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		throw lc86_exp_abort("Failed to allocate memory for the generated code", lc86_status::no_memory);
+	}
+
+	void *addr = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	wr_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// the mappings keep the memory alive, so the fd is not needed anymore
+	close(fd);
+	if ((addr == MAP_FAILED) || (wr_addr == MAP_FAILED)) {
+		if (addr != MAP_FAILED) {
+			munmap(addr, size);
+		}
+		if (wr_addr != MAP_FAILED) {
+			munmap(wr_addr, size);
+		}
+		throw lc86_exp_abort("Failed to allocate memory for the generated code", lc86_status::no_memory);
+	}
+
+	return addr;
+}
+
 void
 os_free(void *addr, size_t size)
 {
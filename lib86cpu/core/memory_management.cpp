@@ -65,28 +65,28 @@ static addr_t tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 		uint32_t idx = (addr >> PAGE_SHIFT) & ITLB_IDX_MASK;
 		tag = (static_cast<uint64_t>(addr) << ITLB_TAG_SHIFT64) & ITLB_TAG_MASK64;
 		for (unsigned i = 0; i < ITLB_NUM_LINES; ++i) {
-			if (!(cpu->itlb[idx][i].entry & TLB_VALID)) {
-				tlb = &cpu->itlb[idx][i];
+			if (!(cpu->cpu_ctx.itlb[idx][i].entry & TLB_VALID)) {
+				tlb = &cpu->cpu_ctx.itlb[idx][i];
 				break;
 			}
 		}
 		if (!tlb) {
 			std::uniform_int_distribution<uint32_t> dis(0, ITLB_NUM_LINES - 1);
-			tlb = &cpu->itlb[idx][dis(cpu->rng_gen)];
+			tlb = &cpu->cpu_ctx.itlb[idx][dis(cpu->rng_gen)];
 		}
 	}
 	else {
 		uint32_t idx = (addr >> PAGE_SHIFT) & DTLB_IDX_MASK;
 		tag = (static_cast<uint64_t>(addr) << DTLB_TAG_SHIFT64) & DTLB_TAG_MASK64;
 		for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-			if (!(cpu->dtlb[idx][i].entry & TLB_VALID)) {
-				tlb = &cpu->dtlb[idx][i];
+			if (!(cpu->cpu_ctx.dtlb[idx][i].entry & TLB_VALID)) {
+				tlb = &cpu->cpu_ctx.dtlb[idx][i];
 				break;
 			}
 		}
 		if (!tlb) {
 			std::uniform_int_distribution<uint32_t> dis(0, DTLB_NUM_LINES - 1);
-			tlb = &cpu->dtlb[idx][dis(cpu->rng_gen)];
+			tlb = &cpu->cpu_ctx.dtlb[idx][dis(cpu->rng_gen)];
 		}
 	}
 
@@ -100,6 +100,13 @@ static addr_t tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 		cpu->smc.set(phys_addr >> PAGE_SHIFT);
 	}
 
+	if constexpr (!is_fetch) {
+		// the jit only accesses memory inline when the page has no watchpoints, so flag the entry to force it to call the memory helpers instead
+		if (cpu_check_page_watchpoints(cpu, addr)) {
+			prot |= TLB_WATCH;
+		}
+	}
+
 	if ((region->start <= start_page) && (region->end >= end_page)) {
 		// region spans the entire page
 
@@ -134,12 +141,15 @@ static addr_t tlb_fill(cpu_t *cpu, addr_t addr, addr_t phys_addr, uint32_t prot)
 template<bool flush_global>
 void tlb_flush(cpu_t *cpu)
 {
+	// the links of the tc's to another page must check the mapping again
+	++cpu->cpu_ctx.tlb_gen;
+
 	if constexpr (flush_global) {
-		std::memset(cpu->itlb, 0, sizeof(cpu->itlb));
-		std::memset(cpu->dtlb, 0, sizeof(cpu->dtlb));
+		std::memset(cpu->cpu_ctx.itlb, 0, sizeof(cpu->cpu_ctx.itlb));
+		std::memset(cpu->cpu_ctx.dtlb, 0, sizeof(cpu->cpu_ctx.dtlb));
 	}
 	else {
-		for (auto &set : cpu->itlb) {
+		for (auto &set : cpu->cpu_ctx.itlb) {
 			for (auto &line : set) {
 				if (!(line.entry & TLB_GLOBAL)) {
 					line.entry = 0;
@@ -147,7 +157,7 @@ void tlb_flush(cpu_t *cpu)
 				}
 			}
 		}
-		for (auto &set : cpu->dtlb) {
+		for (auto &set : cpu->cpu_ctx.dtlb) {
 			for (auto &line : set) {
 				if (!(line.entry & TLB_GLOBAL)) {
 					line.entry = 0;
@@ -240,11 +250,11 @@ check_page_privilege(cpu_t *cpu, uint8_t pde_priv, uint8_t pte_priv)
 
 template<bool raise_host_exp>
 static inline void
-mmu_raise_page_fault(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_ctx, uint8_t err_code, uint8_t is_write, uint8_t cpu_lv)
+mmu_raise_page_fault(cpu_t *cpu, addr_t addr, uint32_t eip, exp_data_t *exp_data, uint8_t err_code, uint8_t is_write, uint8_t cpu_lv)
 {
 	// NOTE: the u/s bit of the error code should reflect the actual cpl even if the memory access is privileged
 	if constexpr (raise_host_exp) {
-		assert(disas_ctx == nullptr);
+		assert(exp_data == nullptr);
 		cpu->cpu_ctx.exp_info.exp_data.fault_addr = addr;
 		cpu->cpu_ctx.exp_info.exp_data.code = err_code | (is_write << 1) | cpu_lv;
 		cpu->cpu_ctx.exp_info.exp_data.idx = EXP_PF;
@@ -252,17 +262,17 @@ mmu_raise_page_fault(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_c
 		throw host_exp_t::pf_exp;
 	}
 	else {
-		assert(disas_ctx != nullptr);
-		disas_ctx->exp_data.fault_addr = addr;
-		disas_ctx->exp_data.code = err_code | (is_write << 1) | cpu_lv;
-		disas_ctx->exp_data.idx = EXP_PF;
-		disas_ctx->exp_data.eip = eip;
+		assert(exp_data != nullptr);
+		exp_data->fault_addr = addr;
+		exp_data->code = err_code | (is_write << 1) | cpu_lv;
+		exp_data->idx = EXP_PF;
+		exp_data->eip = eip;
 	}
 }
 
 // NOTE: flags: bit 0 -> is_write, bit 1 -> is_priv, bit 4 -> set_code
 template<bool is_fetch, bool should_fill_tlb = true, bool raise_host_exp = true>
-addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip, disas_ctx_t *disas_ctx = nullptr)
+addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip, exp_data_t *exp_data = nullptr)
 {
 	uint32_t is_write = flags & MMU_IS_WRITE;
 	uint32_t set_code = flags & MMU_SET_CODE;
@@ -286,7 +296,7 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip,
 		uint32_t pde = as_memory_dispatch_read<uint32_t>(cpu, pde_addr, pde_region);
 
 		if (!(pde & PTE_PRESENT)) {
-			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
+			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, exp_data, err_code, is_write, cpu_lv);
 			return 0;
 		}
 		
@@ -313,7 +323,7 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip,
 				}
 			}
 			err_code = 1;
-			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
+			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, exp_data, err_code, is_write, cpu_lv);
 			return 0;
 		}
 
@@ -323,7 +333,7 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip,
 		uint32_t pte = as_memory_dispatch_read<uint32_t>(cpu, pte_addr, pte_region);
 
 		if (!(pte & PTE_PRESENT)) {
-			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
+			mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, exp_data, err_code, is_write, cpu_lv);
 			return 0;
 		}
 
@@ -355,7 +365,7 @@ addr_t mmu_translate_addr(cpu_t *cpu, addr_t addr, uint32_t flags, uint32_t eip,
 		}
 		err_code = 1;
 
-		mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, disas_ctx, err_code, is_write, cpu_lv);
+		mmu_raise_page_fault<raise_host_exp>(cpu, addr, eip, exp_data, err_code, is_write, cpu_lv);
 		return 0;
 	}
 }
@@ -370,8 +380,8 @@ get_read_addr(cpu_t *cpu, addr_t addr, uint8_t is_priv, uint32_t eip)
 	uint64_t tag = ((static_cast<uint64_t>(addr) << DTLB_TAG_SHIFT64) & DTLB_TAG_MASK64) | mem_access;
 	mem_access |= DTLB_TAG_MASK64;
 	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-		if (((cpu->dtlb[idx][i].entry & mem_access) ^ tag) == 0) {
-			return (cpu->dtlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
+		if (((cpu->cpu_ctx.dtlb[idx][i].entry & mem_access) ^ tag) == 0) {
+			return (cpu->cpu_ctx.dtlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 		}
 	}
 
@@ -389,12 +399,12 @@ get_write_addr(cpu_t *cpu, addr_t addr, uint8_t is_priv, uint32_t eip, bool *is_
 	uint64_t tag = ((static_cast<uint64_t>(addr) << DTLB_TAG_SHIFT64) & DTLB_TAG_MASK64) | mem_access;
 	mem_access |= DTLB_TAG_MASK64;
 	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-		if (((cpu->dtlb[idx][i].entry & mem_access) ^ tag) == 0) {
-			if (!(cpu->dtlb[idx][i].entry & TLB_DIRTY)) {
-				cpu->dtlb[idx][i].entry |= TLB_DIRTY;
+		if (((cpu->cpu_ctx.dtlb[idx][i].entry & mem_access) ^ tag) == 0) {
+			if (!(cpu->cpu_ctx.dtlb[idx][i].entry & TLB_DIRTY)) {
+				cpu->cpu_ctx.dtlb[idx][i].entry |= TLB_DIRTY;
 				mmu_translate_addr<false, false>(cpu, addr, MMU_IS_WRITE | is_priv, eip);
 			}
-			addr_t phys_addr = (cpu->dtlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
+			addr_t phys_addr = (cpu->cpu_ctx.dtlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 			*is_code = cpu->smc[phys_addr >> PAGE_SHIFT];
 			return phys_addr;
 		}
@@ -415,8 +425,8 @@ get_code_addr(cpu_t *cpu, addr_t addr, uint32_t eip)
 	uint64_t tag = ((static_cast<uint64_t>(addr) << ITLB_TAG_SHIFT64) & ITLB_TAG_MASK64) | mem_access;
 	mem_access |= ITLB_TAG_MASK64;
 	for (unsigned i = 0; i < ITLB_NUM_LINES; ++i) {
-		if (((cpu->itlb[idx][i].entry & mem_access) ^ tag) == 0) {
-			return (cpu->itlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
+		if (((cpu->cpu_ctx.itlb[idx][i].entry & mem_access) ^ tag) == 0) {
+			return (cpu->cpu_ctx.itlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 		}
 	}
 
@@ -434,12 +444,12 @@ addr_t get_code_addr(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_c
 	uint64_t tag = ((static_cast<uint64_t>(addr) << ITLB_TAG_SHIFT64) & ITLB_TAG_MASK64) | mem_access;
 	mem_access |= ITLB_TAG_MASK64;
 	for (unsigned i = 0; i < ITLB_NUM_LINES; ++i) {
-		if (((cpu->itlb[idx][i].entry & mem_access) ^ tag) == 0) {
-			return (cpu->itlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
+		if (((cpu->cpu_ctx.itlb[idx][i].entry & mem_access) ^ tag) == 0) {
+			return (cpu->cpu_ctx.itlb[idx][i].entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 		}
 	}
 
-	return mmu_translate_addr<true, true, false>(cpu, addr, set_smc ? MMU_SET_CODE : 0, eip, disas_ctx);
+	return mmu_translate_addr<true, true, false>(cpu, addr, set_smc ? MMU_SET_CODE : 0, eip, &disas_ctx->exp_data);
 }
 
 uint64_t
@@ -506,8 +516,46 @@ ram_fetch(cpu_t *cpu, disas_ctx_t *disas_ctx, uint8_t *buffer)
 	}
 }
 
+template<bool is_write>
+static bool
+mem_check_page_fault(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t size, uint32_t eip, uint8_t is_priv)
+{
+	// walks the page tables of the pages touched by an access that missed the dtlb, without throwing host exceptions. On a page fault, the exception data is
+	// stored in cpu_ctx and exp_pending is set, so that the jitted code can raise the exception itself instead of unwinding its frame. Otherwise, the tlb entries
+	// filled here are then hit by mem_read_slow/mem_write_slow, so the walk is not done twice
+
+	exp_data_t exp_data{ 0, 0, EXP_INVALID, 0 };
+	uint32_t flags = (is_write ? MMU_IS_WRITE : 0) | is_priv;
+	mmu_translate_addr<false, true, false>(cpu_ctx->cpu, addr, flags, eip, &exp_data);
+	if ((exp_data.idx == EXP_INVALID) && (size != 1) && ((addr & ~PAGE_MASK) != ((addr + size - 1) & ~PAGE_MASK))) {
+		mmu_translate_addr<false, true, false>(cpu_ctx->cpu, addr + size - 1, flags, eip, &exp_data);
+	}
+
+	if (exp_data.idx == EXP_PF) {
+		cpu_ctx->exp_info.exp_data = exp_data;
+		cpu_ctx->exp_pending = 1;
+		return true;
+	}
+
+	return false;
+}
+
+template<int type>
+static bool
+mem_check_watchpoints(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t size, uint32_t eip)
+{
+	// same as mem_check_page_fault, but for the debug traps of the data watchpoints
+	if (cpu_check_data_watchpoints<false>(cpu_ctx->cpu, addr, size, type, eip)) {
+		cpu_ctx->exp_pending = 1;
+		return true;
+	}
+
+	return false;
+}
+
 // memory read helper invoked by the jitted code
-template<typename T>
+// NOTE: when raise_host_exp is false, page faults and debug traps are reported with cpu_ctx_t::exp_pending, and the jitted code must check it after the call
+template<typename T, bool raise_host_exp>
 T mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv)
 {
 	uint32_t page_idx1 = addr & ~PAGE_MASK;
@@ -521,10 +569,15 @@ T mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv
 	// this checks the page privilege access (mem_access) and also if the last byte of the read is in the same page as the first (addr + sizeof(T) - 1)
 	// reads that cross pages always result in tlb misses
 	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-		if ((((cpu_ctx->cpu->dtlb[idx][i].entry & mem_access) | page_idx1) ^ tag) == 0) {
-			cpu_check_data_watchpoints(cpu_ctx->cpu, addr, sizeof(T), DR7_TYPE_DATA_RW, eip);
+		if ((((cpu_ctx->dtlb[idx][i].entry & mem_access) | page_idx1) ^ tag) == 0) {
+			if constexpr (raise_host_exp) {
+				cpu_check_data_watchpoints(cpu_ctx->cpu, addr, sizeof(T), DR7_TYPE_DATA_RW, eip);
+			}
+			else if (mem_check_watchpoints<DR7_TYPE_DATA_RW>(cpu_ctx, addr, sizeof(T), eip)) {
+				return T();
+			}
 
-			tlb_t *tlb = &cpu_ctx->cpu->dtlb[idx][i];
+			tlb_t *tlb = &cpu_ctx->dtlb[idx][i];
 			addr_t phys_addr = (tlb->entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 
 			// tlb hit, check the region type
@@ -570,12 +623,17 @@ T mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv
 		}
 	}
 
-	// tlb miss
+	// tlb miss, the watchpoints are also checked here, so that mem_read_slow finds nothing to throw
+	if constexpr (!raise_host_exp) {
+		if (mem_check_page_fault<false>(cpu_ctx, addr, sizeof(T), eip, is_priv) || mem_check_watchpoints<DR7_TYPE_DATA_RW>(cpu_ctx, addr, sizeof(T), eip)) {
+			return T();
+		}
+	}
 	return mem_read_slow<T>(cpu_ctx->cpu, addr, eip, is_priv);
 }
 
 // memory write helper invoked by the jitted code
-template<typename T, bool dont_write>
+template<typename T, bool dont_write, bool raise_host_exp>
 void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint8_t is_priv)
 {
 	// if dont_write is true, then no write will happen and we only check if the access would fault. This is used by the ENTER instruction to check
@@ -592,15 +650,20 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 	// this checks the page privilege access (mem_access), if the last byte of the write is in the same page as the first (addr + sizeof(T) - 1) and
 	// the tlb dirty flag. Writes that cross pages always result in tlb misses, and writes without the dirty flag set miss only once
 	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-		if ((((cpu_ctx->cpu->dtlb[idx][i].entry & mem_access) | page_idx1) ^ tag) == 0) {
+		if ((((cpu_ctx->dtlb[idx][i].entry & mem_access) | page_idx1) ^ tag) == 0) {
 			if constexpr (dont_write) {
 				// If the tlb hits, then the access is valid
 				return;
 			}
 
-			cpu_check_data_watchpoints(cpu_ctx->cpu, addr, sizeof(T), DR7_TYPE_DATA_W, eip);
+			if constexpr (raise_host_exp) {
+				cpu_check_data_watchpoints(cpu_ctx->cpu, addr, sizeof(T), DR7_TYPE_DATA_W, eip);
+			}
+			else if (mem_check_watchpoints<DR7_TYPE_DATA_W>(cpu_ctx, addr, sizeof(T), eip)) {
+				return;
+			}
 
-			tlb_t *tlb = &cpu_ctx->cpu->dtlb[idx][i];
+			tlb_t *tlb = &cpu_ctx->dtlb[idx][i];
 			addr_t phys_addr = (tlb->entry & ~PAGE_MASK) | (addr & PAGE_MASK);
 
 			if (cpu_ctx->cpu->smc[phys_addr >> PAGE_SHIFT]) {
@@ -653,6 +716,15 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 		}
 	}
 
+	if constexpr (!raise_host_exp) {
+		// tlb miss, with dont_write the check of the pages is all that needs to be done. Otherwise, the watchpoints are also checked here, so that
+		// mem_write_slow finds nothing to throw
+		if (mem_check_page_fault<true>(cpu_ctx, addr, sizeof(T), eip, is_priv) || dont_write ||
+			mem_check_watchpoints<DR7_TYPE_DATA_W>(cpu_ctx, addr, sizeof(T), eip)) {
+			return;
+		}
+	}
+
 	if constexpr (dont_write) {
 		// If the tlb misses, then the access might still be valid if the mmu can translate the address
 		if ((sizeof(T) != 1) && ((addr & ~PAGE_MASK) != ((addr + sizeof(T) - 1) & ~PAGE_MASK))) {
@@ -670,18 +742,31 @@ void mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint
 }
 
 // io read helper invoked by the jitted code
-template<typename T>
+// NOTE: when raise_host_exp is false, debug traps are reported with cpu_ctx_t::exp_pending, like mem_read_helper does
+template<typename T, bool raise_host_exp>
 T io_read_helper(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip)
 {
-	cpu_check_io_watchpoints(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip);
+	if constexpr (raise_host_exp) {
+		cpu_check_io_watchpoints(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip);
+	}
+	else if (cpu_check_io_watchpoints<false>(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip)) {
+		cpu_ctx->exp_pending = 1;
+		return T();
+	}
 	return io_read<T>(cpu_ctx->cpu, port);
 }
 
 // io write helper invoked by the jitted code
-template<typename T>
+template<typename T, bool raise_host_exp>
 void io_write_helper(cpu_ctx_t *cpu_ctx, port_t port, T val, uint32_t eip)
 {
-	cpu_check_io_watchpoints(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip);
+	if constexpr (raise_host_exp) {
+		cpu_check_io_watchpoints(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip);
+	}
+	else if (cpu_check_io_watchpoints<false>(cpu_ctx->cpu, port, sizeof(T), DR7_TYPE_IO_RW, eip)) {
+		cpu_ctx->exp_pending = 1;
+		return;
+	}
 	io_write<T>(cpu_ctx->cpu, port, val);
 }
 
@@ -691,6 +776,12 @@ template uint32_t mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip,
 template uint64_t mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
 template uint80_t mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
 template uint128_t mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint8_t mem_read_helper<uint8_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint16_t mem_read_helper<uint16_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint32_t mem_read_helper<uint32_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint64_t mem_read_helper<uint64_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint80_t mem_read_helper<uint80_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template uint128_t mem_read_helper<uint128_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
 template void mem_write_helper<uint8_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint8_t val, uint32_t eip, uint8_t is_priv);
 template void mem_write_helper<uint16_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint16_t val, uint32_t eip, uint8_t is_priv);
 template void mem_write_helper<uint32_t, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t val, uint32_t eip, uint8_t is_priv);
@@ -702,6 +793,16 @@ template void mem_write_helper<uint16_t, true>(cpu_ctx_t *cpu_ctx, addr_t addr,
 template void mem_write_helper<uint32_t, true>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t val, uint32_t eip, uint8_t is_priv);
 template void mem_write_helper<uint64_t, true>(cpu_ctx_t *cpu_ctx, addr_t addr, uint64_t val, uint32_t eip, uint8_t is_priv);
 template void mem_write_helper<uint128_t, true>(cpu_ctx_t *cpu_ctx, addr_t addr, uint128_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint8_t, false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint8_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint16_t, false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint16_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint32_t, false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint64_t, false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint64_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint128_t, false, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint128_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint8_t, true, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint8_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint16_t, true, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint16_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint32_t, true, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint64_t, true, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint64_t val, uint32_t eip, uint8_t is_priv);
+template void mem_write_helper<uint128_t, true, false>(cpu_ctx_t *cpu_ctx, addr_t addr, uint128_t val, uint32_t eip, uint8_t is_priv);
 
 template uint8_t io_read_helper(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
 template uint16_t io_read_helper(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
@@ -709,6 +810,12 @@ template uint32_t io_read_helper(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
 template void io_write_helper(cpu_ctx_t *cpu_ctx, port_t port, uint8_t val, uint32_t eip);
 template void io_write_helper(cpu_ctx_t *cpu_ctx, port_t port, uint16_t val, uint32_t eip);
 template void io_write_helper(cpu_ctx_t *cpu_ctx, port_t port, uint32_t val, uint32_t eip);
+template uint8_t io_read_helper<uint8_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
+template uint16_t io_read_helper<uint16_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
+template uint32_t io_read_helper<uint32_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint32_t eip);
+template void io_write_helper<uint8_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint8_t val, uint32_t eip);
+template void io_write_helper<uint16_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint16_t val, uint32_t eip);
+template void io_write_helper<uint32_t, false>(cpu_ctx_t *cpu_ctx, port_t port, uint32_t val, uint32_t eip);
 
 template addr_t get_code_addr<false>(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_ctx);
 template addr_t get_code_addr<true>(cpu_t *cpu, addr_t addr, uint32_t eip, disas_ctx_t *disas_ctx);
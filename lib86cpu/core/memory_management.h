@@ -28,10 +28,10 @@ template<typename T> T ram_read(cpu_t *cpu, void *ram_ptr);
 template<typename T> void ram_write(cpu_t *cpu, void *ram_ptr, T value);
 void ram_fetch(cpu_t *cpu, disas_ctx_t *disas_ctx, uint8_t *buffer);
 uint64_t as_ram_dispatch_read(cpu_t *cpu, addr_t addr, uint64_t size, const memory_region_t<addr_t> *region, uint8_t *buffer);
-template<typename T> T JIT_API mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
-template<typename T, bool dont_write = false> void JIT_API mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint8_t is_priv);
-template<typename T> T JIT_API io_read_helper(cpu_ctx_t * cpu_ctx, port_t port, uint32_t eip);
-template<typename T> void JIT_API io_write_helper(cpu_ctx_t * cpu_ctx, port_t port, T val, uint32_t eip);
+template<typename T, bool raise_host_exp = true> T JIT_API mem_read_helper(cpu_ctx_t *cpu_ctx, addr_t addr, uint32_t eip, uint8_t is_priv);
+template<typename T, bool dont_write = false, bool raise_host_exp = true> void JIT_API mem_write_helper(cpu_ctx_t *cpu_ctx, addr_t addr, T val, uint32_t eip, uint8_t is_priv);
+template<typename T, bool raise_host_exp = true> T JIT_API io_read_helper(cpu_ctx_t * cpu_ctx, port_t port, uint32_t eip);
+template<typename T, bool raise_host_exp = true> void JIT_API io_write_helper(cpu_ctx_t * cpu_ctx, port_t port, T val, uint32_t eip);
 
 inline constexpr uint64_t tlb_access[2][4] = {
 	{ TLB_SUP_READ, TLB_SUP_READ, TLB_SUP_READ, TLB_USER_READ },
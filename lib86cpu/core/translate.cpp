@@ -13,6 +13,7 @@
 
 #ifdef LIB86CPU_X64_EMITTER
 #include "x64/jit.h"
+#include "disk_cache.h"
 #endif
 
 #define BAD LIB86CPU_ABORT_msg("Encountered unimplemented instruction %s", log_instr(disas_ctx->virt_pc - cpu->instr_bytes, &instr).c_str())
@@ -48,6 +49,7 @@ cpu_reset(cpu_t *cpu)
 	std::memset(cpu->msr.mtrr.phys_fixed, 0, sizeof(cpu->msr.mtrr.phys_fixed));
 	tsc_init(cpu);
 	fpu_init(cpu);
+	tc_cache_clear(cpu);
 }
 
 static void
@@ -76,11 +78,31 @@ check_dbl_exp(cpu_ctx_t *cpu_ctx)
 	cpu_ctx->exp_info.exp_data.idx = idx;
 }
 
+static void
+tc_refund_instr(cpu_ctx_t *cpu_ctx, uint32_t eip)
+{
+	// with cpu_run_instructions, a tc subtracts all of its instr from the budget before it runs. When an exception or a code write stops it early, eip is
+	// where the guest resumes, so the instr from there to the end of the tc were counted but never ran. The faulting instr is among them, while an int n,
+	// the instr before a hw int and a code write have completed
+	translated_code_t *tc = cpu_ctx->instr_tc;
+	if (tc == nullptr) {
+		return;
+	}
+
+	cpu_ctx->instr_tc = nullptr;
+	uint32_t offset = tc->cs_base + eip - tc->virt_pc, instr_off = 0, num_run = 0;
+	for (; (num_run < tc->instr_len.size()) && (instr_off < offset); ++num_run) {
+		instr_off += tc->instr_len[num_run];
+	}
+	cpu_ctx->instr_budget += tc->instr_count - num_run;
+}
+
 template<bool is_intn, bool is_hw_int>
 translated_code_t *cpu_raise_exception(cpu_ctx_t *cpu_ctx)
 {
 	// is_intn -> int3, into or intn instruction, is_hw_int -> hardware interrupt
 
+	tc_refund_instr(cpu_ctx, cpu_ctx->exp_info.exp_data.eip);
 	check_dbl_exp(cpu_ctx);
 
 	cpu_t *cpu = cpu_ctx->cpu;
@@ -377,7 +399,7 @@ get_pc(cpu_ctx_t *cpu_ctx)
 	return cpu_ctx->regs.cs_hidden.base + cpu_ctx->regs.eip;
 }
 
-// dummy tc only used for comparisons in the ibtc. Using the invalid hflag makes sure that comparisons with it always fail, and avoids the need to check
+// dummy tc only used for comparisons in the ibtc and with ret_tc. Using the invalid hflag makes sure that comparisons with it always fail, and avoids the need to check
 // if an entry in the ibtc exists (e.g. cheking for nullptr)
 static translated_code_t dummy_tc(HFLG_INVALID);
 
@@ -385,20 +407,263 @@ translated_code_t::translated_code_t() noexcept
 {
 	size = 0;
 	flags = 0;
+	exec_count = 0;
+	instr_count = 0;
+	code_size = 0;
+	accessed = 0;
 	ptr_code = nullptr;
-	for (auto &entry : ibtc) {
-		entry = &dummy_tc;
+	jmp_patch[0] = jmp_patch[1] = 0;
+	link_gen[0] = link_gen[1] = 0;
+	ret_tc = &dummy_tc;
+	pred = nullptr;
+	page_prev = page_next = nullptr;
+	for (auto &link : links) {
+		link.src = this;
+		link.dst = nullptr;
+		link.prev = link.next = nullptr;
+	}
+}
+
+static void
+tc_ret_stack_flush(cpu_ctx_t *cpu_ctx)
+{
+	// the return stack buffer holds raw tc pointers, so it must be flushed every time a tc is deleted
+	for (auto &entry : cpu_ctx->ret_stack.call_tc) {
+		entry = nullptr;
 	}
+	cpu_ctx->ret_stack.miss_tc = nullptr;
 }
 
 static inline uint32_t
-tc_hash(addr_t pc)
+tc_hash(addr_t pc, addr_t cs_base, uint32_t guest_flags)
+{
+	// fibonacci hashing of the whole key. Only using the low bits of the pc makes entry points aligned to a power of two collide, and then they need longer
+	// probe sequences
+	uint64_t key = (static_cast<uint64_t>(pc) << 32) | (cs_base ^ guest_flags);
+	return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> (64 - CODE_CACHE_TABLE_SHIFT));
+}
+
+static inline uint32_t
+tc_ibtc_hash(addr_t virt_pc)
+{
+	// NOTE: lc86_jit::gen_link_indirect calculates the same hash
+	return virt_pc & (IBTC_SIZE - 1);
+}
+
+static void
+tc_set_jmp(cpu_t *cpu, translated_code_t *tc, uint32_t idx, entry_t dst)
+{
+	// dst is either the code of the linked tc or the exit function of tc, the jit also patches the jmp of the link in the code of tc
+	tc->jmp_offset[idx] = dst;
+	cpu->jit->patch_link(tc, idx);
+}
+
+static void
+tc_link_remove(tc_link_t *link)
+{
+	if (link->dst) {
+		if (link->prev) {
+			link->prev->next = link->next;
+		}
+		else {
+			link->dst->pred = link->next;
+		}
+		if (link->next) {
+			link->next->prev = link->prev;
+		}
+		link->dst = nullptr;
+	}
+}
+
+static void
+tc_link_add(translated_code_t *src, uint32_t idx, translated_code_t *dst)
+{
+	// records that the link idx of src now jumps to dst, so that tc_unlink can find src when dst is deleted
+	// a link that was already used is moved to the new dst
+	tc_link_t *link = &src->links[idx];
+	tc_link_remove(link);
+	link->dst = dst;
+	link->prev = nullptr;
+	link->next = dst->pred;
+	if (dst->pred) {
+		dst->pred->prev = link;
+	}
+	dst->pred = link;
+}
+
+static void
+tc_unlink(cpu_ctx_t *cpu_ctx, translated_code_t *tc, translated_code_t *new_tc = nullptr)
+{
+	// the indirect branches that used to find tc in the ibtc now find new_tc, if any
+	translated_code_t *&ibtc_entry = cpu_ctx->ibtc[tc_ibtc_hash(tc->virt_pc)];
+	if (ibtc_entry == tc) {
+		ibtc_entry = new_tc ? new_tc : &dummy_tc;
+	}
+	tc_ret_stack_flush(cpu_ctx);
+
+	// unlink all other tc's that jump to this tc (aka the predecessors). If new_tc is not nullptr, they are linked to new_tc instead, which must translate the
+	// same guest code of tc. The link tells which jmp_offset of the predecessor, or its predicted return tc, points to tc
+	tc_link_t *link = tc->pred;
+	tc->pred = nullptr;
+	while (link) {
+		tc_link_t *next = link->next;
+		translated_code_t *pred_tc = link->src;
+		uint32_t idx = static_cast<uint32_t>(link - pred_tc->links);
+		if (idx == 2) {
+			pred_tc->ret_tc = new_tc ? new_tc : &dummy_tc;
+		}
+		else {
+			tc_set_jmp(cpu_ctx->cpu, pred_tc, idx, new_tc ? new_tc->ptr_code : pred_tc->jmp_offset[2]);
+		}
+		link->dst = nullptr;
+		if (new_tc) {
+			tc_link_add(pred_tc, idx, new_tc);
+		}
+		link = next;
+	}
+
+	// now remove this tc from the predecessors of the tc's that it's directly jumping to (aka the successors)
+	for (auto &succ_link : tc->links) {
+		tc_link_remove(&succ_link);
+	}
+}
+
+static void
+tc_cache_free_tc(cpu_t *cpu, std::unique_ptr<translated_code_t> &tc)
+{
+	// the running tc can delete itself (e.g. with a code write), but tc_refund_instr still needs it afterwards, so it's freed later by cpu_main_loop
+	if (tc.get() == cpu->cpu_ctx.instr_tc) {
+		cpu->instr_clock.erased_tc = std::move(tc);
+	}
+	else {
+		tc.reset();
+	}
+}
+
+static void
+tc_cache_erase(cpu_t *cpu, translated_code_t *tc)
+{
+	// deletes tc from the code cache. Instead of leaving a tombstone, the following entries of the probe sequence are shifted back, so that searches never
+	// need to skip deleted slots. The code of tc might still be running (e.g. when this is called from tc_invalidate), so it's freed later by cpu_main_loop
+	if (tc->jmp_offset[2]) {
+		cpu->dead_code.push_back(reinterpret_cast<void *>(tc->jmp_offset[2]));
+	}
+	cpu->num_tc--;
+	cpu->code_size -= tc->code_size;
+
+	uint32_t mask = CODE_CACHE_TABLE_SIZE - 1;
+	uint32_t idx = tc_hash(tc->pc, tc->cs_base, tc->guest_flags);
+	while (cpu->code_cache[idx].tc.get() != tc) {
+		assert(cpu->code_cache[idx].tc);
+		idx = (idx + 1) & mask;
+	}
+	tc_cache_free_tc(cpu, cpu->code_cache[idx].tc);
+
+	uint32_t next_idx = idx;
+	while (true) {
+		next_idx = (next_idx + 1) & mask;
+		tc_cache_entry_t &entry = cpu->code_cache[next_idx];
+		if (!entry.tc) {
+			break;
+		}
+
+		// the entry can only be moved to the empty slot if that is not before its home slot in the probe sequence
+		uint32_t home_idx = tc_hash(entry.pc, entry.cs_base, entry.guest_flags);
+		if (((next_idx - home_idx) & mask) >= ((next_idx - idx) & mask)) {
+			cpu->code_cache[idx] = std::move(entry);
+			idx = next_idx;
+		}
+	}
+}
+
+static uint64_t
+tc_code_mask(addr_t addr, uint32_t size)
+{
+	// returns the bits of tc_page_t::code_mask covered by the range [addr, addr + size), clipped to the page of addr
+	static_assert((PAGE_SIZE >> SMC_CHUNK_SHIFT) == 64);
+	if (size == 0) {
+		return 0;
+	}
+
+	uint32_t first = (addr & PAGE_MASK) >> SMC_CHUNK_SHIFT;
+	uint32_t last = (std::min<uint32_t>((addr & PAGE_MASK) + size, PAGE_SIZE) - 1) >> SMC_CHUNK_SHIFT;
+	return (~0ULL >> (63 - last)) & (~0ULL << first);
+}
+
+static tc_page_t *
+tc_page_find(cpu_t *cpu, addr_t phys_addr)
+{
+	// returns nullptr if no tc was ever translated from the pages of this second level of tc_page_map
+	tc_page_t *pages = cpu->tc_page_map[phys_addr >> (PAGE_SHIFT + TC_PAGE_L2_SHIFT)].get();
+	return pages ? &pages[(phys_addr >> PAGE_SHIFT) & (TC_PAGE_L2_SIZE - 1)] : nullptr;
+}
+
+static tc_page_t &
+tc_page_get(cpu_t *cpu, addr_t phys_addr)
+{
+	std::unique_ptr<tc_page_t[]> &pages = cpu->tc_page_map[phys_addr >> (PAGE_SHIFT + TC_PAGE_L2_SHIFT)];
+	if (!pages) {
+		pages.reset(new tc_page_t[TC_PAGE_L2_SIZE]());
+	}
+	return pages[(phys_addr >> PAGE_SHIFT) & (TC_PAGE_L2_SIZE - 1)];
+}
+
+static void
+tc_page_insert(cpu_t *cpu, addr_t pc, translated_code_t *tc)
+{
+	tc_page_t &page = tc_page_get(cpu, pc);
+	tc->page_prev = nullptr;
+	tc->page_next = page.tcs;
+	if (page.tcs) {
+		page.tcs->page_prev = tc;
+	}
+	page.tcs = tc;
+	page.code_mask |= tc_code_mask(pc, tc->size);
+}
+
+static void
+tc_page_erase(tc_page_t &page, translated_code_t *tc)
+{
+	if (tc->page_prev) {
+		tc->page_prev->page_next = tc->page_next;
+	}
+	else {
+		page.tcs = tc->page_next;
+	}
+	if (tc->page_next) {
+		tc->page_next->page_prev = tc->page_prev;
+	}
+}
+
+static void
+tc_page_update(cpu_t *cpu, tc_page_t &page, addr_t phys_addr)
+{
+	// called after tc's were erased from the page. If it has no tc's left, also clear its smc bit. Otherwise, the code mask is computed again from the tc's
+	// that are left
+	page.code_mask = 0;
+	if (page.tcs == nullptr) {
+		cpu->smc.reset(phys_addr >> PAGE_SHIFT);
+	}
+	else {
+		for (translated_code_t *tc = page.tcs; tc; tc = tc->page_next) {
+			page.code_mask |= tc_code_mask(tc->pc, tc->size);
+		}
+	}
+}
+
+static void
+tc_cache_remove(cpu_t *cpu, translated_code_t *tc)
 {
-	return pc & (CODE_CACHE_MAX_SIZE - 1);
+	// deletes tc from the code cache, and also from the tc's of its page
+	tc_page_t &page = *tc_page_find(cpu, tc->pc);
+	tc_unlink(&cpu->cpu_ctx, tc);
+	tc_page_erase(page, tc);
+	tc_page_update(cpu, page, tc->pc);
+	tc_cache_erase(cpu, tc);
 }
 
 template<bool remove_hook>
-void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_t size, [[maybe_unused]] uint32_t eip)
+void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint32_t size, [[maybe_unused]] uint32_t eip)
 {
 	bool halt_tc = false;
 
@@ -409,14 +674,20 @@ void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_
 	}
 
 	// find all tc's in the page phys_addr belongs to
-	auto it_map = cpu_ctx->cpu->tc_page_map.find(phys_addr >> PAGE_SHIFT);
-	if (it_map != cpu_ctx->cpu->tc_page_map.end()) {
-		auto it_set = it_map->second.begin();
+	tc_page_t *page = tc_page_find(cpu_ctx->cpu, phys_addr);
+	if (page && page->tcs) {
+		if constexpr (!remove_hook) {
+			// the write only touches data that shares the page with the code, so none of the tc's can overlap with it
+			if (!(page->code_mask & tc_code_mask(phys_addr, size))) {
+				return;
+			}
+		}
+
 		uint32_t flags = (cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST);
-		std::vector<std::unordered_set<translated_code_t *>::iterator> tc_to_delete;
-		// iterate over all tc's found in the page
-		while (it_set != it_map->second.end()) {
-			translated_code_t *tc_in_page = *it_set;
+		bool tc_removed = false;
+		// iterate over all tc's found in the page. The next tc is fetched first, because the current one might be unlinked from the list below
+		for (translated_code_t *tc_in_page = page->tcs, *tc_next; tc_in_page; tc_in_page = tc_next) {
+			tc_next = tc_in_page->page_next;
 			// only invalidate the tc if phys_addr is included in the translated address range of the tc
 			// hook tc's have a zero guest code size, so they are unaffected by guest writes and do not need to be considered by tc_invalidate
 			bool remove_tc;
@@ -427,98 +698,52 @@ void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_
 				remove_tc = tc_in_page->size && !(std::min(phys_addr + size - 1, tc_in_page->pc + tc_in_page->size - 1) < std::max(phys_addr, tc_in_page->pc));
 			}
 
+			bool is_running = false;
 			if (remove_tc) {
-				auto it_list = tc_in_page->linked_tc.begin();
-				// now unlink all other tc's that jump to this tc (aka the predecessors)
-				while (it_list != tc_in_page->linked_tc.end()) {
-					uint32_t tc_link_type = (*it_list)->flags & TC_FLG_LINK_MASK;
-					if ((tc_link_type == TC_FLG_DIRECT) || (tc_link_type == TC_FLG_DST_COND) || (tc_link_type == TC_FLG_DST_ONLY)) {
-						if ((*it_list)->jmp_offset[0] == tc_in_page->ptr_code) {
-							(*it_list)->jmp_offset[0] = (*it_list)->jmp_offset[2];
-						}
-						if ((*it_list)->jmp_offset[1] == tc_in_page->ptr_code) {
-							(*it_list)->jmp_offset[1] = (*it_list)->jmp_offset[2];
-						}
-					}
-					else {
-						assert((tc_link_type == TC_FLG_INDIRECT) || (tc_link_type == TC_FLG_RET));
-						for (auto &entry : (*it_list)->ibtc) {
-							if (entry == tc_in_page) {
-								entry = &dummy_tc;
-							}
-						}
-					}
-					++it_list;
+				try {
+					// worst case: the write overlaps with the tc we are currently executing
+					is_running = tc_in_page->cs_base == cpu_ctx->regs.cs_hidden.base &&
+						tc_in_page->pc == get_code_addr(cpu_ctx->cpu, get_pc(cpu_ctx), cpu_ctx->regs.eip) &&
+						tc_in_page->guest_flags == flags;
 				}
-
-				// now update the linked_tc list of the tc's that this tc is (in)directly jumping to (aka the successors)
-				const auto update_linked_tc_lambda = [tc_in_page](translated_code_t *tc) {
-					if (tc == tc_in_page) {
-						return true;
-					}
-					return false;
-				};
-				if (tc_in_page->jmp_offset[0] != tc_in_page->jmp_offset[2]) {
-					translated_code_t *dst_tc = *reinterpret_cast<translated_code_t **>(reinterpret_cast<uint8_t *>(tc_in_page->jmp_offset[0]) - 14);
-					[[maybe_unused]] const auto erased = std::erase_if(dst_tc->linked_tc, update_linked_tc_lambda);
-					assert(erased);
+				catch (host_exp_t type) {
+					// the current tc cannot fault
 				}
-				if (tc_in_page->jmp_offset[1] != tc_in_page->jmp_offset[2]) {
-					translated_code_t *next_tc = *reinterpret_cast<translated_code_t **>(reinterpret_cast<uint8_t *>(tc_in_page->jmp_offset[1]) - 14);
-					[[maybe_unused]] const auto erased = std::erase_if(next_tc->linked_tc, update_linked_tc_lambda);
-					assert(erased);
-				}
-				for (auto &entry : tc_in_page->ibtc) {
-					if (entry->guest_flags != HFLG_INVALID) {
-						[[maybe_unused]] const auto erased = std::erase_if(entry->linked_tc, update_linked_tc_lambda);
-						assert(erased);
-					}
+
+				if constexpr (!remove_hook) {
+					// a self checking tc notices by itself that its code changed the next time it runs, unless it's running now
+					remove_tc = is_running || !(tc_in_page->flags & TC_FLG_SELF_CHECK);
 				}
+			}
 
-				// delete the found tc from the code cache
-				uint32_t idx = tc_hash(tc_in_page->pc);
-				auto it = cpu_ctx->cpu->code_cache[idx].begin();
-				while (it != cpu_ctx->cpu->code_cache[idx].end()) {
-					if (it->get() == tc_in_page) {
-						try {
-							if (it->get()->cs_base == cpu_ctx->regs.cs_hidden.base &&
-								it->get()->pc == get_code_addr(cpu_ctx->cpu, get_pc(cpu_ctx), cpu_ctx->regs.eip) &&
-								it->get()->guest_flags == flags) {
-								// worst case: the write overlaps with the tc we are currently executing
-								halt_tc = true;
-								if constexpr (!remove_hook) {
-									cpu_ctx->cpu->cpu_flags |= (CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE);
-								}
-							}
-						}
-						catch (host_exp_t type) {
-							// the current tc cannot fault
-						}
-						cpu_ctx->cpu->code_cache[idx].erase(it);
-						break;
+			if (remove_tc) {
+				tc_unlink(cpu_ctx, tc_in_page);
+
+				if (is_running) {
+					halt_tc = true;
+					if constexpr (!remove_hook) {
+						cpu_ctx->cpu->cpu_flags |= (CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE);
 					}
-					++it;
 				}
 
-				// we can't delete the tc in tc_page_map right now because it would invalidate its iterator, which is still needed below
-				tc_to_delete.push_back(it_set);
+				// delete the found tc from the tc's of the page and from the code cache
+				tc_page_erase(*page, tc_in_page);
+				tc_cache_erase(cpu_ctx->cpu, tc_in_page);
+				tc_removed = true;
 
 				if constexpr (remove_hook) {
 					break;
 				}
 			}
-			++it_set;
 		}
 
-		// delete the found tc's from tc_page_map
-		for (auto &it : tc_to_delete) {
-			it_map->second.erase(it);
-		}
+		if (tc_removed) {
+			if constexpr (!remove_hook) {
+				// count the writes that forced a new translation of the code of this page, see tc_needs_self_check
+				++page->smc_writes;
+			}
 
-		// if the tc_page_map for phys_addr is now empty, also clear the corresponding smc bit and its key in the map
-		if (it_map->second.empty()) {
-			cpu_ctx->cpu->smc.reset(phys_addr >> PAGE_SHIFT);
-			cpu_ctx->cpu->tc_page_map.erase(it_map);
+			tc_page_update(cpu_ctx->cpu, *page, phys_addr);
 		}
 	}
 
@@ -531,23 +756,23 @@ void tc_invalidate(cpu_ctx_t *cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_
 	}
 }
 
-template void tc_invalidate<true>(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_t size, [[maybe_unused]] uint32_t eip);
-template void tc_invalidate<false>(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint8_t size, [[maybe_unused]] uint32_t eip);
+template void tc_invalidate<true>(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint32_t size, [[maybe_unused]] uint32_t eip);
+template void tc_invalidate<false>(cpu_ctx_t * cpu_ctx, addr_t phys_addr, [[maybe_unused]] uint32_t size, [[maybe_unused]] uint32_t eip);
 
 static translated_code_t *
 tc_cache_search(cpu_t *cpu, addr_t pc)
 {
 	uint32_t flags = (cpu->cpu_ctx.hflags & HFLG_CONST) | (cpu->cpu_ctx.regs.eflags & EFLAGS_CONST);
-	uint32_t idx = tc_hash(pc);
-	auto it = cpu->code_cache[idx].begin();
-	while (it != cpu->code_cache[idx].end()) {
-		translated_code_t *tc = it->get();
-		if (tc->cs_base == cpu->cpu_ctx.regs.cs_hidden.base &&
-			tc->pc == pc &&
-			tc->guest_flags == flags) {
-			return tc;
+	addr_t cs_base = cpu->cpu_ctx.regs.cs_hidden.base;
+	uint32_t idx = tc_hash(pc, cs_base, flags);
+	while (cpu->code_cache[idx].tc) {
+		tc_cache_entry_t &entry = cpu->code_cache[idx];
+		if (entry.cs_base == cs_base &&
+			entry.pc == pc &&
+			entry.guest_flags == flags) {
+			return entry.tc.get();
 		}
-		it++;
+		idx = (idx + 1) & (CODE_CACHE_TABLE_SIZE - 1);
 	}
 
 	return nullptr;
@@ -556,9 +781,30 @@ tc_cache_search(cpu_t *cpu, addr_t pc)
 static void
 tc_cache_insert(cpu_t *cpu, addr_t pc, std::unique_ptr<translated_code_t> &&tc)
 {
+	// the table can't be full, because it has more slots than the max number of tc's that tc_cache_evict allows
 	cpu->num_tc++;
-	cpu->tc_page_map[pc >> PAGE_SHIFT].insert(tc.get());
-	cpu->code_cache[tc_hash(pc)].push_front(std::move(tc));
+	cpu->code_size += tc->code_size;
+	tc_page_insert(cpu, pc, tc.get());
+	uint32_t idx = tc_hash(pc, tc->cs_base, tc->guest_flags);
+	while (cpu->code_cache[idx].tc) {
+		idx = (idx + 1) & (CODE_CACHE_TABLE_SIZE - 1);
+	}
+	tc_cache_entry_t &entry = cpu->code_cache[idx];
+	entry.pc = pc;
+	entry.cs_base = tc->cs_base;
+	entry.guest_flags = tc->guest_flags;
+	entry.tc = std::move(tc);
+}
+
+static void
+tc_cache_replace(cpu_t *cpu, translated_code_t *old_tc, std::unique_ptr<translated_code_t> &&tc)
+{
+	// swaps old_tc with its recompiled version tc: all the links to old_tc now point to tc, and old_tc is removed from the code cache
+	tc_unlink(&cpu->cpu_ctx, old_tc, tc.get());
+	// the bits of old_tc are left in the code mask of the page, which can only cause a few more checks in tc_invalidate
+	tc_page_erase(*tc_page_find(cpu, old_tc->pc), old_tc);
+	tc_cache_erase(cpu, old_tc);
+	tc_cache_insert(cpu, tc->pc, std::move(tc));
 }
 
 template<bool should_flush_tlb>
@@ -580,12 +826,33 @@ void
 tc_cache_clear(cpu_t *cpu)
 {
 	// Use this when you want to destroy all tc's but without affecting the actual code allocated. E.g: on x86-64, you'll want to keep the .pdata sections
-	// when this is called from a function called from the JITed code, and the current function can potentially throw an exception
-	cpu->tc_page_map.clear();
+	// when this is called from a function called from the JITed code, and the current function can potentially throw an exception. The code is freed later
+	// by cpu_main_loop
+	// the second levels of tc_page_map are kept, so that the same pages don't need to allocate them again, and so are the smc writes
+	for (auto &pages : cpu->tc_page_map) {
+		if (pages) {
+			for (uint32_t i = 0; i < TC_PAGE_L2_SIZE; ++i) {
+				pages[i].tcs = nullptr;
+				pages[i].code_mask = 0;
+			}
+		}
+	}
 	cpu->smc.reset();
-	for (auto &bucket : cpu->code_cache) {
-		bucket.clear();
+	cpu->superblock.hot_tc = nullptr;
+	tc_ret_stack_flush(&cpu->cpu_ctx);
+	for (auto &entry : cpu->cpu_ctx.ibtc) {
+		entry = &dummy_tc;
+	}
+	for (auto &entry : cpu->code_cache) {
+		if (entry.tc) {
+			if (entry.tc->jmp_offset[2]) {
+				cpu->dead_code.push_back(reinterpret_cast<void *>(entry.tc->jmp_offset[2]));
+			}
+			tc_cache_free_tc(cpu, entry.tc);
+		}
 	}
+	cpu->num_tc = 0;
+	cpu->code_size = 0;
 }
 
 void
@@ -594,13 +861,71 @@ tc_cache_purge(cpu_t *cpu)
 	// This is like tc_cache_clear, but it also frees all code allocated. E.g: on x86-64, the jit also emits .pdata sections that hold the exception tables
 	// necessary to unwind the stack of the JITed functions
 	tc_cache_clear(cpu);
+	cpu->dead_code.clear();
 	cpu->jit->destroy_all_code();
 	cpu->jit->gen_aux_funcs();
-	cpu->num_tc = 0;
+}
+
+static bool
+tc_cache_is_full(cpu_t *cpu)
+{
+	return (cpu->num_tc >= cpu->max_num_tc) || (cpu->code_size >= cpu->max_code_size);
+}
+
+static void
+tc_cache_free_dead_code(cpu_t *cpu)
+{
+	for (void *addr : cpu->dead_code) {
+		cpu->jit->free_code_block(addr);
+	}
+	cpu->dead_code.clear();
+	cpu->instr_clock.erased_tc.reset();
 }
 
 static void
-tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
+tc_cache_evict(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *hot_tc)
+{
+	// Frees the cold tc's with a clock sweep of the code cache, instead of purging all of it. Every tc sets its accessed flag when it runs, and the sweep
+	// clears it, so only the tc's that didn't run since the last sweep are evicted. The sweep stops when 1/8 of both limits is free, so that the cost of a
+	// sweep is paid once for a whole batch of new tc's. prev_tc and hot_tc are still needed by cpu_main_loop, and hook tc's might be in the middle of a
+	// trampoline call, so they are never evicted
+
+	uint32_t num_tc_target = cpu->max_num_tc - (cpu->max_num_tc >> 3);
+	uint64_t code_size_target = cpu->max_code_size - (cpu->max_code_size >> 3);
+	uint32_t num_visited = 0;
+	// after two full sweeps, all accessed flags were cleared, so the only tc's left are the ones that can't be evicted
+	while (((cpu->num_tc > num_tc_target) || (cpu->code_size > code_size_target)) && (num_visited < (2 * CODE_CACHE_TABLE_SIZE))) {
+		translated_code_t *tc = cpu->code_cache[cpu->evict_idx].tc.get();
+		++num_visited;
+		if (tc && !tc->accessed && tc->size && (tc != prev_tc) && (tc != hot_tc) && (tc != cpu->superblock.hot_tc)) {
+			// don't advance evict_idx, because tc_cache_erase might have moved another tc to this slot
+			tc_cache_remove(cpu, tc);
+			continue;
+		}
+
+		if (tc) {
+			tc->accessed = 0;
+		}
+		cpu->evict_idx = (cpu->evict_idx + 1) & (CODE_CACHE_TABLE_SIZE - 1);
+	}
+}
+
+template<bool is_tramp>
+static void
+tc_cache_make_room(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *hot_tc)
+{
+	// called by cpu_main_loop before inserting a new tc. The code of the deleted tc's can only be freed when no jitted code is running, which is not the case
+	// during a trampoline call, because the hook tc that called the trampoline is still on the stack
+	if (tc_cache_is_full(cpu)) {
+		tc_cache_evict(cpu, prev_tc, hot_tc);
+	}
+	if constexpr (!is_tramp) {
+		tc_cache_free_dead_code(cpu);
+	}
+}
+
+static void
+tc_link_direct(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 {
 	uint32_t num_jmp = prev_tc->flags & TC_FLG_NUM_JMP;
 
@@ -614,13 +939,15 @@ tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 		switch ((prev_tc->flags & TC_FLG_JMP_TAKEN) >> 4)
 		{
 		case TC_JMP_DST_PC:
-			prev_tc->jmp_offset[0] = ptr_tc->ptr_code;
-			ptr_tc->linked_tc.push_front(prev_tc);
+			tc_set_jmp(cpu, prev_tc, 0, ptr_tc->ptr_code);
+			tc_link_add(prev_tc, 0, ptr_tc);
+			prev_tc->link_gen[0] = cpu->cpu_ctx.tlb_gen;
 			break;
 
 		case TC_JMP_NEXT_PC:
-			prev_tc->jmp_offset[1] = ptr_tc->ptr_code;
-			ptr_tc->linked_tc.push_front(prev_tc);
+			tc_set_jmp(cpu, prev_tc, 1, ptr_tc->ptr_code);
+			tc_link_add(prev_tc, 1, ptr_tc);
+			prev_tc->link_gen[1] = cpu->cpu_ctx.tlb_gen;
 			break;
 
 		case TC_JMP_RET:
@@ -639,8 +966,8 @@ tc_link_direct(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 	}
 }
 
-void
-tc_link_dst_only(translated_code_t *prev_tc, translated_code_t *ptr_tc)
+static void
+tc_link_dst_only(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 {
 	switch (prev_tc->flags & TC_FLG_NUM_JMP)
 	{
@@ -648,8 +975,8 @@ tc_link_dst_only(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 		break;
 
 	case 1:
-		prev_tc->jmp_offset[0] = ptr_tc->ptr_code;
-		ptr_tc->linked_tc.push_front(prev_tc);
+		tc_set_jmp(cpu, prev_tc, 0, ptr_tc->ptr_code);
+		tc_link_add(prev_tc, 0, ptr_tc);
 		break;
 
 	default:
@@ -658,70 +985,144 @@ tc_link_dst_only(translated_code_t *prev_tc, translated_code_t *ptr_tc)
 }
 
 static void
-tc_link_indirect(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
+tc_link_indirect(cpu_ctx_t *cpu_ctx, translated_code_t *ptr_tc)
 {
-	// dst pc of ptr_tc must be in the same page of prev_tc to avoid possible page faults
-	if ((ptr_tc->virt_pc & ~PAGE_MASK) == (prev_tc->virt_pc & ~PAGE_MASK)) {
-		for (auto &entry : prev_tc->ibtc) {
-			if (entry->guest_flags == HFLG_INVALID) {
-				entry = ptr_tc;
-				ptr_tc->linked_tc.push_front(prev_tc);
-				return;
-			}
-		}
+	// insert ptr_tc in the ibtc, replacing the tc with the same hash, if any. There's no need to track the tc's that find ptr_tc there, since the ibtc is
+	// searched again every time an indirect branch is executed
+	cpu_ctx->ibtc[tc_ibtc_hash(ptr_tc->virt_pc)] = ptr_tc;
+}
 
-		// if we reach here, it means the ibtc is full. In this case we pick a random entry and replace it
-		std::uniform_int_distribution<uint32_t> dis(0, 2);
-		uint32_t idx = dis(cpu->rng_gen);
-		[[maybe_unused]] const auto erased = std::erase_if(prev_tc->ibtc[idx]->linked_tc, [prev_tc](translated_code_t *tc) {
-			if (tc == prev_tc) {
-				return true;
-			}
-			return false;
-			});
-		assert(erased);
-		prev_tc->ibtc[idx] = ptr_tc;
-		ptr_tc->linked_tc.push_front(prev_tc);
+static void
+tc_link_ret(cpu_ctx_t *cpu_ctx, translated_code_t *ptr_tc)
+{
+	// the last near ret was mispredicted, so use the tc it returned to as the new prediction of the call that pushed the return address. Once set, the
+	// prediction is only cleared by tc_unlink, since the guest code after a call is almost always the same
+	translated_code_t *call_tc = cpu_ctx->ret_stack.miss_tc;
+	if (call_tc && (call_tc->ret_tc == &dummy_tc) && (call_tc->cs_base == ptr_tc->cs_base) && (cpu_ctx->ret_stack.miss_pc == ptr_tc->virt_pc)) {
+		call_tc->ret_tc = ptr_tc;
+		tc_link_add(call_tc, 2, ptr_tc);
+	}
+	cpu_ctx->ret_stack.miss_tc = nullptr;
+}
+
+static bool
+tc_itlb_check(cpu_ctx_t *cpu_ctx, translated_code_t *dst_tc)
+{
+	// returns true if the itlb currently maps the virtual page of dst_tc to the physical page it was translated from. This doesn't walk the page tables, so
+	// a miss only means that we can't link to dst_tc without going through the dispatcher first
+	uint32_t idx = (dst_tc->virt_pc >> PAGE_SHIFT) & ITLB_IDX_MASK;
+	uint64_t mem_access = tlb_access[0][cpu_ctx->hflags & HFLG_CPL];
+	uint64_t tag = ((static_cast<uint64_t>(dst_tc->virt_pc) << ITLB_TAG_SHIFT64) & ITLB_TAG_MASK64) | mem_access;
+	mem_access |= ITLB_TAG_MASK64;
+	for (unsigned i = 0; i < ITLB_NUM_LINES; ++i) {
+		if (((cpu_ctx->itlb[idx][i].entry & mem_access) ^ tag) == 0) {
+			return static_cast<addr_t>(cpu_ctx->itlb[idx][i].entry & ~PAGE_MASK) == (dst_tc->pc & ~PAGE_MASK);
+		}
 	}
+
+	return false;
 }
 
 entry_t
 link_indirect_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 {
+	// this is only reached when the inline search of the ibtc emitted by lc86_jit::gen_link_indirect fails, or when the dst is on another page. In the latter
+	// case, the dst tc can still be used if the itlb maps its page to the code it was translated from
 	// NOTE: make sure to check guest_flags first, so that if we are comparing against the dummy_tc, we fail at the first comparison
-	for (const auto entry : tc->ibtc) {
-		if (entry->guest_flags == ((cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST)) && // must have matching hidden flags
-			(entry->cs_base == cpu_ctx->regs.cs_hidden.base) && // must have same cs_base to avoid jumping to wrong pc
-			(entry->virt_pc == get_pc(cpu_ctx))) { // must match dst pc we are jumping to
-			return entry->ptr_code;
-		}
+	addr_t pc = get_pc(cpu_ctx);
+	translated_code_t *entry = cpu_ctx->ibtc[tc_ibtc_hash(pc)];
+	if (entry->guest_flags == ((cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST)) && // must have matching hidden flags
+		(entry->cs_base == cpu_ctx->regs.cs_hidden.base) && // must have same cs_base to avoid jumping to wrong pc
+		(entry->virt_pc == pc) && // must match dst pc we are jumping to
+		(((entry->virt_pc & ~PAGE_MASK) == (tc->virt_pc & ~PAGE_MASK)) || tc_itlb_check(cpu_ctx, entry))) { // must be mapped to the same code
+		++cpu_ctx->ibtc_hits;
+		return entry->ptr_code;
 	}
 
+	++cpu_ctx->ibtc_misses;
 	return tc->jmp_offset[2];
 }
 
+entry_t
+link_ret_handler(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
+{
+	// pop the return stack buffer and check if the predicted tc is the one the near ret of tc returns to. Like in the ibtc, a prediction on another page is
+	// only accepted if the itlb still maps that page to the code of the predicted tc
+	ret_stack_t *ret_stack = &cpu_ctx->ret_stack;
+	uint32_t idx = ret_stack->idx;
+	translated_code_t *call_tc = ret_stack->call_tc[idx];
+	addr_t ret_pc = ret_stack->ret_pc[idx];
+	ret_stack->call_tc[idx] = nullptr;
+	ret_stack->idx = (idx - 1) & (RET_STACK_SIZE - 1);
+	ret_stack->miss_tc = nullptr;
+
+	addr_t pc = get_pc(cpu_ctx);
+	if (call_tc && (ret_pc == pc)) {
+		translated_code_t *ret_tc = call_tc->ret_tc;
+		if (ret_tc->guest_flags == ((cpu_ctx->hflags & HFLG_CONST) | (cpu_ctx->regs.eflags & EFLAGS_CONST)) &&
+			(ret_tc->cs_base == cpu_ctx->regs.cs_hidden.base) &&
+			(ret_tc->virt_pc == pc) &&
+			(((ret_tc->virt_pc & ~PAGE_MASK) == (tc->virt_pc & ~PAGE_MASK)) || tc_itlb_check(cpu_ctx, ret_tc))) {
+			return ret_tc->ptr_code;
+		}
+
+		// remember the call, so that tc_link_ret can update its prediction after the dispatcher has found the tc we are returning to
+		ret_stack->miss_tc = call_tc;
+		ret_stack->miss_pc = ret_pc;
+	}
+
+	// the guest didn't return to the address pushed by the last call (e.g. it changed the return address on the stack), or the prediction failed
+	return link_indirect_handler(cpu_ctx, tc);
+}
+
+void
+tc_self_check_failed(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
+{
+	// called by a self checking tc when its guest code changed since it was translated. Nothing of it ran yet, so it's deleted and the tc then returns to
+	// cpu_main_loop, which translates the new code. Like in tc_invalidate, the code of tc is freed later
+	cpu_t *cpu = cpu_ctx->cpu;
+	if (cpu->superblock.hot_tc == tc) {
+		cpu->superblock.hot_tc = nullptr;
+	}
+	tc_cache_remove(cpu, tc);
+}
+
+static bool
+tc_needs_self_check(cpu_t *cpu, addr_t pc)
+{
+	// The code of a page that the guest writes to often is translated with self checking tc's, which are not deleted by tc_invalidate, and instead compare
+	// their guest code with the one they were translated from every time they run. This avoids translating the same code again after every write when the
+	// guest keeps data next to its code, or patches it often
+	const tc_page_t *page = tc_page_find(cpu, pc);
+	return page && (page->smc_writes >= SMC_CHECK_THRESHOLD);
+}
+
 static void
 tc_link_prev(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 {
-	// see if we can link the previous tc with the current one
-	if (prev_tc != nullptr) {
+	// see if we can link the previous tc with the current one. Interpreted tc's have no code to jump to, so they can't be linked
+	if ((prev_tc != nullptr) && !(ptr_tc->flags & TC_FLG_INTERP)) {
 		switch (prev_tc->flags & TC_FLG_LINK_MASK)
 		{
 		case 0:
 			break;
 
 		case TC_FLG_DST_ONLY:
-			tc_link_dst_only(prev_tc, ptr_tc);
+			tc_link_dst_only(cpu, prev_tc, ptr_tc);
 			break;
 
 		case TC_FLG_DIRECT:
 		case TC_FLG_DST_COND:
-			tc_link_direct(prev_tc, ptr_tc);
+			tc_link_direct(cpu, prev_tc, ptr_tc);
 			break;
 
 		case TC_FLG_RET:
+			tc_link_ret(&cpu->cpu_ctx, ptr_tc);
+			tc_link_indirect(&cpu->cpu_ctx, ptr_tc);
+			break;
+
 		case TC_FLG_INDIRECT:
-			tc_link_indirect(cpu, prev_tc, ptr_tc);
+			tc_link_indirect(&cpu->cpu_ctx, ptr_tc);
 			break;
 
 		default:
@@ -730,6 +1131,171 @@ tc_link_prev(cpu_t *cpu, translated_code_t *prev_tc, translated_code_t *ptr_tc)
 	}
 }
 
+static void
+tc_build_superblock_trace(cpu_t *cpu, translated_code_t *hot_tc)
+{
+	// follow the direct links that the hot tc and its successors took the last time they were executed, and record the tc's found in the trace. Only forward jumps
+	// in the same page are followed, so that the superblock can still be invalidated by a single guest code range [pc, pc + size), like any other tc
+	std::vector<addr_t> &trace = cpu->superblock.trace;
+	trace.clear();
+	translated_code_t *tc = hot_tc;
+	while (trace.size() < (SUPERBLOCK_MAX_TC - 1)) {
+		if ((tc->flags & TC_FLG_LINK_MASK) != TC_FLG_DIRECT) {
+			break;
+		}
+
+		uint32_t jmp_taken = (tc->flags & TC_FLG_JMP_TAKEN) >> 4;
+		if ((jmp_taken == TC_JMP_RET) || (tc->jmp_offset[jmp_taken] == tc->jmp_offset[2])) {
+			break;
+		}
+
+		translated_code_t *next_tc = tc->links[jmp_taken].dst;
+		if ((next_tc->virt_pc < (tc->virt_pc + tc->size)) ||
+			((next_tc->virt_pc & ~PAGE_MASK) != (hot_tc->virt_pc & ~PAGE_MASK)) ||
+			(next_tc->cs_base != hot_tc->cs_base) ||
+			(next_tc->guest_flags != hot_tc->guest_flags) ||
+			(next_tc->size == 0)) {
+			break;
+		}
+
+		trace.push_back(next_tc->virt_pc);
+		tc = next_tc;
+	}
+
+	cpu->superblock.idx = 0;
+}
+
+static bool
+is_flags_producer(ZydisDecodedInstruction *instr)
+{
+	// instructions whose emitters only write the lazy eflags with set_flags, set_flags_sum or set_flags_sub
+	switch (instr->mnemonic)
+	{
+	case ZYDIS_MNEMONIC_ADC:
+	case ZYDIS_MNEMONIC_ADD:
+	case ZYDIS_MNEMONIC_AND:
+	case ZYDIS_MNEMONIC_CMP:
+	case ZYDIS_MNEMONIC_DEC:
+	case ZYDIS_MNEMONIC_INC:
+	case ZYDIS_MNEMONIC_NEG:
+	case ZYDIS_MNEMONIC_OR:
+	case ZYDIS_MNEMONIC_SBB:
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_TEST:
+	case ZYDIS_MNEMONIC_XOR:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool
+has_only_gpr_operands(ZydisDecodedInstruction *instr, bool allow_mem)
+{
+	// true if the instr cannot fault because of its operands
+	for (unsigned i = 0; i < instr->operand_count; ++i) {
+		ZydisDecodedOperand *operand = &instr->operands[i];
+		if (operand->visibility == ZYDIS_OPERAND_VISIBILITY_HIDDEN) {
+			continue;
+		}
+
+		switch (operand->type)
+		{
+		case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+			break;
+
+		case ZYDIS_OPERAND_TYPE_REGISTER:
+			switch (ZydisRegisterGetClass(operand->reg.value))
+			{
+			case ZYDIS_REGCLASS_GPR8:
+			case ZYDIS_REGCLASS_GPR16:
+			case ZYDIS_REGCLASS_GPR32:
+				break;
+
+			default:
+				return false;
+			}
+			break;
+
+		case ZYDIS_OPERAND_TYPE_MEMORY:
+			if (!allow_mem) {
+				return false;
+			}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+are_flags_dead(cpu_t *cpu, disas_ctx_t *disas_ctx, ZydisDecoder *decoder)
+{
+	// Looks at the instructions that follow the current one, to find out if the arithmetic flags it produces are overwritten before they are read. This only
+	// considers the instructions of the current tc: the successors of a tc can be retranslated independently, so the flags are always live at its end. The scan
+	// stops at the first instr that can fault, read the flags or end the tc, because the flags must be correct when an exception is raised
+
+	if ((disas_ctx->flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR)) || (cpu->cpu_ctx.regs.dr[7] & DR7_EN_MASK)) {
+		return false;
+	}
+
+	addr_t virt_pc = disas_ctx->virt_pc, pc = disas_ctx->pc;
+	for (unsigned i = 0; i < FLAGS_LOOKAHEAD_MAX; ++i) {
+		if (((virt_pc & PAGE_MASK) + X86_MAX_INSTR_LENGTH) > PAGE_SIZE) {
+			return false;
+		}
+
+		uint8_t instr_buffer[X86_MAX_INSTR_LENGTH];
+		ZydisDecodedInstruction instr;
+		if ((as_ram_dispatch_read(cpu, pc, sizeof(instr_buffer), as_memory_search_addr(cpu, pc), instr_buffer) != sizeof(instr_buffer)) ||
+			!ZYAN_SUCCESS(ZydisDecoderDecodeBuffer(decoder, instr_buffer, sizeof(instr_buffer), &instr))) {
+			return false;
+		}
+
+		switch (instr.mnemonic)
+		{
+		case ZYDIS_MNEMONIC_ADD:
+		case ZYDIS_MNEMONIC_AND:
+		case ZYDIS_MNEMONIC_CMP:
+		case ZYDIS_MNEMONIC_NEG:
+		case ZYDIS_MNEMONIC_OR:
+		case ZYDIS_MNEMONIC_SUB:
+		case ZYDIS_MNEMONIC_TEST:
+		case ZYDIS_MNEMONIC_XOR:
+			// these overwrite all the lazy eflags without reading them
+			return has_only_gpr_operands(&instr, false);
+
+		case ZYDIS_MNEMONIC_MOV:
+		case ZYDIS_MNEMONIC_MOVSX:
+		case ZYDIS_MNEMONIC_MOVZX:
+		case ZYDIS_MNEMONIC_NOT:
+			// these don't touch the flags
+			if (!has_only_gpr_operands(&instr, false)) {
+				return false;
+			}
+			break;
+
+		case ZYDIS_MNEMONIC_LEA:
+			if (!has_only_gpr_operands(&instr, true)) {
+				return false;
+			}
+			break;
+
+		default:
+			return false;
+		}
+
+		virt_pc += instr.length;
+		pc += instr.length;
+	}
+
+	return false;
+}
+
 static void
 cpu_translate(cpu_t *cpu)
 {
@@ -743,6 +1309,22 @@ cpu_translate(cpu_t *cpu)
 
 	init_instr_decoder(disas_ctx, &decoder);
 
+	if (!(disas_ctx->flags & DISAS_FLG_ONE_INSTR)) {
+		if (cpu->tc->flags & TC_FLG_SELF_CHECK) {
+			cpu->jit->gen_self_check();
+		}
+		cpu->jit->gen_accessed_mark();
+		cpu->jit->gen_loop_head();
+		// superblocks are not built when counting instr, since their side exits would make the count depend on the tier that translated the code
+		if (!cpu->jit->is_optimizing() && !(cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT)) {
+			cpu->jit->gen_exec_counter();
+		}
+	}
+
+	if (cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT) {
+		cpu->jit->gen_instr_count_check();
+	}
+
 	do {
 		cpu->instr_eip = cpu->virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
 
@@ -830,6 +1412,13 @@ cpu_translate(cpu_t *cpu)
 			cpu->addr_mode = ADDR16;
 		}
 
+		cpu->jit->set_flags_dead(cpu->jit->is_optimizing() && is_flags_producer(&instr) && are_flags_dead(cpu, disas_ctx, &decoder));
+		cpu->jit->gen_reg_cache_begin(&instr);
+		++cpu->tc->instr_count;
+		if (cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT) {
+			cpu->tc->instr_len.push_back(cpu->instr_bytes);
+		}
+
 		switch (instr.mnemonic)
 		{
 		case ZYDIS_MNEMONIC_AAA:
@@ -1404,6 +1993,20 @@ cpu_translate(cpu_t *cpu)
 		cpu->virt_pc += cpu->instr_bytes;
 		cpu->tc->size += cpu->instr_bytes;
 
+		if (cpu->superblock.follow) {
+			// the jit merged the next tc of the trace in this superblock, so keep translating from its first instr. The gap between the two tc's is added
+			// to the size, so that guest writes to it also invalidate the superblock
+			addr_t next_pc = cpu->superblock.trace[cpu->superblock.idx++];
+			assert(next_pc >= disas_ctx->virt_pc);
+			cpu->superblock.follow = false;
+			cpu->translate_next = 1;
+			cpu->tc->flags &= ~TC_FLG_LINK_MASK;
+			cpu->tc->size += (next_pc - disas_ctx->virt_pc);
+			disas_ctx->pc += (next_pc - disas_ctx->virt_pc);
+			disas_ctx->virt_pc = next_pc;
+			cpu->virt_pc = next_pc;
+		}
+
 	} while ((cpu->translate_next | (disas_ctx->flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR))) == 1);
 }
 
@@ -1479,10 +2082,17 @@ void cpu_suppress_trampolines(cpu_t *cpu)
 	}
 }
 
+static bool
+tc_exceeds_instr_budget(cpu_t *cpu, translated_code_t *tc)
+{
+	// with cpu_run_instructions, the budget can end inside a tc. Such a tc returns at its instr count check, and the remaining instr are run one at a time
+	return (cpu->cpu_ctx.hflags & HFLG_INSTR_COUNT) && (tc->instr_count > cpu->cpu_ctx.instr_budget);
+}
+
 template<bool is_tramp, bool is_trap, typename T>
 void cpu_main_loop(cpu_t *cpu, T &&lambda)
 {
-	translated_code_t *prev_tc = nullptr, *ptr_tc = nullptr;
+	translated_code_t *prev_tc = nullptr, *ptr_tc = nullptr, *hot_tc = nullptr;
 	addr_t virt_pc, pc;
 
 	// main cpu loop
@@ -1518,6 +2128,28 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 			// if we are executing a trapped instr, we must always emit a new tc to run it and not consider other tc's in the cache. Doing so avoids having to invalidate
 			// the tc in the cache that contains the trapped instr
 			ptr_tc = tc_cache_search(cpu, pc);
+
+			if (ptr_tc && tc_exceeds_instr_budget(cpu, ptr_tc)) {
+				cpu->cpu_flags |= CPU_DISAS_ONE;
+				ptr_tc = nullptr;
+			}
+
+			if (cpu->superblock.hot_tc) {
+				// the tc we are about to run became hot, so recompile it with the optimizing tier, and also merge it with its successors in a superblock if possible.
+				// The hot tc stays in the code cache until its replacement is ready
+				if ((ptr_tc == cpu->superblock.hot_tc) && !(cpu->cpu_flags & CPU_DISAS_ONE)) {
+					tc_build_superblock_trace(cpu, ptr_tc);
+					hot_tc = ptr_tc;
+					ptr_tc = nullptr;
+				}
+				cpu->superblock.hot_tc = nullptr;
+			}
+			else if (ptr_tc && (ptr_tc->flags & TC_FLG_INTERP) && (ptr_tc->exec_count >= INTERP_HOT_COUNT) && !(cpu->cpu_flags & CPU_DISAS_ONE)) {
+				// the interpreted tc we are about to run is executed often enough, so translate it with the baseline tier of the jit. Like above, it stays in
+				// the code cache until its replacement is ready
+				hot_tc = ptr_tc;
+				ptr_tc = nullptr;
+			}
 		}
 
 		if (ptr_tc == nullptr) {
@@ -1526,7 +2158,6 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 			std::unique_ptr<translated_code_t> tc(new translated_code_t);
 
 			cpu->tc = tc.get();
-			cpu->jit->gen_tc_prologue();
 
 			// prepare the disas ctx
 			cpu->disas_ctx.flags = ((cpu->cpu_ctx.hflags & HFLG_CS32) >> CS32_SHIFT) |
@@ -1540,37 +2171,58 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 			cpu->disas_ctx.virt_pc = virt_pc;
 			cpu->disas_ctx.pc = pc;
 
-			if constexpr (is_trap) {
-				// don't take hooks if we are executing a trapped instr. Otherwise, if the trapped instr is also hooked, we will take the hook instead of executing it
-				cpu_translate(cpu);
-			}
-			else {
-				const auto it = cpu->hook_map.find(cpu->disas_ctx.virt_pc);
-				bool take_hook;
-				if constexpr (is_tramp) {
-					take_hook = (it != cpu->hook_map.end()) && !(cpu->cpu_ctx.hflags & HFLG_TRAMP);
-				}
-				else {
-					take_hook = it != cpu->hook_map.end();
+			// code translated by a previous run is loaded from the disk cache, if enabled. Otherwise, code that was never executed before is interpreted, if possible.
+			// Tc's that are being recompiled always use the jit, but the optimized ones are never in the disk cache. Self checking tc's also always use the jit,
+			// since the interpreter can't check the code
+			bool is_self_check = !(cpu->disas_ctx.flags & DISAS_FLG_ONE_INSTR) && tc_needs_self_check(cpu, pc);
+			bool is_loaded = !is_trap && !is_self_check && (!hot_tc || (hot_tc->flags & TC_FLG_INTERP)) && tc_disk_cache_load(cpu);
+			bool is_interp = !is_loaded && !is_self_check && (hot_tc == nullptr) && cpu_interp_translate(cpu);
+
+			if (!is_loaded && !is_interp) {
+				if (is_self_check) {
+					cpu->tc->flags |= TC_FLG_SELF_CHECK;
 				}
+				cpu->jit->gen_tc_prologue();
+				cpu->jit->set_optimize(hot_tc && !(hot_tc->flags & TC_FLG_INTERP));
 
-				if (take_hook) {
-					cpu->instr_eip = cpu->disas_ctx.virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
-					cpu->jit->gen_hook(it->second);
+				if constexpr (is_trap) {
+					// don't take hooks if we are executing a trapped instr. Otherwise, if the trapped instr is also hooked, we will take the hook instead of executing it
+					cpu_translate(cpu);
 				}
 				else {
-					// start guest code translation
-					cpu_translate(cpu);
+					const auto it = cpu->hook_map.find(cpu->disas_ctx.virt_pc);
+					bool take_hook;
+					if constexpr (is_tramp) {
+						take_hook = (it != cpu->hook_map.end()) && !(cpu->cpu_ctx.hflags & HFLG_TRAMP);
+					}
+					else {
+						take_hook = it != cpu->hook_map.end();
+					}
+
+					if (take_hook) {
+						cpu->instr_eip = cpu->disas_ctx.virt_pc - cpu->cpu_ctx.regs.cs_hidden.base;
+						cpu->jit->gen_hook(it->second);
+					}
+					else {
+						// start guest code translation
+						cpu_translate(cpu);
+					}
 				}
-			}
 
-			cpu->jit->gen_tc_epilogue();
+				cpu->jit->gen_tc_epilogue();
+				cpu->superblock.trace.clear();
+			}
 
 			cpu->tc->pc = pc;
 			cpu->tc->virt_pc = virt_pc;
 			cpu->tc->cs_base = cpu->cpu_ctx.regs.cs_hidden.base;
 			cpu->tc->guest_flags = (cpu->cpu_ctx.hflags & HFLG_CONST) | (cpu->cpu_ctx.regs.eflags & EFLAGS_CONST);
-			cpu->jit->gen_code_block();
+			if (!is_loaded && !is_interp) {
+				cpu->jit->gen_code_block();
+				if constexpr (!is_trap) {
+					tc_disk_cache_save(cpu);
+				}
+			}
 
 			// we are done with code generation for this block, so we null the tc and bb pointers to prevent accidental usage
 			ptr_tc = cpu->tc;
@@ -1578,32 +2230,44 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 
 			if (cpu->disas_ctx.flags & (DISAS_FLG_PAGE_CROSS | DISAS_FLG_ONE_INSTR)) {
 				if (cpu->cpu_flags & CPU_FORCE_INSERT) {
-					if ((cpu->num_tc) == CODE_CACHE_MAX_SIZE) {
-						tc_cache_purge(cpu);
-						prev_tc = nullptr;
+					tc_cache_make_room<is_tramp>(cpu, prev_tc, hot_tc);
+					if (hot_tc) {
+						tc_cache_replace(cpu, hot_tc, std::move(tc));
+					}
+					else {
+						tc_cache_insert(cpu, pc, std::move(tc));
 					}
-					tc_cache_insert(cpu, pc, std::move(tc));
 
 					// if the tc is forcefully inserted, then we can still link it
 					tc_link_prev(cpu, prev_tc, ptr_tc);
 				}
 
+				hot_tc = nullptr;
 				uint32_t cpu_flags = cpu->cpu_flags;
 				cpu_suppress_trampolines<is_tramp>(cpu);
 				cpu->cpu_flags &= ~(CPU_DISAS_ONE | CPU_ALLOW_CODE_WRITE | CPU_FORCE_INSERT);
+				if (tc_exceeds_instr_budget(cpu, ptr_tc)) {
+					// this tc returns without running anything, and it's not in the code cache, so translate it again one instr at a time
+					cpu->cpu_flags |= CPU_DISAS_ONE;
+				}
 				prev_tc = tc_run_code(&cpu->cpu_ctx, ptr_tc);
 				if (!(cpu_flags & CPU_FORCE_INSERT)) {
-					cpu->jit->free_code_block(reinterpret_cast<void *>(ptr_tc->jmp_offset[2]));
+					if (!is_interp) {
+						cpu->jit->free_code_block(reinterpret_cast<void *>(ptr_tc->jmp_offset[2]));
+					}
 					prev_tc = nullptr;
 				}
 				continue;
 			}
 			else {
-				if ((cpu->num_tc) == CODE_CACHE_MAX_SIZE) {
-					tc_cache_purge(cpu);
-					prev_tc = nullptr;
+				tc_cache_make_room<is_tramp>(cpu, prev_tc, hot_tc);
+				if (hot_tc) {
+					tc_cache_replace(cpu, hot_tc, std::move(tc));
+					hot_tc = nullptr;
+				}
+				else {
+					tc_cache_insert(cpu, pc, std::move(tc));
 				}
-				tc_cache_insert(cpu, pc, std::move(tc));
 			}
 		}
 
@@ -1616,12 +2280,39 @@ void cpu_main_loop(cpu_t *cpu, T &&lambda)
 	}
 }
 
+static translated_code_t *
+tc_run_db_trap(cpu_ctx_t *cpu_ctx)
+{
+	// debug exception trap (mem/io r/w watch) while excecuting the translated code.
+	// We set CPU_DBG_TRAP, so that we can execute the trapped instruction without triggering again a de exp,
+	// and then jump to the debug handler. Note thate eip points to the trapped instr, so we can execute it.
+	assert(cpu_ctx->exp_info.exp_data.idx == EXP_DB);
+
+	cpu_ctx->cpu->cpu_flags |= CPU_DISAS_ONE;
+	cpu_ctx->hflags |= HFLG_DBG_TRAP;
+	cpu_ctx->regs.eip = cpu_ctx->exp_info.exp_data.eip;
+	// the trapped instr is counted again when it runs below
+	tc_refund_instr(cpu_ctx, cpu_ctx->regs.eip);
+	// run the main loop only once, since we only execute the trapped instr
+	int i = 0;
+	cpu_main_loop<false, true>(cpu_ctx->cpu, [&i]() { return i++ == 0; });
+	return nullptr;
+}
+
 translated_code_t *
 tc_run_code(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 {
 	try {
 		// run the translated code
-		return tc->ptr_code(cpu_ctx);
+		if (tc->flags & TC_FLG_INTERP) {
+			return tc_run_interp(cpu_ctx, tc);
+		}
+		translated_code_t *next_tc = tc->ptr_code(cpu_ctx);
+		if (!cpu_ctx->exp_pending) [[likely]] {
+			// all the instr of the last tc ran, see tc_refund_instr
+			cpu_ctx->instr_tc = nullptr;
+			return next_tc;
+		}
 	}
 	catch (host_exp_t type) {
 		switch (type)
@@ -1642,22 +2333,12 @@ tc_run_code(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 		}
 		break;
 
-		case host_exp_t::db_exp: {
-			// debug exception trap (mem/io r/w watch) while excecuting the translated code.
-			// We set CPU_DBG_TRAP, so that we can execute the trapped instruction without triggering again a de exp,
-			// and then jump to the debug handler. Note thate eip points to the trapped instr, so we can execute it.
-			assert(cpu_ctx->exp_info.exp_data.idx == EXP_DB);
-
-			cpu_ctx->cpu->cpu_flags |= CPU_DISAS_ONE;
-			cpu_ctx->hflags |= HFLG_DBG_TRAP;
-			cpu_ctx->regs.eip = cpu_ctx->exp_info.exp_data.eip;
-			// run the main loop only once, since we only execute the trapped instr
-			int i = 0;
-			cpu_main_loop<false, true>(cpu_ctx->cpu, [&i]() { return i++ == 0; });
-			return nullptr;
-		}
+		case host_exp_t::db_exp:
+			// debug trap thrown by the interpreter or by a c++ helper
+			return tc_run_db_trap(cpu_ctx);
 
 		case host_exp_t::halt_tc:
+			tc_refund_instr(cpu_ctx, cpu_ctx->regs.eip);
 			return nullptr;
 
 		default:
@@ -1665,10 +2346,12 @@ tc_run_code(cpu_ctx_t *cpu_ctx, translated_code_t *tc)
 		}
 	}
 
-	LIB86CPU_ABORT();
+	// debug trap reported by the memory or io helpers with exp_pending, see lc86_jit::gen_mem_fault_stub
+	cpu_ctx->exp_pending = 0;
+	return tc_run_db_trap(cpu_ctx);
 }
 
-template<bool run_forever>
+template<bool run_forever, bool count_instr>
 lc86_status cpu_start(cpu_t *cpu)
 {
 	if (cpu->cpu_flags & CPU_DBG_PRESENT) {
@@ -1687,6 +2370,27 @@ lc86_status cpu_start(cpu_t *cpu)
 		if constexpr (run_forever) {
 			cpu_main_loop<false, false>(cpu, []() { return true; });
 		}
+		else if constexpr (count_instr) {
+			cpu->cpu_ctx.hflags |= HFLG_INSTR_COUNT;
+			cpu->cpu_ctx.instr_budget = static_cast<int64_t>(cpu->instr_clock.slice);
+			if (cpu->cpu_ctx.is_halted) {
+				// no guest code runs while halted, so no io callback can raise the hw int that wakes up the cpu during the slice. Check it once here,
+				// and if it's not there, the cpu stays halted for the whole slice
+				if (cpu_do_int(&cpu->cpu_ctx, cpu->read_int_fn(&cpu->cpu_ctx)) == CPU_HW_INT) {
+					cpu->cpu_ctx.is_halted = 0;
+				}
+				else {
+					cpu->cpu_ctx.instr_budget = 0;
+				}
+			}
+			cpu_main_loop<false, false>(cpu, [cpu]() { return cpu->cpu_ctx.instr_budget > 0; });
+			// the slice spent halted is also counted, so that the time derived from the count keeps flowing, see lc86_jit::hlt
+			cpu->instr_clock.start += cpu->instr_clock.slice - cpu->cpu_ctx.instr_budget;
+			cpu->instr_clock.slice = 0;
+			cpu->cpu_ctx.instr_budget = 0;
+			cpu->cpu_ctx.hflags &= ~HFLG_INSTR_COUNT;
+			return lc86_status::timeout;
+		}
 		else {
 			cpu->cpu_ctx.hflags |= HFLG_TIMEOUT;
 			cpu_timer_set_now(cpu);
@@ -1710,6 +2414,8 @@ lc86_status cpu_start(cpu_t *cpu)
 			dbg_should_close();
 		}
 
+		cpu->cpu_ctx.instr_tc = nullptr;
+
 		last_error = exp.what();
 		return exp.get_code();
 	}
@@ -1734,3 +2440,4 @@ template translated_code_t *cpu_raise_exception<false, false>(cpu_ctx_t *cpu_ctx
 template void tc_should_clear_cache_and_tlb<true>(cpu_t *cpu, addr_t start, addr_t end);
 template lc86_status cpu_start<true>(cpu_t *cpu);
 template lc86_status cpu_start<false>(cpu_t *cpu);
+template lc86_status cpu_start<false, true>(cpu_t *cpu);
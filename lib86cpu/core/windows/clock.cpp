@@ -7,6 +7,12 @@
 #include "clock.h"
 #include "internal.h"
 #include "Windows.h"
+#include <algorithm>
+
+#define TIMER_MIN_BUDGET 256
+#define TIMER_MAX_SLICE  1000 // in microseconds
+#define TIMER_INIT_INSTR_PER_MS 10000 // a low estimate of the guest speed, which is only used until the first refill measures it
+#define TIMER_MIN_MEASURE 10 // in microseconds
 
 
 void
@@ -15,6 +21,9 @@ tsc_init(cpu_t *cpu)
 	LARGE_INTEGER freq, now;
 	QueryPerformanceFrequency(&freq);
 	cpu->timer.host_freq = freq.QuadPart;
+	cpu->timer.budget = 0;
+	cpu->timer.instr_per_ms = TIMER_INIT_INSTR_PER_MS;
+	cpu->instr_clock.start = 0;
 	QueryPerformanceCounter(&now);
 	cpu->tsc_clock.last_host_ticks = now.QuadPart;
 }
@@ -22,23 +31,50 @@ tsc_init(cpu_t *cpu)
 void
 cpu_rdtsc_helper(cpu_ctx_t *cpu_ctx)
 {
-	LARGE_INTEGER now;
-	QueryPerformanceCounter(&now);
-	uint64_t elapsed_us = static_cast<uint64_t>(now.QuadPart) - cpu_ctx->cpu->tsc_clock.last_host_ticks;
-	elapsed_us *= 1000000;
-	elapsed_us /= cpu_ctx->cpu->timer.host_freq;
-	uint64_t elapsed_ticks = elapsed_us / 1000000;
-	elapsed_ticks *= cpu_ctx->cpu->tsc_clock.cpu_freq;
+	uint64_t elapsed_ticks;
+	if (cpu_ctx->hflags & HFLG_INSTR_COUNT) {
+		// with cpu_run_instructions, the tsc advances by one tick per instr, so that it doesn't depend on the speed of the host
+		cpu_t *cpu = cpu_ctx->cpu;
+		elapsed_ticks = cpu->instr_clock.start + cpu->instr_clock.slice - cpu_ctx->instr_budget;
+	}
+	else {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		uint64_t elapsed_us = static_cast<uint64_t>(now.QuadPart) - cpu_ctx->cpu->tsc_clock.last_host_ticks;
+		elapsed_us *= 1000000;
+		elapsed_us /= cpu_ctx->cpu->timer.host_freq;
+		elapsed_ticks = elapsed_us / 1000000;
+		elapsed_ticks *= cpu_ctx->cpu->tsc_clock.cpu_freq;
+	}
 	cpu_ctx->regs.edx = (elapsed_ticks >> 32);
 	cpu_ctx->regs.eax = elapsed_ticks;
 }
 
+static void
+cpu_timer_refill(cpu_t *cpu, uint64_t elapsed_us, uint64_t remaining_us)
+{
+	// measures the speed of the guest code since the last refill, and gives it enough instr to run for half of the remaining time. Halving the time reaches the
+	// timeout in a few refills without overshooting it by much, and the slice is capped so that a drop of the speed cannot delay the timeout for long.
+	// The speed starts from TIMER_INIT_INSTR_PER_MS, so the first slices are shorter than needed, and it then converges to the measured one, since every
+	// refill averages it with the last measurement. Short measurements are skipped, because the clock resolution makes them too noisy
+	int64_t executed = static_cast<int64_t>(cpu->timer.budget) - cpu->cpu_ctx.timer_budget;
+	if ((executed > 0) && (elapsed_us >= TIMER_MIN_MEASURE)) {
+		uint64_t instr_per_ms = static_cast<uint64_t>(executed) * 1000 / elapsed_us;
+		cpu->timer.instr_per_ms = (cpu->timer.instr_per_ms + instr_per_ms) / 2;
+	}
+
+	uint64_t budget = std::min<uint64_t>(remaining_us / 2, TIMER_MAX_SLICE) * cpu->timer.instr_per_ms / 1000;
+	cpu->timer.budget = std::max<uint64_t>(budget, TIMER_MIN_BUDGET);
+	cpu->cpu_ctx.timer_budget = static_cast<int64_t>(cpu->timer.budget);
+}
+
 void
 cpu_timer_set_now(cpu_t *cpu)
 {
 	LARGE_INTEGER now;
 	QueryPerformanceCounter(&now);
-	cpu->timer.last_time = now.QuadPart;
+	cpu->timer.last_time = cpu->timer.last_check_time = now.QuadPart;
+	cpu_timer_refill(cpu, 0, cpu->timer.timeout_time);
 }
 
 uint32_t
@@ -49,14 +85,21 @@ cpu_timer_helper(cpu_ctx_t *cpu_ctx)
 		return ret;
 	}
 
+	// this is only called when the instr budget of cpu_ctx_t::timer_budget runs out or the cpu is halted, so the host clock is not read at every code block
+	cpu_t *cpu = cpu_ctx->cpu;
 	LARGE_INTEGER now;
 	QueryPerformanceCounter(&now);
-	uint64_t elapsed_us = static_cast<uint64_t>(now.QuadPart) - cpu_ctx->cpu->timer.last_time;
+	uint64_t elapsed_us = static_cast<uint64_t>(now.QuadPart) - cpu->timer.last_time;
 	elapsed_us *= 1000000;
-	elapsed_us /= cpu_ctx->cpu->timer.host_freq;
-	if (elapsed_us >= cpu_ctx->cpu->timer.timeout_time) {
+	elapsed_us /= cpu->timer.host_freq;
+	if (elapsed_us >= cpu->timer.timeout_time) {
 		return CPU_TIMEOUT_INT;
 	}
 
+	uint64_t check_us = static_cast<uint64_t>(now.QuadPart) - cpu->timer.last_check_time;
+	check_us *= 1000000;
+	check_us /= cpu->timer.host_freq;
+	cpu_timer_refill(cpu, check_us, cpu->timer.timeout_time - elapsed_us);
+	cpu->timer.last_check_time = now.QuadPart;
 	return CPU_NO_INT;
 }
@@ -77,19 +77,20 @@ create_unwind_info()
 }
 
 void
-lc86_jit::gen_exception_info(uint8_t *code_ptr, size_t code_size)
+lc86_jit::gen_exception_info(uint8_t *code_ptr, uint8_t *wr_code_ptr, size_t code_size)
 {
 	create_unwind_info();
 
 	// Write .xdata
 	size_t aligned_code_size = (code_size + sizeof(DWORD) - 1) & ~(sizeof(DWORD) - 1);
-	std::memcpy(code_ptr + aligned_code_size, unwind_info, sizeof(unwind_info));
+	std::memcpy(wr_code_ptr + aligned_code_size, unwind_info, sizeof(unwind_info));
 
 	// Write .pdata
+	RUNTIME_FUNCTION *wr_table = reinterpret_cast<RUNTIME_FUNCTION *>(wr_code_ptr + aligned_code_size + sizeof(unwind_info));
+	wr_table->BeginAddress = 0;
+	wr_table->EndAddress = code_size;
+	wr_table->UnwindInfoAddress = aligned_code_size;
 	RUNTIME_FUNCTION *table = reinterpret_cast<RUNTIME_FUNCTION *>(code_ptr + aligned_code_size + sizeof(unwind_info));
-	table->BeginAddress = 0;
-	table->EndAddress = code_size;
-	table->UnwindInfoAddress = aligned_code_size;
 	m_mem.eh_frames.emplace(code_ptr, table);
 
 	[[maybe_unused]] auto ret = RtlAddFunctionTable(table, 1, reinterpret_cast<DWORD64>(code_ptr));
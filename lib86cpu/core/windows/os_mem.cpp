@@ -50,6 +50,42 @@ os_alloc(size_t size)
 	return addr;
 }
 
+void *
+os_alloc_code(size_t size, void *&wr_addr)
+{
+	// Maps the same memory twice: the jit writes the code through the view at wr_addr, and runs it from the returned view. No view is ever writable and
+	// executable at the same time, even if the blocks of code share their pages, and VirtualProtect doesn't need to be called every time a block is written
+
+	HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_EXECUTE_READWRITE | SEC_COMMIT, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+		static_cast<DWORD>(size), NULL);
+	if (mapping == NULL) {
+		throw lc86_exp_abort("Failed to create the file mapping for the generated code", lc86_status::no_memory);
+	}
+
+	void *addr = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size);
+	wr_addr = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size);
+	// the views keep the memory alive, so the handle is not needed anymore
+	CloseHandle(mapping);
+	if ((addr == NULL) || (wr_addr == NULL)) {
+		if (addr != NULL) {
+			UnmapViewOfFile(addr);
+		}
+		if (wr_addr != NULL) {
+			UnmapViewOfFile(wr_addr);
+		}
+		throw lc86_exp_abort("Failed to allocate memory for the generated code", lc86_status::no_memory);
+	}
+
+	return addr;
+}
+
+void
+os_free_code(void *addr)
+{
+	[[maybe_unused]] auto ret = UnmapViewOfFile(addr);
+	assert(ret);
+}
+
 void
 os_free(void *addr)
 {
@@ -10,6 +10,7 @@
 #ifdef LIB86CPU_X64_EMITTER
 #include "x64/jit.h"
 #endif
+#include "disk_cache.h"
 #include <fstream>
 #include <cstring>
 
@@ -154,6 +155,8 @@ cpu_new(uint32_t ramsize, cpu_t *&out, fp_int int_fn, const char *debuggee)
 	cpu->cpu_name = "Intel Pentium III KC 733 (Xbox CPU)";
 	cpu->dbg_name = debuggee ? debuggee : "";
 	cpu->get_int_vec = int_fn ? int_fn : default_get_int_vec;
+	cpu->max_num_tc = CODE_CACHE_MAX_SIZE;
+	cpu->max_code_size = CODE_CACHE_MAX_CODE_SIZE;
 
 	cpu->memory_space_tree = address_space<addr_t>::create();
 	cpu->io_space_tree = address_space<port_t>::create();
@@ -188,12 +191,14 @@ cpu_new(uint32_t ramsize, cpu_t *&out, fp_int int_fn, const char *debuggee)
 void
 cpu_free(cpu_t *cpu)
 {
+	tc_disk_cache_close(cpu);
+
 	if (cpu->cpu_ctx.ram) {
 		delete[] cpu->cpu_ctx.ram;
 	}
 
-	for (auto &bucket : cpu->code_cache) {
-		bucket.clear();
+	for (auto &entry : cpu->code_cache) {
+		entry.tc.reset();
 	}
 
 	delete cpu;
@@ -273,6 +278,37 @@ cpu_set_timeout(cpu_t *cpu, uint64_t timeout_time)
 	cpu->timer.timeout_time = timeout_time;
 }
 
+/*
+* cpu_run_instructions -> starts the emulation. Returns when (1) there is an error in lib86cpu (2) num_instr instructions have been executed. Unlike cpu_run_until,
+* the point where it stops doesn't depend on the speed of the host, so the emulation can be reproduced exactly. While the cpu is halted, the remaining instructions
+* are counted as executed. An instruction that raises a fault is not counted, while the instructions that complete, like int n, are.
+* cpu_sync_state not internally called
+* cpu: a valid cpu instance
+* num_instr: the number of instructions to execute before returning
+* ret: the exit reason
+*/
+lc86_status
+cpu_run_instructions(cpu_t *cpu, uint64_t num_instr)
+{
+	if (num_instr == 0) {
+		return lc86_status::timeout;
+	}
+
+	cpu->instr_clock.slice = num_instr;
+	return cpu_start<false, true>(cpu);
+}
+
+/*
+* cpu_get_instr_count -> returns the number of instructions executed by all the calls to cpu_run_instructions. Rdtsc returns this too, while it runs
+* cpu: a valid cpu instance
+* ret: the number of instructions executed
+*/
+uint64_t
+cpu_get_instr_count(cpu_t *cpu)
+{
+	return cpu->instr_clock.start;
+}
+
 /*
 * cpu_exit->submit to the cpu a request to terminate the emulation(this function is multi - thread safe)
 * cpu: a valid cpu instance
@@ -370,6 +406,63 @@ cpu_lower_hw_int_line(cpu_t *cpu)
 	cpu->lower_hw_int_fn(&cpu->cpu_ctx);
 }
 
+/*
+* cpu_get_stats -> returns the statistics collected by the translator since the cpu was created, and the current memory usage of the code cache. Only call this while the emulation is not running
+* cpu: a valid cpu instance
+* out: returned statistics
+* ret: nothing
+*/
+void
+cpu_get_stats(cpu_t *cpu, cpu_stats_t &out)
+{
+	out.ibtc_hits = cpu->cpu_ctx.ibtc_hits;
+	out.ibtc_misses = cpu->cpu_ctx.ibtc_misses;
+	out.num_tc = cpu->num_tc;
+	out.code_size = cpu->code_size;
+	out.code_mem_size = cpu->jit->get_code_mem_size();
+	out.disk_cache_hits = cpu->disk_cache ? cpu->disk_cache->hits : 0;
+}
+
+/*
+* cpu_set_cache_limits -> sets the max size of the code cache. When either limit is reached, the translated code blocks that didn't run recently are freed.
+* Only call this while the emulation is not running
+* cpu: a valid cpu instance
+* max_num_tc: max number of translated code blocks, must be between 1 and 32768
+* max_code_size: max number of bytes of host memory used by the translated code blocks, must not be zero
+* ret: the status of the operation
+*/
+lc86_status
+cpu_set_cache_limits(cpu_t *cpu, uint32_t max_num_tc, uint64_t max_code_size)
+{
+	if ((max_num_tc == 0) || (max_num_tc > CODE_CACHE_MAX_SIZE) || (max_code_size == 0)) {
+		return set_last_error(lc86_status::invalid_parameter);
+	}
+
+	cpu->max_num_tc = max_num_tc;
+	cpu->max_code_size = max_code_size;
+
+	return lc86_status::success;
+}
+
+/*
+* cpu_set_disk_cache -> saves the translated code blocks in a file, and loads them from it in the next runs instead of translating the same guest code again.
+* Blocks whose guest code changed since they were saved are ignored, and the whole file is discarded when it was created by a different build of lib86cpu.
+* The new blocks are written to the file periodically and by cpu_free, and several processes can use the same directory at the same time.
+* Only call this while the emulation is not running, and after cpu_set_flags
+* cpu: a valid cpu instance
+* dir: the directory where the file is stored, nullptr disables the disk cache
+* ret: the status of the operation
+*/
+lc86_status
+cpu_set_disk_cache(cpu_t *cpu, const char *dir)
+{
+	if (lc86_status status = tc_disk_cache_open(cpu, dir); status != lc86_status::success) {
+		return set_last_error(status);
+	}
+
+	return lc86_status::success;
+}
+
 /*
 * register_log_func -> registers a log function to receive log events from lib86cpu
 * logger: the function to call
@@ -964,21 +1057,22 @@ tlb_invalidate(cpu_t *cpu, addr_t addr)
 	// this relies on the fact that, even with the most restrictive permission type, if the entry is valis, then TLB_SUP_READ must be set. Note that more permissive
 	// accesses will set additional permission bits in the entry, in adition to TLB_SUP_READ
 
+	++cpu->cpu_ctx.tlb_gen;
 	uint32_t idx = (addr >> PAGE_SHIFT) & ITLB_IDX_MASK;
 	uint64_t tag = ((static_cast<uint64_t>(addr) << ITLB_TAG_SHIFT64) & ITLB_TAG_MASK64) | TLB_SUP_READ;
 	for (unsigned i = 0; i < ITLB_NUM_LINES; ++i) {
-		if (((cpu->itlb[idx][i].entry & (ITLB_TAG_MASK64 | TLB_SUP_READ)) ^ tag) == 0) {
-			cpu->itlb[idx][i].entry = 0;
-			cpu->itlb[idx][i].region = nullptr;
+		if (((cpu->cpu_ctx.itlb[idx][i].entry & (ITLB_TAG_MASK64 | TLB_SUP_READ)) ^ tag) == 0) {
+			cpu->cpu_ctx.itlb[idx][i].entry = 0;
+			cpu->cpu_ctx.itlb[idx][i].region = nullptr;
 			break;
 		}
 	}
 	idx = (addr >> PAGE_SHIFT) & DTLB_IDX_MASK;
 	tag = ((static_cast<uint64_t>(addr) << DTLB_TAG_SHIFT64) & DTLB_TAG_MASK64) | TLB_SUP_READ;
 	for (unsigned i = 0; i < DTLB_NUM_LINES; ++i) {
-		if (((cpu->dtlb[idx][i].entry & (DTLB_TAG_MASK64 | TLB_SUP_READ)) ^ tag) == 0) {
-			cpu->dtlb[idx][i].entry = 0;
-			cpu->dtlb[idx][i].region = nullptr;
+		if (((cpu->cpu_ctx.dtlb[idx][i].entry & (DTLB_TAG_MASK64 | TLB_SUP_READ)) ^ tag) == 0) {
+			cpu->cpu_ctx.dtlb[idx][i].entry = 0;
+			cpu->cpu_ctx.dtlb[idx][i].region = nullptr;
 			break;
 		}
 	}
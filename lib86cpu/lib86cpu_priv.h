@@ -6,13 +6,13 @@
 
 #pragma once
 
-#include <forward_list>
-#include <unordered_set>
+#include <unordered_map>
 #include <bitset>
 #include <random>
 #include <memory>
 #include <list>
 #include <cinttypes>
+#include <cstring>
 #include "lib86cpu.h"
 
 #ifdef LIB86CPU_X64_EMITTER
@@ -26,13 +26,27 @@
 
 
 #define CODE_CACHE_MAX_SIZE (1 << 15)
+// default limit of the host memory used by the tc's in the code cache
+#define CODE_CACHE_MAX_CODE_SIZE (256 * 1024 * 1024)
+// the code cache table has twice the slots of the max number of tc's, so that its load factor is never above 0.5
+#define CODE_CACHE_TABLE_SHIFT 16
+#define CODE_CACHE_TABLE_SIZE (1 << CODE_CACHE_TABLE_SHIFT)
 #define SMC_MAX_SIZE (1 << 20)
+#define SMC_CHUNK_SHIFT 6
+#define SMC_CHUNK_SIZE (1 << SMC_CHUNK_SHIFT) // granularity of tc_page_t::code_mask
+#define TC_PAGE_L2_SHIFT 10
+#define TC_PAGE_L2_SIZE (1 << TC_PAGE_L2_SHIFT)
+#define TC_PAGE_L1_SIZE (SMC_MAX_SIZE >> TC_PAGE_L2_SHIFT)
 // itlb: 512 sets * 8 lines = 4096 entries -> offset 12 bits, index 9 bites, tag 11 bits
 #define ITLB_NUM_SETS (1 << 9)
 #define ITLB_NUM_LINES (1 << 3)
 // dtlb: 2048 sets * 4 lines = 8192 entries -> offset 12 bits, index 11 bits, tag 9 bits
 #define DTLB_NUM_SETS (1 << 11)
 #define DTLB_NUM_LINES (1 << 2)
+// return stack buffer: must be a power of two, since its index wraps around
+#define RET_STACK_SIZE (1 << 4)
+// indirect branch target cache: 4096 entries, indexed by the low bits of the dst virt pc
+#define IBTC_SIZE (1 << 12)
 
  // used to generate the parity table
  // borrowed from Bit Twiddling Hacks by Sean Eron Anderson (public domain)
@@ -100,22 +114,83 @@ using read_int_t = uint32_t(JIT_API *)(cpu_ctx_t *cpu_ctx);
 using clear_int_t = void(JIT_API *)(cpu_ctx_t *cpu_ctx);
 using raise_int_t = void(JIT_API *)(cpu_ctx_t *cpu_ctx, uint32_t int_flg);
 
+// a guest instr decoded by cpu_interp_translate. fn executes it and returns the next instr to run, or nullptr if it ends the tc
+struct interp_instr_t;
+using interp_fn_t = interp_instr_t *(*)(cpu_ctx_t *cpu_ctx, interp_instr_t *instr);
+struct interp_instr_t {
+	interp_fn_t fn;
+	uint32_t eip;
+	uint32_t next_eip;
+	uint32_t dst; // offset of the dst reg in cpu_ctx_t, or jmp eip for jmp/jcc
+	uint32_t src; // offset of the src reg in cpu_ctx_t, imm value, or condition code for jcc
+	uint32_t disp; // the fields below describe the mem operand, if any
+	uint16_t seg_base;
+	uint16_t base;
+	uint16_t index;
+	uint8_t scale;
+	uint8_t mem_flags;
+};
+
+struct translated_code_t;
+
+// a link from a tc to one of its successors. The links of all the predecessors of a tc form an intrusive list, so that any of them can be removed in O(1)
+struct tc_link_t {
+	translated_code_t *src; // the tc that owns this link
+	translated_code_t *dst; // nullptr if not linked
+	tc_link_t *prev, *next; // other links to dst
+};
+
 // jmp_offset functions: 0,1 -> used for direct linking (either points to exit or &next_tc), 2 -> exit
 struct translated_code_t {
-	std::forward_list<translated_code_t *> linked_tc;
+	tc_link_t links[3]; // 0,1 -> the successors jmp_offset[0,1] jump to, 2 -> ret_tc
+	tc_link_t *pred; // list of the links of the predecessors of this tc
+	translated_code_t *page_prev, *page_next; // other tc's in the page of pc, see tc_page_t
 	addr_t cs_base;
 	addr_t pc;
 	addr_t virt_pc;
 	uint32_t guest_flags;
 	entry_t ptr_code;
 	entry_t jmp_offset[3];
-	translated_code_t *ibtc[3];
+	uint32_t jmp_patch[2]; // offsets from jmp_offset[2] of the rel32 of the jmp's of the links 0,1, or zero if the code has no such jmp
+	uint64_t link_gen[2]; // cpu_ctx_t::tlb_gen when the links 0,1 were established, only checked by the links to another page
+	translated_code_t *ret_tc; // predicted tc of the return address of the near call in this tc, see link_ret_handler
 	uint32_t flags;
 	uint32_t size;
+	uint32_t exec_count; // incremented by the tc itself on every entry, used to detect hot tc's
+	uint32_t instr_count; // num of guest instr translated in this tc
+	uint32_t code_size; // bytes of host memory used by the jitted or interpreted code
+	uint8_t accessed; // set by the tc itself on every entry, and cleared by tc_cache_evict
+	std::vector<interp_instr_t> interp_code; // only used by interpreted tc's, which have no jitted code
+	std::vector<uint8_t> instr_len; // length of each guest instr, only recorded when counting instr, see tc_refund_instr
 	explicit translated_code_t() noexcept;
 	explicit translated_code_t(uint32_t flags) noexcept : translated_code_t() { guest_flags = flags; }
 };
 
+// a slot of the code cache. The key of the tc is duplicated here, so that searching the table doesn't need to dereference the tc's it skips
+struct tc_cache_entry_t {
+	addr_t pc;
+	addr_t cs_base;
+	uint32_t guest_flags;
+	std::unique_ptr<translated_code_t> tc; // nullptr if the slot is empty
+};
+
+// one bit per physical page with translated code. The bits are kept in plain 64 bit words instead of a std::bitset, whose storage is implementation defined,
+// because the jitted code tests them directly with bt, see lc86_jit::gen_dtlb_lookup
+struct smc_bits_t {
+	uint64_t words[SMC_MAX_SIZE / 64];
+	bool operator[](size_t idx) const { return (words[idx >> 6] >> (idx & 63)) & 1; }
+	void set(size_t idx) { words[idx >> 6] |= (1ULL << (idx & 63)); }
+	void reset(size_t idx) { words[idx >> 6] &= ~(1ULL << (idx & 63)); }
+	void reset() { std::memset(words, 0, sizeof(words)); }
+};
+
+// the tc's whose guest code starts in a page, see tc_page_map
+struct tc_page_t {
+	translated_code_t *tcs; // intrusive list, linked through translated_code_t::page_next
+	uint64_t code_mask; // one bit for every SMC_CHUNK_SIZE bytes of the page that hold guest code of tcs, so that tc_invalidate can skip the writes to its data
+	uint32_t smc_writes; // num of writes that invalidated the tc's of this page, see tc_needs_self_check
+};
+
 struct disas_ctx_t {
 	uint8_t flags;
 	addr_t virt_pc, pc;
@@ -142,6 +217,15 @@ struct lazy_eflags_t {
 	uint8_t parity[256] = { GEN_TABLE };
 };
 
+// shadow stack of the near calls executed by the guest, used to predict the tc a near ret returns to
+struct ret_stack_t {
+	translated_code_t *call_tc[RET_STACK_SIZE]; // tc that pushed the entry, or nullptr if it is not in the code cache
+	addr_t ret_pc[RET_STACK_SIZE]; // return address pushed by the call
+	uint32_t idx; // index of the top entry
+	translated_code_t *miss_tc; // call_tc of the last entry popped by a mispredicted ret, see tc_link_prev
+	addr_t miss_pc;
+};
+
 struct fpu_data_t {
 	uint16_t ftop; // these are the top of stack pointer bits of fstatus
 	uint16_t fes; // pending unmasked exception flag that is, es bit of fstatus
@@ -159,13 +243,28 @@ struct cpu_ctx_t {
 	uint32_t int_pending;
 	uint8_t exit_requested;
 	uint8_t is_halted;
+	uint8_t exp_pending; // set by the memory and io helpers called by the jit when they report a page fault or a debug trap instead of throwing it
+	uint64_t tlb_gen; // incremented every time tlb entries are flushed, see lc86_jit::gen_link_jmp
+	int64_t timer_budget; // num of instr that can still run before the host clock is read again, see cpu_timer_helper
+	int64_t instr_budget; // num of instr that can still run before cpu_run_instructions returns, see lc86_jit::gen_instr_count_check
+	translated_code_t *instr_tc; // running tc whose instr were subtracted from instr_budget, or nullptr, see tc_refund_instr
+	ret_stack_t ret_stack;
 	fpu_data_t fpu_data;
+	// the tlbs are placed last, so that the offsets of the other members stay small and can be encoded with short displacements by the jit
+	tlb_t itlb[ITLB_NUM_SETS][ITLB_NUM_LINES]; // instruction tlb
+	tlb_t dtlb[DTLB_NUM_SETS][DTLB_NUM_LINES]; // data tlb
+	translated_code_t *ibtc[IBTC_SIZE]; // indirect branch target cache, shared by all tc's that end with an indirect branch
+	uint64_t ibtc_hits;
+	uint64_t ibtc_misses;
 };
 
 // int_pending must be 4 byte aligned to ensure atomicity
 static_assert(alignof(decltype(cpu_ctx_t::int_pending)) == 4);
+// the jit indexes a dtlb set by shifting the set index, so this must stay a power of two
+static_assert(sizeof(tlb_t) * DTLB_NUM_LINES == 64);
 
 class lc86_jit;
+struct disk_cache_t;
 struct cpu_t {
 	uint32_t cpu_flags;
 	const char *cpu_name;
@@ -176,16 +275,19 @@ struct cpu_t {
 	std::unique_ptr<lc86_jit> jit;
 	std::unique_ptr<address_space<addr_t>> memory_space_tree;
 	std::unique_ptr<address_space<port_t>> io_space_tree;
-	std::list<std::unique_ptr<translated_code_t>> code_cache[CODE_CACHE_MAX_SIZE];
-	std::unordered_map<uint32_t, std::unordered_set<translated_code_t *>> tc_page_map;
+	tc_cache_entry_t code_cache[CODE_CACHE_TABLE_SIZE]; // open addressing hash table with linear probing
+	std::unique_ptr<tc_page_t[]> tc_page_map[TC_PAGE_L1_SIZE]; // two level table indexed by the physical page, the second levels are only allocated when needed
 	std::unordered_map<addr_t, hook_t> hook_map;
 	std::vector<wp_info<addr_t>> wp_data;
 	std::vector<wp_info<port_t>> wp_io;
 	std::vector<std::pair<bool, std::unique_ptr<memory_region_t<addr_t>>>> regions_changed;
-	std::bitset<SMC_MAX_SIZE> smc; // self-modifying code tracking
-	tlb_t itlb[ITLB_NUM_SETS][ITLB_NUM_LINES]; // instruction tlb
-	tlb_t dtlb[DTLB_NUM_SETS][DTLB_NUM_LINES]; // data tlb
-	uint16_t num_tc; // num of tc actually emitted, tc's might not be present in the code cache
+	smc_bits_t smc; // self-modifying code tracking
+	uint32_t num_tc; // num of tc's in the code cache
+	uint64_t code_size; // bytes of host memory used by the tc's in the code cache
+	uint32_t max_num_tc; // limits of the code cache, when one of them is reached tc_cache_evict frees the cold tc's
+	uint64_t max_code_size;
+	uint32_t evict_idx; // slot of code_cache where the next sweep of tc_cache_evict starts
+	std::vector<void *> dead_code; // code blocks of the deleted tc's, which are freed by cpu_main_loop when they can't be running anymore
 	uint8_t microcode_updated;
 	struct _tsc_clock {
 		uint64_t last_host_ticks;
@@ -195,7 +297,22 @@ struct cpu_t {
 		uint64_t last_time;
 		uint64_t host_freq;
 		uint64_t timeout_time;
+		uint64_t last_check_time; // when the host clock was last read by cpu_timer_helper
+		uint64_t budget; // value that cpu_ctx_t::timer_budget was last refilled with
+		uint64_t instr_per_ms; // measured speed of the guest code, a low estimate until the first measurement
 	} timer;
+	struct _instr_clock {
+		uint64_t start; // num of instr run by all the previous calls to cpu_run_instructions
+		uint64_t slice; // num of instr requested by the current call to cpu_run_instructions
+		std::unique_ptr<translated_code_t> erased_tc; // cpu_ctx_t::instr_tc after it was deleted while running, kept until cpu_main_loop frees its code
+	} instr_clock;
+	struct _superblock {
+		std::vector<addr_t> trace; // virt pc of the linked tc's to merge in the superblock being translated, in execution order
+		size_t idx; // next entry of trace that the jit can merge
+		bool follow; // set by the jit when it merged trace[idx] in the current tc
+		translated_code_t *hot_tc; // tc that became hot, written by the jitted code
+	} superblock;
+	std::unique_ptr<disk_cache_t> disk_cache; // nullptr if the disk cache is disabled, see cpu_set_disk_cache
 	msr_t msr;
 	read_int_t read_int_fn;
 	clear_int_t clear_int_fn;
@@ -45,7 +45,7 @@ private:
 };
 
 void cpu_reset(cpu_t *cpu);
-template<bool run_forever>
+template<bool run_forever, bool count_instr = false>
 lc86_status cpu_start(cpu_t *cpu);
 [[noreturn]] void JIT_API cpu_runtime_abort(const char *msg);
 [[noreturn]] void cpu_abort(int32_t code, const char *msg, ...);
@@ -61,5 +61,16 @@ to_u64(auto val)
     return static_cast<uint64_t>(val);
 }
 
+// 64 bit FNV-1a hash, pass the previous hash to continue hashing more data
+inline uint64_t
+hash_bytes(const void *data, size_t size, uint64_t hash = 0xCBF29CE484222325ULL)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
 inline logfn_t logfn = &discard_log;
 inline std::string last_error = "";
@@ -0,0 +1,402 @@
+/*
+ * lib86cpu translator benchmarks
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#include "run.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+#define BENCH_RAM_SIZE (1 * 1024 * 1024)
+#define BENCH_CODE_START 0xF0000
+
+
+static bool
+bench_init(const std::vector<uint8_t> &code)
+{
+	// the code runs in real mode from f000:0000, reached with a far jmp from the reset vector
+	if (code.size() > (BENCH_RAM_SIZE - BENCH_CODE_START - 16)) {
+		printf("Benchmark code doesn't fit inside RAM!\n");
+		return false;
+	}
+
+	if (!LC86_SUCCESS(cpu_new(BENCH_RAM_SIZE, cpu))) {
+		printf("Failed to initialize lib86cpu!\n");
+		return false;
+	}
+
+	uint8_t *ram = get_ram_ptr(cpu);
+	std::memcpy(&ram[BENCH_CODE_START], code.data(), code.size());
+	static const uint8_t reset_jmp[] = { 0xEA, 0x00, 0x00, 0x00, 0xF0 }; // jmp f000:0000
+	std::memcpy(&ram[BENCH_RAM_SIZE - 16], reset_jmp, sizeof(reset_jmp));
+
+	if (!LC86_SUCCESS(mem_init_region_ram(cpu, 0, BENCH_RAM_SIZE))) {
+		printf("Failed to initialize ram memory for the benchmark!\n");
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	if (!LC86_SUCCESS(mem_init_region_alias(cpu, 0xFFFF0000, 0xF0000, 0x10000))) {
+		printf("Failed to initialize aliased ram memory for the benchmark!\n");
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+static void
+put16(std::vector<uint8_t> &code, uint16_t off, uint16_t val)
+{
+	code[off] = val & 0xFF;
+	code[off + 1] = val >> 8;
+}
+
+static void
+bench_fill_chain(std::vector<uint8_t> &code, unsigned blocks_per_page, uint16_t exit_off)
+{
+	// writes a run of blocks made of a single jmp $+2 at the start of every 0x1000 bytes of the code segment, each followed by a jmp to the next run. The
+	// last run jumps to exit_off instead. Running the chain from f000:0000 fills the code cache with about 16 * blocks_per_page tc's
+	for (uint16_t page = 0; page < 16; ++page) {
+		uint16_t off = page * 0x1000;
+		for (unsigned i = 0; i < blocks_per_page; ++i, off += 2) {
+			code[off] = 0xEB;
+			code[off + 1] = 0x00;
+		}
+		code[off] = 0xE9;
+		put16(code, off + 1, static_cast<uint16_t>((page == 15 ? exit_off : (page + 1) * 0x1000) - (off + 3)));
+	}
+}
+
+static double
+bench_run(cpu_t *cpu)
+{
+	// runs until the guest executes a hlt, and returns the elapsed time in milliseconds
+	cpu_set_flags(cpu, CPU_ABORT_ON_HLT);
+	auto start = std::chrono::steady_clock::now();
+	cpu_run(cpu);
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool
+gen_loop_bench(const std::string &executable)
+{
+	// measures the time of a register bound loop, which is what the reg cache speeds up. If the path of the test386.asm binary is given, that is timed instead
+
+	if (!executable.empty()) {
+		if (!gen_test386asm_test(executable)) {
+			return false;
+		}
+		printf("test386.asm ran in %.3f ms\n", bench_run(cpu));
+		cpu_free(cpu);
+		cpu = nullptr;
+		return true;
+	}
+
+	const std::vector<uint8_t> code = {
+		0x66, 0xB9, 0x00, 0x00, 0x00, 0x02, // mov ecx, 0x2000000
+		0x66, 0x31, 0xC0,                   // xor eax, eax
+		0x66, 0x31, 0xD2,                   // xor edx, edx
+		0x66, 0x01, 0xC8,                   // loop: add eax, ecx
+		0x66, 0x31, 0xC2,                   // xor edx, eax
+		0x66, 0x49,                         // dec ecx
+		0x75, 0xF6,                         // jnz loop
+		0xF4,                               // hlt
+	};
+
+	if (!bench_init(code)) {
+		return false;
+	}
+
+	printf("0x2000000 iterations of the register loop ran in %.3f ms\n", bench_run(cpu));
+	cpu_free(cpu);
+	cpu = nullptr;
+	return true;
+}
+
+bool
+gen_lookup_bench()
+{
+	// measures the cost of searching the code cache from the dispatcher. The code first runs a chain of 8192 small blocks to fill the code cache, and then
+	// it jumps indirectly through 16 blocks 0x1000 bytes apart. Those have the same hash in the ibtc, so every indirect jmp misses it and returns to the
+	// dispatcher, which then finds the dst tc in the code cache
+
+	constexpr uint32_t num_lookups = 0x400000;
+	constexpr uint16_t setup_off = 0x800, done_off = 0x900, table_off = 0xA00, target_off = 0xF00;
+	std::vector<uint8_t> code(0xFF00 + 17, 0x90);
+	bench_fill_chain(code, 0x200, setup_off);
+
+	for (uint16_t page = 0; page < 16; ++page) {
+		uint16_t target = page * 0x1000 + target_off;
+		put16(code, table_off + page * 2, target);
+		const uint8_t target_code[] = {
+			0x66, 0x49,                                   // dec ecx
+			0x0F, 0x84, 0x00, 0x00,                       // jz done
+			0x83, 0xC6, 0x02,                             // add si, 2
+			0x83, 0xE6, 0x1E,                             // and si, 0x1E
+			0x2E, 0xFF, 0xA4, table_off & 0xFF, table_off >> 8, // jmp word [cs:si + table]
+		};
+		std::memcpy(&code[target], target_code, sizeof(target_code));
+		put16(code, target + 4, static_cast<uint16_t>(done_off - (target + 6)));
+	}
+
+	const uint8_t setup_code[] = {
+		0x66, 0xB9, num_lookups & 0xFF, (num_lookups >> 8) & 0xFF, (num_lookups >> 16) & 0xFF, num_lookups >> 24, // mov ecx, num_lookups
+		0x31, 0xF6,                                                                                          // xor si, si
+		0x2E, 0xFF, 0xA4, table_off & 0xFF, table_off >> 8,                                                  // jmp word [cs:si + table]
+	};
+	std::memcpy(&code[setup_off], setup_code, sizeof(setup_code));
+	code[done_off] = 0xF4; // hlt
+
+	if (!bench_init(code)) {
+		return false;
+	}
+
+	double time = bench_run(cpu);
+	cpu_stats_t stats;
+	cpu_get_stats(cpu, stats);
+	printf("0x%X code cache lookups ran in %.3f ms (%.1f ns each), with %u tc's in the code cache and %llu ibtc misses\n", num_lookups, time,
+		time * 1000000.0 / num_lookups, stats.num_tc, static_cast<unsigned long long>(stats.ibtc_misses));
+	cpu_free(cpu);
+	cpu = nullptr;
+	return true;
+}
+
+bool
+gen_throw_bench()
+{
+	// measures the latency of the c++ exceptions thrown through the jitted code, for increasing sizes of the code cache. On linux, the unwinder has to find
+	// the frame info of the jitted code, so this shows how that scales with the number of tc's. The code first fills the code cache, and then it runs a loop
+	// that writes to its own code, which makes tc_invalidate throw host_exp_t::halt_tc while the tc is running. After SMC_CHECK_THRESHOLD writes, the loop is
+	// always translated by the jit. The time of each iteration also includes the translation of the loop and of the writing instr, which doesn't depend
+	// on the size of the code cache
+
+	constexpr uint32_t num_throws = 0x4000;
+	constexpr uint16_t loop_off = 0xF00;
+	const uint8_t loop_code[] = {
+		0x66, 0xB9, num_throws & 0xFF, (num_throws >> 8) & 0xFF, (num_throws >> 16) & 0xFF, num_throws >> 24, // mov ecx, num_throws
+		0xB0, 0x90,                                                                                        // mov al, 0x90
+		0x2E, 0xA2, (loop_off + 12) & 0xFF, (loop_off + 12) >> 8,                                          // loop: mov [cs:patch], al
+		0x90,                                                                                              // patch: nop
+		0x66, 0x49,                                                                                        // dec ecx
+		0x75, 0xF7,                                                                                        // jnz loop
+		0xF4,                                                                                              // hlt
+	};
+
+	for (unsigned blocks_per_page : { 0, 0x100, 0x200, 0x400 }) {
+		std::vector<uint8_t> code(0xFF00, 0x90);
+		bench_fill_chain(code, blocks_per_page, loop_off);
+		std::memcpy(&code[loop_off], loop_code, sizeof(loop_code));
+
+		if (!bench_init(code)) {
+			return false;
+		}
+
+		double time = bench_run(cpu);
+		cpu_stats_t stats;
+		cpu_get_stats(cpu, stats);
+		printf("0x%X throws with %u tc's in the code cache ran in %.3f ms (%.2f us each)\n", num_throws, stats.num_tc, time, time * 1000.0 / num_throws);
+		cpu_free(cpu);
+		cpu = nullptr;
+	}
+
+	return true;
+}
+
+bool
+gen_fault_bench()
+{
+	// measures the cost of delivering guest page faults raised by the jitted code. The code switches to protected mode with paging, and then it runs a loop that
+	// reads a page that is not present. The #PF handler marks it as present and returns to the read, which succeeds, and the loop makes the page not present
+	// again before the next read. The gdt, idt and the page tables are written by the host, see the layout below
+
+	constexpr uint32_t num_faults = 0x80000;
+	constexpr uint32_t gdt_addr = 0x1000, idt_addr = 0x2000, pd_addr = 0x3000, pt_addr = 0x4000, fault_addr = 0x80000;
+	constexpr uint32_t fault_pte_addr = pt_addr + (fault_addr >> 12) * 4;
+	constexpr uint16_t pm_off = 0x100, handler_off = 0x200;
+	std::vector<uint8_t> code(0x300, 0x90);
+	auto put_code = [&code](uint16_t off, std::initializer_list<uint8_t> bytes) {
+		std::copy(bytes.begin(), bytes.end(), code.begin() + off);
+		};
+	auto b = [](uint32_t val, unsigned idx) { return static_cast<uint8_t>(val >> (idx * 8)); };
+
+	put_code(0, {
+		0xFA,                                      // cli
+		0x0F, 0x01, 0x16, 0x00, 0x05,              // lgdt [0x500]
+		0x0F, 0x01, 0x1E, 0x08, 0x05,              // lidt [0x508]
+		0x66, 0xB8, b(pd_addr, 0), b(pd_addr, 1), b(pd_addr, 2), b(pd_addr, 3), // mov eax, pd_addr
+		0x0F, 0x22, 0xD8,                          // mov cr3, eax
+		0x0F, 0x20, 0xC0,                          // mov eax, cr0
+		0x66, 0x0D, 0x01, 0x00, 0x00, 0x80,        // or eax, 0x80000001
+		0x0F, 0x22, 0xC0,                          // mov cr0, eax
+		0x66, 0xEA, b(BENCH_CODE_START + pm_off, 0), b(BENCH_CODE_START + pm_off, 1), b(BENCH_CODE_START + pm_off, 2), b(BENCH_CODE_START + pm_off, 3),
+		0x08, 0x00,                                // jmp dword 0x8:pm_entry
+		});
+
+	put_code(pm_off, {
+		0x66, 0xB8, 0x10, 0x00,                    // mov ax, 0x10
+		0x8E, 0xD8,                                // mov ds, ax
+		0x8E, 0xC0,                                // mov es, ax
+		0x8E, 0xD0,                                // mov ss, ax
+		0xBC, 0x00, 0x90, 0x00, 0x00,              // mov esp, 0x9000
+		0xB9, b(num_faults, 0), b(num_faults, 1), b(num_faults, 2), b(num_faults, 3), // mov ecx, num_faults
+		0x8B, 0x05, b(fault_addr, 0), b(fault_addr, 1), b(fault_addr, 2), b(fault_addr, 3), // loop: mov eax, [fault_addr]
+		0x81, 0x25, b(fault_pte_addr, 0), b(fault_pte_addr, 1), b(fault_pte_addr, 2), b(fault_pte_addr, 3), 0xFE, 0xFF, 0xFF, 0xFF, // and dword [fault_pte], ~1
+		0x0F, 0x01, 0x3D, b(fault_addr, 0), b(fault_addr, 1), b(fault_addr, 2), b(fault_addr, 3), // invlpg [fault_addr]
+		0x49,                                      // dec ecx
+		0x75, 0xE6,                                // jnz loop
+		0xF4,                                      // hlt
+		});
+
+	put_code(handler_off, {
+		0x81, 0x0D, b(fault_pte_addr, 0), b(fault_pte_addr, 1), b(fault_pte_addr, 2), b(fault_pte_addr, 3), 0x01, 0x00, 0x00, 0x00, // or dword [fault_pte], 1
+		0x83, 0xC4, 0x04,                          // add esp, 4
+		0xCF,                                      // iretd
+		});
+
+	if (!bench_init(code)) {
+		return false;
+	}
+
+	uint8_t *ram = get_ram_ptr(cpu);
+	auto put32 = [ram](uint32_t addr, uint32_t val) { std::memcpy(&ram[addr], &val, 4); };
+	// flat 4 GiB code and data segments
+	put32(gdt_addr + 8, 0x0000FFFF);
+	put32(gdt_addr + 12, 0x00CF9A00);
+	put32(gdt_addr + 16, 0x0000FFFF);
+	put32(gdt_addr + 20, 0x00CF9200);
+	// the pseudo descriptors read by lgdt and lidt
+	put32(0x500, 0x0017 | (gdt_addr << 16));
+	put32(0x504, gdt_addr >> 16);
+	put32(0x508, 0x007F | (idt_addr << 16));
+	put32(0x50C, idt_addr >> 16);
+	// interrupt gate of the #PF handler
+	uint32_t handler_addr = BENCH_CODE_START + handler_off;
+	put32(idt_addr + 14 * 8, (handler_addr & 0xFFFF) | (0x8 << 16));
+	put32(idt_addr + 14 * 8 + 4, (handler_addr & 0xFFFF0000) | 0x8E00);
+	// identity map the ram, except for the page that faults
+	put32(pd_addr, pt_addr | 3);
+	for (uint32_t page = 0; page < (BENCH_RAM_SIZE >> 12); ++page) {
+		put32(pt_addr + page * 4, (page << 12) | 3);
+	}
+	put32(fault_pte_addr, fault_addr | 2);
+
+	double time = bench_run(cpu);
+	printf("0x%X guest page faults ran in %.3f ms (%.2f us each)\n", num_faults, time, time * 1000.0 / num_faults);
+	cpu_free(cpu);
+	cpu = nullptr;
+	return true;
+}
+
+bool
+gen_warm_boot_bench(const std::string &executable)
+{
+	// measures how much the disk cache speeds up a second run of the same guest code. The code runs a chain of 8192 blocks 32 times, so that they all become
+	// hot and are translated by the jit, which then saves them to the disk cache. If the path of the test386.asm binary is given, that is run instead
+
+	std::error_code ec;
+	std::filesystem::path dir = std::filesystem::temp_directory_path(ec) / "lib86cpu_bench";
+	std::filesystem::create_directories(dir, ec);
+	std::filesystem::remove(dir / "lib86cpu_tc.bin", ec);
+	if (!std::filesystem::is_directory(dir, ec)) {
+		printf("Failed to create the directory of the disk cache!\n");
+		return false;
+	}
+
+	constexpr uint16_t exit_off = 0x800;
+	std::vector<uint8_t> code(0xF803, 0x90);
+	bench_fill_chain(code, 0x200, exit_off);
+	const uint8_t exit_code[] = {
+		0x41,                   // inc cx
+		0x83, 0xF9, 0x20,       // cmp cx, 32
+		0x0F, 0x85, 0xF8, 0xF7, // jne 0
+		0xF4,                   // hlt
+	};
+	std::memcpy(&code[exit_off], exit_code, sizeof(exit_code));
+
+	for (const char *boot : { "cold", "warm" }) {
+		if (!(executable.empty() ? bench_init(code) : gen_test386asm_test(executable))) {
+			return false;
+		}
+
+		// the flags must be set before the disk cache, because the jitted code depends on them
+		cpu_set_flags(cpu, CPU_ABORT_ON_HLT);
+		if (!LC86_SUCCESS(cpu_set_disk_cache(cpu, dir.string().c_str()))) {
+			printf("Failed to enable the disk cache!\n");
+			cpu_free(cpu);
+			cpu = nullptr;
+			return false;
+		}
+
+		double time = bench_run(cpu);
+		cpu_stats_t stats;
+		cpu_get_stats(cpu, stats);
+		printf("The %s boot ran in %.3f ms, with %llu tc's loaded from the disk cache\n", boot, time, static_cast<unsigned long long>(stats.disk_cache_hits));
+		// this also writes the disk cache used by the warm boot
+		cpu_free(cpu);
+		cpu = nullptr;
+	}
+
+	return true;
+}
+
+bool
+gen_timer_bench()
+{
+	// measures how much cpu_run_until overshoots the requested timeout. The code is an endless loop, so every call returns only because of the timeout. The
+	// first call runs before the guest speed has been measured, so it's reported separately
+
+	constexpr unsigned num_runs = 50;
+	const std::vector<uint8_t> code = {
+		0x66, 0x40,       // loop: inc eax
+		0x66, 0x01, 0xC2, // add edx, eax
+		0xEB, 0xF9,       // jmp loop
+	};
+
+	if (!bench_init(code)) {
+		return false;
+	}
+
+	auto run_until = [](uint64_t timeout_us, double &time_us) {
+		auto start = std::chrono::steady_clock::now();
+		lc86_status status = cpu_run_until(cpu, timeout_us);
+		time_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		if (status != lc86_status::timeout) {
+			printf("cpu_run_until stopped without reaching the timeout!\n");
+			return false;
+		}
+		return true;
+	};
+
+	double time_us;
+	if (!run_until(1000, time_us)) {
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+	printf("The first run of 1000 us took %.1f us\n", time_us);
+
+	for (uint64_t timeout_us : { 50, 200, 1000, 5000, 20000 }) {
+		double total_us = 0.0, max_us = 0.0;
+		for (unsigned i = 0; i < num_runs; ++i) {
+			if (!run_until(timeout_us, time_us)) {
+				cpu_free(cpu);
+				cpu = nullptr;
+				return false;
+			}
+			total_us += time_us;
+			max_us = std::max(max_us, time_us);
+		}
+		printf("Timeout of %llu us: %.1f us on average (%+.1f us), %.1f us at most (%+.1f us)\n", static_cast<unsigned long long>(timeout_us), total_us / num_runs,
+			total_us / num_runs - timeout_us, max_us, max_us - timeout_us);
+	}
+
+	cpu_free(cpu);
+	cpu = nullptr;
+	return true;
+}
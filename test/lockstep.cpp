@@ -0,0 +1,125 @@
+/*
+ * lib86cpu instruction counting test
+ *
+ * ergo720                Copyright (c) 2026
+ */
+
+#include "run.h"
+#include <algorithm>
+
+#define LOCKSTEP_RAM_SIZE (1 * 1024 * 1024)
+#define LOCKSTEP_CODE_START 0xF0000
+
+
+static const uint8_t lockstep_binary[] = {
+	0x31, 0xC0,                         // xor ax, ax
+	0x8E, 0xD0,                         // mov ss, ax
+	0xBC, 0x00, 0x70,                   // mov sp, 0x7000
+	0xBB, 0x01, 0x00,                   // mov bx, 1
+	0x46,                               // loop: inc si
+	0x89, 0xF0,                         // mov ax, si
+	0x31, 0xD2,                         // xor dx, dx
+	0xF7, 0xF3,                         // div bx
+	0x01, 0xC7,                         // add di, ax
+	0xCD, 0x20,                         // int 0x20
+	0x2E, 0xC6, 0x06, 0x24, 0x00, 0xE5, // mov byte [cs:next + 1], 0xE5
+	0xF7, 0xC6, 0x07, 0x00,             // test si, 7
+	0x75, 0x02,                         // jnz next
+	0x31, 0xDB,                         // xor bx, bx
+	0xEB, 0xE5,                         // next: jmp loop
+	0x43,                               // de_handler: inc bx
+	0xCF,                               // iret
+	0x45,                               // int_handler: inc bp
+	0xCF,                               // iret
+};
+
+static bool
+lockstep_init()
+{
+	if (!LC86_SUCCESS(cpu_new(LOCKSTEP_RAM_SIZE, cpu))) {
+		printf("Failed to initialize lib86cpu!\n");
+		return false;
+	}
+
+	// the code runs in real mode from f000:0000, reached with a far jmp from the reset vector. The ivt entries of #DE and int 0x20 point to the handlers
+	// at the end of the code
+	uint8_t *ram = get_ram_ptr(cpu);
+	std::memcpy(&ram[LOCKSTEP_CODE_START], lockstep_binary, sizeof(lockstep_binary));
+	static const uint8_t reset_jmp[] = { 0xEA, 0x00, 0x00, 0x00, 0xF0 }; // jmp f000:0000
+	std::memcpy(&ram[LOCKSTEP_RAM_SIZE - 16], reset_jmp, sizeof(reset_jmp));
+	static const uint8_t de_vec[] = { 0x25, 0x00, 0x00, 0xF0 }; // f000:0025
+	std::memcpy(&ram[0 * 4], de_vec, sizeof(de_vec));
+	static const uint8_t int_vec[] = { 0x27, 0x00, 0x00, 0xF0 }; // f000:0027
+	std::memcpy(&ram[0x20 * 4], int_vec, sizeof(int_vec));
+
+	if (!LC86_SUCCESS(mem_init_region_ram(cpu, 0, LOCKSTEP_RAM_SIZE))) {
+		printf("Failed to initialize ram memory for the lockstep test!\n");
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	if (!LC86_SUCCESS(mem_init_region_alias(cpu, 0xFFFF0000, 0xF0000, 0x10000))) {
+		printf("Failed to initialize aliased ram memory for the lockstep test!\n");
+		cpu_free(cpu);
+		cpu = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool
+gen_lockstep_test()
+{
+	// runs the same guest code twice, first with a single call to cpu_run_instructions and then with many short slices of different sizes, and checks that
+	// both runs end in the same state. The code raises a #DE in the middle of a tc, calls an int n and writes to its own code, so that tc's are stopped early
+	// in all the ways that refund the instr they didn't run. With the short slices, most tc's don't fit in the budget and run one instr at a time instead
+
+	constexpr uint64_t num_instr = 100000;
+	regs_t end_regs[2];
+	uint32_t end_eflags[2];
+	for (int run = 0; run < 2; ++run) {
+		if (!lockstep_init()) {
+			return false;
+		}
+
+		uint64_t slice = (run == 0) ? num_instr : 0;
+		for (uint64_t done = 0; done < num_instr; done += slice) {
+			if (run == 1) {
+				slice = std::min<uint64_t>(slice % 37 + 1, num_instr - done);
+			}
+			if (lc86_status status = cpu_run_instructions(cpu, slice); status != lc86_status::timeout) {
+				printf("Emulation terminated with status %d. The error was \"%s\"\n", static_cast<int32_t>(status), get_last_error().c_str());
+				return false;
+			}
+		}
+
+		if (cpu_get_instr_count(cpu) != num_instr) {
+			printf("Run %d executed %llu instructions instead of %llu\n", run, static_cast<unsigned long long>(cpu_get_instr_count(cpu)),
+				static_cast<unsigned long long>(num_instr));
+			return false;
+		}
+
+		end_regs[run] = *get_regs_ptr(cpu);
+		end_eflags[run] = read_eflags(cpu);
+		cpu_free(cpu);
+		cpu = nullptr;
+	}
+
+	const regs_t &one = end_regs[0], &many = end_regs[1];
+	if ((one.eax != many.eax) || (one.ecx != many.ecx) || (one.edx != many.edx) || (one.ebx != many.ebx) || (one.esp != many.esp) || (one.ebp != many.ebp) ||
+		(one.esi != many.esi) || (one.edi != many.edi) || (one.eip != many.eip) || (end_eflags[0] != end_eflags[1])) {
+		printf("The runs diverged: eax 0x%X/0x%X, ebx 0x%X/0x%X, ebp 0x%X/0x%X, esi 0x%X/0x%X, edi 0x%X/0x%X, eip 0x%X/0x%X, eflags 0x%X/0x%X\n",
+			one.eax, many.eax, one.ebx, many.ebx, one.ebp, many.ebp, one.esi, many.esi, one.edi, many.edi, one.eip, many.eip, end_eflags[0], end_eflags[1]);
+		return false;
+	}
+
+	if ((one.esi == 0) || (one.ebp == 0)) {
+		printf("The guest code didn't run its loop\n");
+		return false;
+	}
+
+	printf("Both runs executed %llu instructions and ended in the same state\n", static_cast<unsigned long long>(num_instr));
+	return true;
+}
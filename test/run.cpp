@@ -17,7 +17,7 @@ print_help()
 options: \n\
 -i         Use Intel syntax (default is AT&T)\n\
 -d         Start with debugger\n\
--t <num>   Run a test specified by num\n\
+-t <num>   Run a test specified by num (5 to 10 are benchmarks)\n\
 -h         Print this message\n";
 
 	printf("%s", help);
@@ -160,6 +160,69 @@ main(int argc, char **argv)
 		gen_test80186_test(executable, intel_syntax, use_dbg);
 		return 0;
 
+	case 5:
+		if (gen_loop_bench(executable) == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 6:
+		if (gen_lookup_bench() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 7:
+		if (gen_throw_bench() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 8:
+		if (gen_fault_bench() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 9:
+		if (gen_warm_boot_bench(executable) == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 10:
+		if (gen_timer_bench() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
+	case 11:
+		if (gen_lockstep_test() == false) {
+			if (cpu) {
+				cpu_free(cpu);
+			}
+			return 1;
+		}
+		return 0;
+
 	default:
 		printf("Unknown test option specified\n");
 		return 1;
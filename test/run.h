@@ -12,3 +12,10 @@ bool gen_hook_test();
 bool gen_dbg_test();
 bool gen_cxbxrkrnl_test(const std::string &executable);
 void gen_test80186_test(const std::string &path, int intel_syntax, int use_dbg);
+bool gen_loop_bench(const std::string &executable);
+bool gen_lookup_bench();
+bool gen_throw_bench();
+bool gen_fault_bench();
+bool gen_warm_boot_bench(const std::string &executable);
+bool gen_timer_bench();
+bool gen_lockstep_test();